@@ -1,6 +1,58 @@
 #include "CNVR.h"
+#include "MapCodec.h"
 
 #include <cstdarg>
+#include <chrono>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define MAX_MAPPED_DMB 1024
+
+// Per-view map container (maps.cvm): a header and an index table in the first
+// page, followed by one page-aligned section per layer. A layer is named after
+// the .dmb file it replaces, e.g. "depths_geom" for depths_geom.dmb.
+#define MAP_CONTAINER_NAME "maps.cvm"
+#define MAP_CONTAINER_MAGIC 0x4D564E43 // "CNVM"
+#define MAP_CONTAINER_VERSION 1
+#define MAP_CONTAINER_MAX_LAYERS 16
+#define MAP_CONTAINER_ALIGNMENT 4096
+#define MAP_LAYER_FLOAT32 1
+#define MAP_LAYER_UINT32 2
+#define MAP_LAYER_FP16 3
+#define MAP_LAYER_OCT16 4
+
+#define JBU_RANGE_LUT_STEPS 16 // range weights per intensity level of the guide
+#define JBU_TILE_ROWS 16 // output rows upsampled by one host thread at a time
+
+struct MapContainerHeader {
+    int32_t magic;
+    int32_t version;
+    int32_t num_layers;
+    int32_t reserved;
+};
+
+struct MapLayerEntry {
+    char name[24];
+    int32_t type;
+    int32_t rows;
+    int32_t cols;
+    int32_t channels;
+    uint64_t offset; // page aligned, from the start of the file
+    uint64_t capacity; // bytes reserved for the section
+};
+
+static MapStorageParams map_storage_params;
+static int writeContainerLayer(const std::string &file_path, const int type, const cv::Mat &mat);
+static int writeDmbFile(const std::string &file_path, const int type, const cv::Mat &mat);
 
 void StringAppendV(std::string* dst, const char* format, va_list ap) {
   // First try with a small fixed size buffer.
@@ -96,57 +148,251 @@ void CudaCheckError(const char* file, const int line) {
   }
 }
 
-CNVR::CNVR() {}
+#define WORKSPACE_ALIGNMENT 256
+#define HUGE_PAGE_SIZE (2 << 20)
 
-CNVR::~CNVR()
+static double ElapsedMs(const std::chrono::steady_clock::time_point &start)
 {
-    delete[] plane_hypotheses_host;
-    delete[] costs_host;
-    //delete[] normal_costs_host;
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
 
-    for (int i = 0; i < num_images; ++i) {
-        cudaDestroyTextureObject(texture_objects_host.images[i]);
-        cudaFreeArray(cuArray[i]);
-    }
-    cudaFree(texture_objects_cuda);
-    cudaFree(cameras_cuda);
-    cudaFree(plane_hypotheses_cuda);
-    cudaFree(pre_plane_hypotheses_cuda);
-    cudaFree(costs_cuda);
-    //cudaFree(normal_costs_cuda);
-    cudaFree(pre_costs_cuda);
-    cudaFree(rand_states_cuda);
-    cudaFree(selected_views_cuda);
-    cudaFree(depths_cuda);
-    cudaFree(normals0_cuda);
-    cudaFree(normals1_cuda);
-    cudaFree(normals2_cuda);
+// Huge pages are requested explicitly first (MAP_HUGETLB, MEM_LARGE_PAGES),
+// then transparent huge pages are advised on an ordinary mapping.
+static void *AllocateHostPages(const size_t bytes, bool &huge_pages)
+{
+    huge_pages = false;
+#ifdef _WIN32
+    const size_t large_page = GetLargePageMinimum();
+    if (large_page > 0 && bytes % large_page == 0) {
+        void *data = VirtualAlloc(NULL, bytes, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+        if (data) {
+            huge_pages = true;
+            return data;
+        }
+    }
+    return VirtualAlloc(NULL, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+    void *data;
+#ifdef MAP_HUGETLB
+    data = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (data != MAP_FAILED) {
+        huge_pages = true;
+        return data;
+    }
+#endif
+    data = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+#ifdef MADV_HUGEPAGE
+    huge_pages = madvise(data, bytes, MADV_HUGEPAGE) == 0;
+#endif
+    return data;
+#endif
+}
 
-    if (params.geom_consistency) {
-        for (int i = 0; i < num_images; ++i) {
-            cudaDestroyTextureObject(texture_depths_host.images[i]);
-            cudaDestroyTextureObject(texture_normals0_host.images[i]);
-            cudaDestroyTextureObject(texture_normals1_host.images[i]);
-            cudaDestroyTextureObject(texture_normals2_host.images[i]);
-            cudaFreeArray(cuDepthArray[i]);
-            cudaFreeArray(cuNormal0Array[i]);
-            cudaFreeArray(cuNormal1Array[i]);
-            cudaFreeArray(cuNormal2Array[i]);
+static void FreeHostPages(void *data, const size_t bytes)
+{
+#ifdef _WIN32
+    VirtualFree(data, 0, MEM_RELEASE);
+#else
+    munmap(data, bytes);
+#endif
+}
+
+WorkspaceArena::WorkspaceArena(const bool device) : num_requests(0), num_allocations(0), allocation_ms(0.0), capacity(0), device(device) {}
+
+WorkspaceArena::~WorkspaceArena()
+{
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        FreeBlock(blocks[i]);
+    }
+}
+
+void WorkspaceArena::AllocateBlock(const size_t bytes)
+{
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    Block block;
+    block.size = (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    block.used = 0;
+    block.pinned = false;
+    block.huge_pages = false;
+    if (device) {
+        CUDA_SAFE_CALL(cudaMalloc((void**)&block.data, block.size));
+    }
+    else {
+        block.data = (char*)AllocateHostPages(block.size, block.huge_pages);
+        if (!block.data) {
+            std::cout << "Failed to allocate " << block.size << " bytes of host workspace" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        // Page-locked memory makes the host-device copies faster.
+        block.pinned = cudaHostRegister(block.data, block.size, cudaHostRegisterDefault) == cudaSuccess;
+    }
+    blocks.push_back(block);
+    capacity += block.size;
+    num_allocations++;
+    allocation_ms += ElapsedMs(start);
+}
+
+// Whether every host block is backed by huge pages.
+bool WorkspaceArena::UsesHugePages() const
+{
+    if (device || blocks.empty()) {
+        return false;
+    }
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        if (!blocks[i].huge_pages) {
+            return false;
         }
-        cudaFree(texture_depths_cuda);
-        cudaFree(texture_normals0_cuda);
-        cudaFree(texture_normals1_cuda);
-        cudaFree(texture_normals2_cuda);
     }
+    return true;
+}
 
-    if (params.hierarchy) {
-        delete[] scaled_plane_hypotheses_host;
-        delete[] pre_costs_host;
+void WorkspaceArena::FreeBlock(Block &block)
+{
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (device) {
+        cudaFree(block.data);
+    }
+    else {
+        if (block.pinned) {
+            cudaHostUnregister(block.data);
+        }
+        FreeHostPages(block.data, block.size);
+    }
+    capacity -= block.size;
+    allocation_ms += ElapsedMs(start);
+}
+
+void *WorkspaceArena::Allocate(const size_t bytes)
+{
+    num_requests++;
+    const size_t aligned = (bytes + WORKSPACE_ALIGNMENT - 1) / WORKSPACE_ALIGNMENT * WORKSPACE_ALIGNMENT;
+    if (blocks.empty() || blocks.back().used + aligned > blocks.back().size) {
+        AllocateBlock(std::max(aligned, blocks.empty() ? (size_t)0 : blocks.back().size));
+    }
+    Block &block = blocks.back();
+    void *data = block.data + block.used;
+    block.used += aligned;
+    return data;
+}
+
+void WorkspaceArena::Reset()
+{
+    if (blocks.size() > 1) {
+        // Merge into one block large enough for everything the last problem used.
+        size_t total = 0;
+        for (size_t i = 0; i < blocks.size(); ++i) {
+            total += blocks[i].size;
+            FreeBlock(blocks[i]);
+        }
+        blocks.clear();
+        AllocateBlock(total);
+    }
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        blocks[i].used = 0;
+    }
+}
+
+CNVRWorkspace::CNVRWorkspace() : host_arena(false), device_arena(true), num_texture_requests(0), num_texture_allocations(0), texture_allocation_ms(0.0)
+{
+    memset(arrays, 0, sizeof(arrays));
+    memset(textures, 0, sizeof(textures));
+    memset(array_sizes, 0, sizeof(array_sizes));
+    memset(array_types, 0, sizeof(array_types));
+}
+
+CNVRWorkspace::~CNVRWorkspace()
+{
+    for (int k = 0; k < WORKSPACE_TEXTURE_KINDS; ++k) {
+        for (int i = 0; i < MAX_IMAGES; ++i) {
+            if (arrays[k][i]) {
+                cudaDestroyTextureObject(textures[k][i]);
+                cudaFreeArray(arrays[k][i]);
+            }
+        }
+    }
+}
+
+void CNVRWorkspace::Reset()
+{
+    host_arena.Reset();
+    device_arena.Reset();
+}
+
+// Copies an image into the cached array of the slot. The array and its
+// texture object are only recreated when the image size or type changes, since
+// the wrap addressing depends on the array extent. Packed geometry maps (CV_32SC2)
+// become uint2 textures read without filtering, uint8 images are read as
+// normalized floats and fp16 images as floats.
+cudaTextureObject_t CNVRWorkspace::UploadTexture(const int kind, const int index, const cv::Mat &image)
+{
+    num_texture_requests++;
+    const int rows = image.rows;
+    const int cols = image.cols;
+    const int type = image.type();
+    if (!arrays[kind][index] || array_sizes[kind][index].x != cols || array_sizes[kind][index].y != rows || array_types[kind][index] != type) {
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        if (arrays[kind][index]) {
+            cudaDestroyTextureObject(textures[kind][index]);
+            cudaFreeArray(arrays[kind][index]);
+        }
+        const bool packed = type == CV_32SC2;
+        cudaChannelFormatDesc channelDesc = cudaCreateChannelDesc(32, 0, 0, 0, cudaChannelFormatKindFloat);
+        if (packed) {
+            channelDesc = cudaCreateChannelDesc(32, 32, 0, 0, cudaChannelFormatKindUnsigned);
+        }
+        else if (type == CV_8UC1) {
+            channelDesc = cudaCreateChannelDesc(8, 0, 0, 0, cudaChannelFormatKindUnsigned);
+        }
+        else if (type == CV_16FC1) {
+            channelDesc = cudaCreateChannelDescHalf();
+        }
+        cudaMallocArray(&arrays[kind][index], &channelDesc, cols, rows);
+
+        struct cudaResourceDesc resDesc;
+        memset(&resDesc, 0, sizeof(cudaResourceDesc));
+        resDesc.resType = cudaResourceTypeArray;
+        resDesc.res.array.array = arrays[kind][index];
+
+        struct cudaTextureDesc texDesc;
+        memset(&texDesc, 0, sizeof(cudaTextureDesc));
+        texDesc.addressMode[0] = cudaAddressModeWrap;
+        texDesc.addressMode[1] = cudaAddressModeWrap;
+        texDesc.filterMode = packed ? cudaFilterModePoint : cudaFilterModeLinear;
+        texDesc.readMode  = type == CV_8UC1 ? cudaReadModeNormalizedFloat : cudaReadModeElementType;
+        texDesc.normalizedCoords = 0;
 
-        cudaFree(scaled_plane_hypotheses_cuda);
-        cudaFree(pre_costs_cuda);
+        cudaCreateTextureObject(&textures[kind][index], &resDesc, &texDesc, NULL);
+        array_sizes[kind][index] = make_int2(cols, rows);
+        array_types[kind][index] = type;
+        num_texture_allocations++;
+        texture_allocation_ms += ElapsedMs(start);
     }
-    //std::cout << "CNVR destructor" << std::endl;
+    cudaMemcpy2DToArray(arrays[kind][index], 0, 0, image.ptr(), image.step[0], cols * image.elemSize(), rows, cudaMemcpyHostToDevice);
+    return textures[kind][index];
+}
+
+void CNVRWorkspace::PrintStats() const
+{
+    const size_t num_requests = host_arena.num_requests + device_arena.num_requests + num_texture_requests;
+    const size_t num_allocations = host_arena.num_allocations + device_arena.num_allocations + num_texture_allocations;
+    const double allocation_ms = host_arena.allocation_ms + device_arena.allocation_ms + texture_allocation_ms;
+    // Each request used to be a separate allocation and free. Not measured: the
+    // estimate charges every avoided request the mean time of the allocations made.
+    const double estimated_saved_ms = num_allocations > 0 ? allocation_ms / num_allocations * (num_requests - num_allocations) : 0.0;
+    std::cout << "Workspace: " << num_allocations << " allocations for " << num_requests << " requests, "
+              << allocation_ms << " ms allocating, estimated " << estimated_saved_ms << " ms saved (mean allocation time x avoided requests)" << std::endl;
+    std::cout << "Workspace: " << host_arena.capacity / (1 << 20) << " MB host" << (host_arena.UsesHugePages() ? " (huge pages)" : "")
+              << ", " << device_arena.capacity / (1 << 20) << " MB device" << std::endl;
+}
+
+CNVR::CNVR(CNVRWorkspace &workspace) : workspace(workspace), pass_changed_pixels(0.0), pass_cost_improvement(0.0), pass_pixels(0.0) {}
+
+CNVR::~CNVR()
+{
+    // All buffers belong to the workspace and are reused by the next problem.
 }
 
 Camera ReadCamera(const std::string &cam_path)
@@ -176,6 +422,316 @@ Camera ReadCamera(const std::string &cam_path)
     return camera;
 }
 
+bool ReadImageSize(const std::string &image_path, int &width, int &height)
+{
+    // Parse the SOF marker of a JPEG file so the pixels need not be decoded.
+    FILE *inimage = fopen(image_path.c_str(), "rb");
+    if (!inimage) {
+        std::cout << "Error opening file " << image_path << std::endl;
+        return false;
+    }
+
+    bool found = false;
+    unsigned char header[2];
+    if (fread(header, 1, 2, inimage) == 2 && header[0] == 0xFF && header[1] == 0xD8) {
+        while (!found) {
+            int c = fgetc(inimage);
+            if (c != 0xFF) {
+                break;
+            }
+            int marker = fgetc(inimage);
+            while (marker == 0xFF) {
+                marker = fgetc(inimage);
+            }
+            if (marker == EOF || marker == 0xD9 || marker == 0xDA) {
+                break;
+            }
+            if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+                continue;
+            }
+            unsigned char length_bytes[2];
+            if (fread(length_bytes, 1, 2, inimage) != 2) {
+                break;
+            }
+            const int length = (length_bytes[0] << 8) | length_bytes[1];
+            if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+                unsigned char sof[5];
+                if (fread(sof, 1, 5, inimage) != 5) {
+                    break;
+                }
+                height = (sof[1] << 8) | sof[2];
+                width = (sof[3] << 8) | sof[4];
+                found = true;
+            }
+            else if (fseek(inimage, length - 2, SEEK_CUR) != 0) {
+                break;
+            }
+        }
+    }
+    fclose(inimage);
+
+    if (!found) {
+        cv::Mat image = cv::imread(image_path, cv::IMREAD_UNCHANGED);
+        if (image.empty()) {
+            return false;
+        }
+        width = image.cols;
+        height = image.rows;
+    }
+    return true;
+}
+
+#define SCENE_MANIFEST_NAME "scene.bin"
+#define SCENE_MANIFEST_MAGIC 0x4D534E43 // "CNSM"
+#define SCENE_MANIFEST_VERSION 1
+
+struct SceneManifestHeader {
+    int32_t magic;
+    int32_t version;
+    int32_t num_views;
+    int32_t num_pairs;
+    FileStamp pair_stamp;
+};
+
+struct SceneManifest {
+    MappedFile file;
+    std::vector<char> buffer; // used when the manifest cannot be written
+    const SceneManifestHeader *header = NULL;
+    const SceneView *views = NULL;
+    const ScenePair *pairs = NULL;
+    std::vector<int> view_index; // image id -> view
+};
+static SceneManifest scene_manifest;
+
+static FileStamp GetFileStamp(const std::string &file_path)
+{
+    FileStamp stamp;
+    stamp.size = -1;
+    stamp.mtime = 0;
+#ifdef _WIN32
+    struct _stat64 info;
+    if (_stat64(file_path.c_str(), &info) == 0) {
+#else
+    struct stat info;
+    if (stat(file_path.c_str(), &info) == 0) {
+#endif
+        stamp.size = (int64_t)info.st_size;
+        stamp.mtime = (int64_t)info.st_mtime;
+    }
+    return stamp;
+}
+
+static bool SameStamp(const FileStamp &a, const FileStamp &b)
+{
+    return a.size >= 0 && a.size == b.size && a.mtime == b.mtime;
+}
+
+static std::string SceneCamPath(const std::string &dense_folder, const int image_id)
+{
+    std::stringstream cam_path;
+    cam_path << dense_folder << "/cams/" << std::setw(8) << std::setfill('0') << image_id << "_cam.txt";
+    return cam_path.str();
+}
+
+static std::string SceneImagePath(const std::string &dense_folder, const int image_id)
+{
+    std::stringstream image_path;
+    image_path << dense_folder << "/images/" << std::setw(8) << std::setfill('0') << image_id << ".jpg";
+    return image_path.str();
+}
+
+static bool BuildSceneManifest(const std::string &dense_folder, std::vector<char> &buffer)
+{
+    const std::string pair_path = dense_folder + std::string("/pair.txt");
+    std::ifstream file(pair_path);
+    if (!file) {
+        std::cout << "Error opening file " << pair_path << std::endl;
+        return false;
+    }
+
+    SceneManifestHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = SCENE_MANIFEST_MAGIC;
+    header.version = SCENE_MANIFEST_VERSION;
+    header.pair_stamp = GetFileStamp(pair_path);
+
+    int num_images = 0;
+    file >> num_images;
+    std::vector<SceneView> views(std::max(num_images, 0));
+    std::vector<ScenePair> pairs;
+    for (int i = 0; i < num_images; ++i) {
+        SceneView &view = views[i];
+        memset(&view, 0, sizeof(view));
+        file >> view.image_id >> view.num_pairs;
+        view.first_pair = (int32_t)pairs.size();
+        for (int j = 0; j < view.num_pairs; ++j) {
+            ScenePair pair;
+            file >> pair.image_id >> pair.score;
+            pairs.push_back(pair);
+        }
+        if (!file) {
+            std::cout << "Error parsing " << pair_path << std::endl;
+            return false;
+        }
+    }
+    header.num_views = (int32_t)views.size();
+    header.num_pairs = (int32_t)pairs.size();
+
+    // Cameras and image headers are independent, parse them in parallel.
+    bool valid = true;
+#pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < (int)views.size(); ++i) {
+        SceneView &view = views[i];
+        const std::string cam_path = SceneCamPath(dense_folder, view.image_id);
+        const std::string image_path = SceneImagePath(dense_folder, view.image_id);
+        view.cam_stamp = GetFileStamp(cam_path);
+        view.image_stamp = GetFileStamp(image_path);
+        const Camera camera = ReadCamera(cam_path);
+        memcpy(view.R, camera.R, sizeof(view.R));
+        memcpy(view.t, camera.t, sizeof(view.t));
+        memcpy(view.K, camera.K, sizeof(view.K));
+        view.depth_min = camera.depth_min;
+        view.depth_max = camera.depth_max;
+        if (view.cam_stamp.size < 0 || !ReadImageSize(image_path, view.width, view.height)) {
+#pragma omp critical
+            valid = false;
+        }
+    }
+    if (!valid) {
+        return false;
+    }
+
+    const size_t views_size = views.size() * sizeof(SceneView);
+    const size_t pairs_size = pairs.size() * sizeof(ScenePair);
+    buffer.resize(sizeof(header) + views_size + pairs_size);
+    memcpy(buffer.data(), &header, sizeof(header));
+    if (views_size > 0) {
+        memcpy(buffer.data() + sizeof(header), views.data(), views_size);
+    }
+    if (pairs_size > 0) {
+        memcpy(buffer.data() + sizeof(header) + views_size, pairs.data(), pairs_size);
+    }
+    return true;
+}
+
+static bool ParseSceneManifest(const char *data, const size_t size)
+{
+    const SceneManifestHeader *header = (const SceneManifestHeader*)data;
+    if (data == NULL || size < sizeof(SceneManifestHeader) || header->magic != SCENE_MANIFEST_MAGIC ||
+        header->version != SCENE_MANIFEST_VERSION || header->num_views < 0 || header->num_pairs < 0 ||
+        size != sizeof(SceneManifestHeader) + header->num_views * sizeof(SceneView) + header->num_pairs * sizeof(ScenePair)) {
+        return false;
+    }
+    scene_manifest.header = header;
+    scene_manifest.views = (const SceneView*)(data + sizeof(SceneManifestHeader));
+    scene_manifest.pairs = (const ScenePair*)(data + sizeof(SceneManifestHeader) + header->num_views * sizeof(SceneView));
+
+    scene_manifest.view_index.clear();
+    for (int i = 0; i < header->num_views; ++i) {
+        const SceneView &view = scene_manifest.views[i];
+        if (view.image_id < 0 || view.first_pair < 0 || view.num_pairs < 0 || view.first_pair + view.num_pairs > header->num_pairs) {
+            return false;
+        }
+        if (view.image_id >= (int)scene_manifest.view_index.size()) {
+            scene_manifest.view_index.resize(view.image_id + 1, -1);
+        }
+        scene_manifest.view_index[view.image_id] = i;
+    }
+    return true;
+}
+
+static bool IsSceneManifestCurrent(const std::string &dense_folder)
+{
+    if (!SameStamp(scene_manifest.header->pair_stamp, GetFileStamp(dense_folder + std::string("/pair.txt")))) {
+        return false;
+    }
+    for (int i = 0; i < scene_manifest.header->num_views; ++i) {
+        const SceneView &view = scene_manifest.views[i];
+        if (!SameStamp(view.cam_stamp, GetFileStamp(SceneCamPath(dense_folder, view.image_id))) ||
+            !SameStamp(view.image_stamp, GetFileStamp(SceneImagePath(dense_folder, view.image_id)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool LoadSceneManifest(const std::string &dense_folder)
+{
+    const std::string manifest_path = dense_folder + "/" + SCENE_MANIFEST_NAME;
+    if (scene_manifest.file.Open(manifest_path) && ParseSceneManifest(scene_manifest.file.data, scene_manifest.file.size) &&
+        IsSceneManifestCurrent(dense_folder)) {
+        return true;
+    }
+    scene_manifest.file.Close();
+
+    std::cout << "Building scene manifest " << manifest_path << std::endl;
+    std::vector<char> &buffer = scene_manifest.buffer;
+    if (!BuildSceneManifest(dense_folder, buffer)) {
+        return false;
+    }
+
+    // Write to a temporary file first, so concurrent readers never see a partial manifest.
+    const std::string temp_path = manifest_path + ".tmp";
+    FILE *outfile = fopen(temp_path.c_str(), "wb");
+    bool written = outfile && fwrite(buffer.data(), 1, buffer.size(), outfile) == buffer.size();
+    if (outfile) {
+        written = (fclose(outfile) == 0) && written;
+    }
+#ifdef _WIN32
+    remove(manifest_path.c_str());
+#endif
+    if (written && rename(temp_path.c_str(), manifest_path.c_str()) == 0 && scene_manifest.file.Open(manifest_path) &&
+        ParseSceneManifest(scene_manifest.file.data, scene_manifest.file.size)) {
+        std::vector<char>().swap(buffer);
+        return true;
+    }
+    std::cout << "Could not store " << manifest_path << ", keeping the scene manifest in memory" << std::endl;
+    scene_manifest.file.Close();
+    return ParseSceneManifest(buffer.data(), buffer.size());
+}
+
+int GetNumSceneViews()
+{
+    return scene_manifest.header ? scene_manifest.header->num_views : 0;
+}
+
+const SceneView &GetSceneView(const int index)
+{
+    return scene_manifest.views[index];
+}
+
+const SceneView *FindSceneView(const int image_id)
+{
+    if (image_id < 0 || image_id >= (int)scene_manifest.view_index.size() || scene_manifest.view_index[image_id] < 0) {
+        return NULL;
+    }
+    return &scene_manifest.views[scene_manifest.view_index[image_id]];
+}
+
+const ScenePair *GetScenePairs(const SceneView &view)
+{
+    return scene_manifest.pairs + view.first_pair;
+}
+
+Camera GetSceneCamera(const int image_id)
+{
+    Camera camera;
+    const SceneView *view = FindSceneView(image_id);
+    if (view == NULL) {
+        std::cout << "Image " << image_id << " is not in the scene manifest" << std::endl;
+        memset(&camera, 0, sizeof(camera));
+        return camera;
+    }
+    memcpy(camera.R, view->R, sizeof(camera.R));
+    memcpy(camera.t, view->t, sizeof(camera.t));
+    memcpy(camera.K, view->K, sizeof(camera.K));
+    camera.width = view->width;
+    camera.height = view->height;
+    camera.depth_min = view->depth_min;
+    camera.depth_max = view->depth_max;
+    return camera;
+}
+
 void  RescaleImageAndCamera(cv::Mat_<cv::Vec3b> &src, cv::Mat_<cv::Vec3b> &dst, cv::Mat_<float> &depth, Camera &camera)
 {
     const int cols = depth.cols;
@@ -250,126 +806,696 @@ float GetAngle( const cv::Vec3f &v1, const cv::Vec3f &v2 )
 
 int readDepthDmb(const std::string file_path, cv::Mat_<float> &depth)
 {
-    FILE *inimage;
-    inimage = fopen(file_path.c_str(), "rb");
-    if (!inimage){
-        std::cout << "Error opening file " << file_path << std::endl;
-        return -1;
-    }
-
-    int32_t type, h, w, nb;
-
-    type = -1;
-
-    fread(&type,sizeof(int32_t),1,inimage);
-    fread(&h,sizeof(int32_t),1,inimage);
-    fread(&w,sizeof(int32_t),1,inimage);
-    fread(&nb,sizeof(int32_t),1,inimage);
-
-    if (type != 1) {
-        fclose(inimage);
+    cv::Mat_<float> mapped_depth;
+    MappedFileHandle handle;
+    if (mapDepthDmb(file_path, mapped_depth, handle) != 0) {
         return -1;
     }
-
-    int32_t dataSize = h*w*nb;
-    depth = cv::Mat::zeros(h, w, CV_32F);
-    fread(depth.data, sizeof(float), dataSize, inimage);
-    fclose(inimage);
+    depth = mapped_depth.clone();
     return 0;
 }
 
-int writeDepthDmb(const std::string file_path, const cv::Mat_<float> depth)
+int writeDepthDmb(const std::string file_path, const cv::Mat_<float> depth, const bool allow_quantized)
 {
-    FILE *outimage;
-    outimage = fopen(file_path.c_str(), "wb");
-    if (!outimage) {
-        std::cout << "Error opening file " << file_path << std::endl;
+    const int type = (map_storage_params.quantized && allow_quantized) ? MAP_LAYER_FP16 : MAP_LAYER_FLOAT32;
+    if (map_storage_params.container) {
+        return writeContainerLayer(file_path, type, depth);
     }
-
-    int32_t type = 1;
-    int32_t h = depth.rows;
-    int32_t w = depth.cols;
-    int32_t nb = 1;
-
-    fwrite(&type,sizeof(int32_t),1,outimage);
-    fwrite(&h,sizeof(int32_t),1,outimage);
-    fwrite(&w,sizeof(int32_t),1,outimage);
-    fwrite(&nb,sizeof(int32_t),1,outimage);
-
-    float* data = (float*)depth.data;
-
-    int32_t datasize = w*h*nb;
-    fwrite(data,sizeof(float),datasize,outimage);
-
-    fclose(outimage);
-    return 0;
+    return writeDmbFile(file_path, type, depth);
 }
 
 int readNormalDmb (const std::string file_path, cv::Mat_<cv::Vec3f> &normal)
 {
-    FILE *inimage;
-    inimage = fopen(file_path.c_str(), "rb");
-    if (!inimage) {
-        std::cout << "Error opening file " << file_path << std::endl;
+    cv::Mat_<cv::Vec3f> mapped_normal;
+    MappedFileHandle handle;
+    if (mapNormalDmb(file_path, mapped_normal, handle) != 0) {
         return -1;
     }
+    normal = mapped_normal.clone();
+    return 0;
+}
 
-    int32_t type, h, w, nb;
-
-    type = -1;
-
-    fread(&type,sizeof(int32_t),1,inimage);
-    fread(&h,sizeof(int32_t),1,inimage);
-    fread(&w,sizeof(int32_t),1,inimage);
-    fread(&nb,sizeof(int32_t),1,inimage);
-
-    if (type != 1) {
-        fclose(inimage);
-        return -1;
+int writeNormalDmb(const std::string file_path, const cv::Mat_<cv::Vec3f> normal, const bool allow_quantized)
+{
+    const int type = (map_storage_params.quantized && allow_quantized) ? MAP_LAYER_OCT16 : MAP_LAYER_FLOAT32;
+    if (map_storage_params.container) {
+        return writeContainerLayer(file_path, type, normal);
     }
+    return writeDmbFile(file_path, type, normal);
+}
 
-    int32_t dataSize = h*w*nb;
+MappedFile::MappedFile() : data(NULL), size(0)
+{
+#ifdef _WIN32
+    file_handle = INVALID_HANDLE_VALUE;
+    mapping_handle = NULL;
+#endif
+}
 
-    normal = cv::Mat::zeros(h, w, CV_32FC3);
-    fread(normal.data, sizeof(float), dataSize, inimage);
+MappedFile::~MappedFile()
+{
+    Close();
+}
 
-    fclose(inimage);
-    return 0;
+void MappedFile::Close()
+{
+#ifdef _WIN32
+    if (data) {
+        UnmapViewOfFile(data);
+    }
+    if (mapping_handle) {
+        CloseHandle(mapping_handle);
+    }
+    if (file_handle != INVALID_HANDLE_VALUE) {
+        CloseHandle(file_handle);
+    }
+    file_handle = INVALID_HANDLE_VALUE;
+    mapping_handle = NULL;
+#else
+    if (data) {
+        munmap(data, size);
+    }
+#endif
+    data = NULL;
+    size = 0;
 }
 
-int writeNormalDmb(const std::string file_path, const cv::Mat_<cv::Vec3f> normal)
+bool MappedFile::Open(const std::string &file_path)
 {
-    FILE *outimage;
-    outimage = fopen(file_path.c_str(), "wb");
-    if (!outimage) {
-        std::cout << "Error opening file " << file_path << std::endl;
+    Close();
+#ifdef _WIN32
+    file_handle = CreateFileA(file_path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file_handle == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file_handle, &file_size) || file_size.QuadPart == 0) {
+        return false;
+    }
+    mapping_handle = CreateFileMappingA(file_handle, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+    if (!mapping_handle) {
+        return false;
+    }
+    data = (char*)MapViewOfFile(mapping_handle, FILE_MAP_COPY, 0, 0, 0);
+    if (!data) {
+        return false;
+    }
+    size = (size_t)file_size.QuadPart;
+#else
+    int fd = open(file_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+        close(fd);
+        return false;
     }
+    void *mapped = mmap(NULL, file_stat.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        return false;
+    }
+    data = (char*)mapped;
+    size = file_stat.st_size;
+#endif
+    return true;
+}
 
-    int32_t type = 1; //float
-    int32_t h = normal.rows;
-    int32_t w = normal.cols;
-    int32_t nb = 3;
+struct MappedDmbEntry {
+    MappedFileHandle handle;
+    uint64_t last_use;
+};
 
-    fwrite(&type,sizeof(int32_t),1,outimage);
-    fwrite(&h,sizeof(int32_t),1,outimage);
-    fwrite(&w,sizeof(int32_t),1,outimage);
-    fwrite(&nb,sizeof(int32_t),1,outimage);
+static std::mutex mapped_dmb_mutex;
+static std::map<std::string, MappedDmbEntry> mapped_dmb_cache;
+static uint64_t mapped_dmb_clock = 0;
 
-    float* data = (float*)normal.data;
+static MappedFileHandle GetDmbMapping(const std::string &file_path)
+{
+    std::lock_guard<std::mutex> lock(mapped_dmb_mutex);
+    std::map<std::string, MappedDmbEntry>::iterator it = mapped_dmb_cache.find(file_path);
+    if (it != mapped_dmb_cache.end()) {
+        it->second.last_use = ++mapped_dmb_clock;
+        return it->second.handle;
+    }
 
-    int32_t datasize = w*h*nb;
-    fwrite(data,sizeof(float),datasize,outimage);
+    MappedFileHandle handle = std::make_shared<MappedFile>();
+    if (!handle->Open(file_path)) {
+        return MappedFileHandle();
+    }
 
-    fclose(outimage);
-    return 0;
+    if (mapped_dmb_cache.size() >= MAX_MAPPED_DMB) {
+        std::map<std::string, MappedDmbEntry>::iterator oldest = mapped_dmb_cache.begin();
+        for (it = mapped_dmb_cache.begin(); it != mapped_dmb_cache.end(); ++it) {
+            if (it->second.last_use < oldest->second.last_use) {
+                oldest = it;
+            }
+        }
+        mapped_dmb_cache.erase(oldest);
+    }
+    MappedDmbEntry entry;
+    entry.handle = handle;
+    entry.last_use = ++mapped_dmb_clock;
+    mapped_dmb_cache[file_path] = entry;
+    return handle;
 }
 
-void StoreColorPlyFileBinaryPointCloud (const std::string &plyFilePath, const std::vector<PointList> &pc)
+void releaseDmbMapping(const std::string file_path)
 {
-    std::cout << "store 3D points to ply file" << std::endl;
+    std::lock_guard<std::mutex> lock(mapped_dmb_mutex);
+    mapped_dmb_cache.erase(file_path);
+}
 
-    FILE *outputPly;
-    outputPly=fopen(plyFilePath.c_str(), "wb");
+void SetMapStorageParams(const MapStorageParams &storage_params)
+{
+    map_storage_params = storage_params;
+}
+
+const MapStorageParams &GetMapStorageParams()
+{
+    return map_storage_params;
+}
+
+// Splits ".../2333_00000000/depths.dmb" into the container path of the folder and the layer name.
+static bool SplitDmbPath(const std::string &file_path, std::string &container_path, std::string &layer)
+{
+    const size_t slash = file_path.find_last_of("/\\");
+    const std::string folder = (slash == std::string::npos) ? std::string(".") : file_path.substr(0, slash);
+    const std::string file_name = (slash == std::string::npos) ? file_path : file_path.substr(slash + 1);
+    if (file_name.size() <= 4 || file_name.compare(file_name.size() - 4, 4, ".dmb") != 0) {
+        return false;
+    }
+    layer = file_name.substr(0, file_name.size() - 4);
+    if (layer.size() >= sizeof(((MapLayerEntry*)0)->name)) {
+        return false;
+    }
+    container_path = folder + "/" + MAP_CONTAINER_NAME;
+    return true;
+}
+
+// Depth bits and a 16-bit octahedral normal code per pixel, the geometric
+// consistency costs read both with one fetch. A zero normal gets the code
+// 0x80008000, which no unit normal produces.
+static cv::Mat PackGeometry(const cv::Mat_<float> &depth, const cv::Mat_<cv::Vec3f> &normal)
+{
+    cv::Mat_<cv::Vec2i> geometry(depth.rows, depth.cols);
+    for (int r = 0; r < depth.rows; ++r) {
+        for (int c = 0; c < depth.cols; ++c) {
+            const cv::Vec3f &n = normal(r, c);
+            uint32_t code = 0x80008000u;
+            int oct[2];
+            if (EncodeOctNormal(n, 32767.0f, oct)) {
+                code = (uint32_t)(uint16_t)(int16_t)oct[0] | ((uint32_t)(uint16_t)(int16_t)oct[1] << 16);
+            }
+            memcpy(&geometry(r, c)[0], &depth(r, c), sizeof(float));
+            memcpy(&geometry(r, c)[1], &code, sizeof(uint32_t));
+        }
+    }
+    return geometry;
+}
+
+static uint64_t MapPayloadSize(const int type, const int rows, const int cols, const int channels)
+{
+    const uint64_t num_values = (uint64_t)rows * (uint64_t)cols * (uint64_t)channels;
+    if (type == MAP_LAYER_FLOAT32 || type == MAP_LAYER_UINT32) {
+        return num_values * 4;
+    }
+    if (type == MAP_LAYER_FP16) {
+        return 2 * sizeof(float) + num_values * sizeof(uint16_t);
+    }
+    if (type == MAP_LAYER_OCT16 && channels == 3) {
+        return (uint64_t)rows * (uint64_t)cols * 2;
+    }
+    return 0;
+}
+
+// Float maps can be read back from any float encoding, masks only as they are.
+static bool IsCompatibleLayer(const int type, const int expected_type, const int channels)
+{
+    if (expected_type == MAP_LAYER_UINT32) {
+        return type == MAP_LAYER_UINT32;
+    }
+    return type == MAP_LAYER_FLOAT32 || type == MAP_LAYER_FP16 || (type == MAP_LAYER_OCT16 && channels == 3);
+}
+
+static void EncodeMap(const cv::Mat &mat, const int type, std::vector<char> &payload)
+{
+    const cv::Mat values = mat.isContinuous() ? mat : mat.clone();
+    const size_t num_values = values.total() * values.channels();
+    payload.resize(MapPayloadSize(type, values.rows, values.cols, values.channels()));
+
+    if (type == MAP_LAYER_FLOAT32 || type == MAP_LAYER_UINT32) {
+        memcpy(payload.data(), values.data, payload.size());
+    }
+    else if (type == MAP_LAYER_FP16) {
+        const float *data = (const float*)values.data;
+        float lower = FLT_MAX;
+        float upper = -FLT_MAX;
+        for (size_t i = 0; i < num_values; ++i) {
+            if (std::isfinite(data[i]) && data[i] != 0.0f) {
+                lower = std::min(lower, data[i]);
+                upper = std::max(upper, data[i]);
+            }
+        }
+        if (lower > upper) {
+            lower = upper = 0.0f;
+        }
+        const float scale = (upper > lower) ? (upper - lower) : 1.0f;
+        memcpy(payload.data(), &lower, sizeof(float));
+        memcpy(payload.data() + sizeof(float), &scale, sizeof(float));
+        uint16_t *halfs = (uint16_t*)(payload.data() + 2 * sizeof(float));
+        for (size_t i = 0; i < num_values; ++i) {
+            halfs[i] = EncodeRangeHalf(data[i], lower, scale);
+        }
+    }
+    else if (type == MAP_LAYER_OCT16) {
+        const cv::Vec3f *normals = (const cv::Vec3f*)values.data;
+        int8_t *codes = (int8_t*)payload.data();
+        for (size_t i = 0; i < values.total(); ++i) {
+            int oct[2];
+            EncodeOctNormal(normals[i], 127.0f, oct);
+            codes[2 * i] = (int8_t)oct[0];
+            codes[2 * i + 1] = (int8_t)oct[1];
+        }
+    }
+}
+
+static void DecodeMap(const char *payload, const int type, const int rows, const int cols, const int channels, cv::Mat &mat)
+{
+    mat.create(rows, cols, CV_MAKETYPE(CV_32F, channels));
+    const size_t num_pixels = mat.total();
+    if (type == MAP_LAYER_FP16) {
+        float lower, scale;
+        memcpy(&lower, payload, sizeof(float));
+        memcpy(&scale, payload + sizeof(float), sizeof(float));
+        const uint16_t *halfs = (const uint16_t*)(payload + 2 * sizeof(float));
+        float *data = (float*)mat.data;
+        for (size_t i = 0; i < num_pixels * channels; ++i) {
+            data[i] = DecodeRangeHalf(halfs[i], lower, scale);
+        }
+    }
+    else if (type == MAP_LAYER_OCT16) {
+        const int8_t *codes = (const int8_t*)payload;
+        cv::Vec3f *normals = (cv::Vec3f*)mat.data;
+        for (size_t i = 0; i < num_pixels; ++i) {
+            normals[i] = DecodeOctNormal(codes + 2 * i);
+        }
+    }
+}
+
+// Wraps the payload of a layer: raw layers stay in the mapping, quantized ones are decoded into owned memory.
+static void ViewMapPayload(const char *payload, const int type, const int rows, const int cols, const int channels, cv::Mat &mat, MappedFileHandle &handle)
+{
+    if (type == MAP_LAYER_FLOAT32 || type == MAP_LAYER_UINT32) {
+        const int depth = (type == MAP_LAYER_UINT32) ? CV_32S : CV_32F;
+        mat = cv::Mat(rows, cols, CV_MAKETYPE(depth, channels), (void*)payload);
+        return;
+    }
+    DecodeMap(payload, type, rows, cols, channels, mat);
+    handle.reset();
+}
+
+static int mapDmbFile(const std::string &file_path, const int expected_type, const int expected_nb, cv::Mat &mat, MappedFileHandle &handle)
+{
+    handle = GetDmbMapping(file_path);
+    if (!handle) {
+        return -1;
+    }
+
+    const size_t header_size = 4 * sizeof(int32_t);
+    if (handle->size < header_size) {
+        std::cout << "Truncated dmb header in " << file_path << std::endl;
+        handle.reset();
+        return -1;
+    }
+    const int32_t *header = (const int32_t*)handle->data;
+    const int32_t type = header[0];
+    const int32_t h = header[1];
+    const int32_t w = header[2];
+    const int32_t nb = header[3];
+    if (!IsCompatibleLayer(type, expected_type, nb) || h <= 0 || w <= 0 || nb != expected_nb) {
+        std::cout << "Unexpected dmb header in " << file_path << std::endl;
+        handle.reset();
+        return -1;
+    }
+    const uint64_t data_size = MapPayloadSize(type, h, w, nb);
+    if (handle->size < header_size + data_size) {
+        std::cout << "Truncated dmb data in " << file_path << std::endl;
+        handle.reset();
+        return -1;
+    }
+
+    ViewMapPayload(handle->data + header_size, type, h, w, nb, mat, handle);
+    return 0;
+}
+
+static int mapContainerLayer(const std::string &container_path, const std::string &layer, const int expected_type, const int expected_channels, cv::Mat &mat, MappedFileHandle &handle)
+{
+    handle = GetDmbMapping(container_path);
+    if (!handle) {
+        return -1;
+    }
+
+    const size_t index_size = sizeof(MapContainerHeader) + MAP_CONTAINER_MAX_LAYERS * sizeof(MapLayerEntry);
+    const MapContainerHeader *header = (const MapContainerHeader*)handle->data;
+    if (handle->size < index_size || header->magic != MAP_CONTAINER_MAGIC || header->version != MAP_CONTAINER_VERSION ||
+        header->num_layers < 0 || header->num_layers > MAP_CONTAINER_MAX_LAYERS) {
+        std::cout << "Invalid map container " << container_path << std::endl;
+        handle.reset();
+        return -1;
+    }
+
+    const MapLayerEntry *entries = (const MapLayerEntry*)(handle->data + sizeof(MapContainerHeader));
+    for (int i = 0; i < header->num_layers; ++i) {
+        const MapLayerEntry &entry = entries[i];
+        if (strncmp(entry.name, layer.c_str(), sizeof(entry.name)) != 0) {
+            continue;
+        }
+        const uint64_t data_size = MapPayloadSize(entry.type, entry.rows, entry.cols, entry.channels);
+        if (!IsCompatibleLayer(entry.type, expected_type, entry.channels) || entry.channels != expected_channels || entry.rows <= 0 || entry.cols <= 0 ||
+            entry.offset % MAP_CONTAINER_ALIGNMENT != 0 || data_size > entry.capacity || entry.offset + data_size > handle->size) {
+            std::cout << "Invalid layer " << layer << " in " << container_path << std::endl;
+            break;
+        }
+        ViewMapPayload(handle->data + entry.offset, entry.type, entry.rows, entry.cols, entry.channels, mat, handle);
+        return 0;
+    }
+    handle.reset();
+    return -1;
+}
+
+// Paths queued in an AsyncMapWriter, readers wait until they are written.
+static std::mutex pending_writes_mutex;
+static std::condition_variable pending_writes_done;
+static std::multiset<std::string> pending_writes;
+
+// In container mode every layer of a folder is written into the same file,
+// so writes are tracked per container: a reader of any layer must not see
+// the index while another layer is being rewritten.
+static std::string PendingWriteKey(const std::string &file_path)
+{
+    std::string container_path, layer;
+    if (map_storage_params.container && SplitDmbPath(file_path, container_path, layer)) {
+        return container_path;
+    }
+    return file_path;
+}
+
+static void WaitForPendingWrite(const std::string &file_path)
+{
+    const std::string key = PendingWriteKey(file_path);
+    std::unique_lock<std::mutex> lock(pending_writes_mutex);
+    pending_writes_done.wait(lock, [&]() { return pending_writes.count(key) == 0; });
+}
+
+static int mapDmb(const std::string &file_path, const int expected_type, const int expected_nb, cv::Mat &mat, MappedFileHandle &handle)
+{
+    WaitForPendingWrite(file_path);
+
+    // The active storage is looked up first, the other one keeps old results readable.
+    std::string container_path, layer;
+    const bool has_layer = SplitDmbPath(file_path, container_path, layer);
+    if (map_storage_params.container && has_layer && mapContainerLayer(container_path, layer, expected_type, expected_nb, mat, handle) == 0) {
+        return 0;
+    }
+    if (mapDmbFile(file_path, expected_type, expected_nb, mat, handle) == 0) {
+        return 0;
+    }
+    if (!map_storage_params.container && has_layer && mapContainerLayer(container_path, layer, expected_type, expected_nb, mat, handle) == 0) {
+        return 0;
+    }
+    std::cout << "Error opening file " << file_path << std::endl;
+    return -1;
+}
+
+int mapDepthDmb(const std::string file_path, cv::Mat_<float> &depth, MappedFileHandle &handle)
+{
+    cv::Mat mat;
+    if (mapDmb(file_path, MAP_LAYER_FLOAT32, 1, mat, handle) != 0) {
+        return -1;
+    }
+    depth = mat;
+    return 0;
+}
+
+int mapNormalDmb(const std::string file_path, cv::Mat_<cv::Vec3f> &normal, MappedFileHandle &handle)
+{
+    cv::Mat mat;
+    if (mapDmb(file_path, MAP_LAYER_FLOAT32, 3, mat, handle) != 0) {
+        return -1;
+    }
+    normal = mat;
+    return 0;
+}
+
+int mapMaskDmb(const std::string file_path, cv::Mat_<int> &mask, MappedFileHandle &handle)
+{
+    cv::Mat mat;
+    if (mapDmb(file_path, MAP_LAYER_UINT32, 1, mat, handle) != 0) {
+        return -1;
+    }
+    mask = mat;
+    return 0;
+}
+
+int writeMaskDmb(const std::string file_path, const cv::Mat_<int> mask)
+{
+    if (map_storage_params.container) {
+        return writeContainerLayer(file_path, MAP_LAYER_UINT32, mask);
+    }
+    return writeDmbFile(file_path, MAP_LAYER_UINT32, mask);
+}
+
+static bool SeekFile(FILE *file, const uint64_t offset)
+{
+#ifdef _WIN32
+    return _fseeki64(file, (__int64)offset, SEEK_SET) == 0;
+#else
+    return fseeko(file, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+// Writes one layer into the container of the folder. A layer that still fits
+// into its section is overwritten in place, otherwise it moves to a new
+// section at the end of the file; the other layers are left untouched.
+static int writeContainerLayer(const std::string &file_path, const int type, const cv::Mat &mat)
+{
+    std::string container_path, layer;
+    if (!SplitDmbPath(file_path, container_path, layer)) {
+        std::cout << "Invalid layer path " << file_path << std::endl;
+        return -1;
+    }
+    releaseDmbMapping(container_path);
+
+    MapContainerHeader header;
+    MapLayerEntry entries[MAP_CONTAINER_MAX_LAYERS];
+    memset(&header, 0, sizeof(header));
+    memset(entries, 0, sizeof(entries));
+
+    FILE *outimage = fopen(container_path.c_str(), "r+b");
+    bool valid = false;
+    if (outimage) {
+        valid = fread(&header, sizeof(header), 1, outimage) == 1 &&
+                fread(entries, sizeof(entries), 1, outimage) == 1 &&
+                header.magic == MAP_CONTAINER_MAGIC && header.version == MAP_CONTAINER_VERSION &&
+                header.num_layers >= 0 && header.num_layers <= MAP_CONTAINER_MAX_LAYERS;
+        if (!valid) {
+            fclose(outimage);
+            outimage = NULL;
+        }
+    }
+    if (!valid) {
+        outimage = fopen(container_path.c_str(), "w+b");
+        if (!outimage) {
+            std::cout << "Error opening file " << container_path << std::endl;
+            return -1;
+        }
+        memset(&header, 0, sizeof(header));
+        memset(entries, 0, sizeof(entries));
+        header.magic = MAP_CONTAINER_MAGIC;
+        header.version = MAP_CONTAINER_VERSION;
+    }
+
+    std::vector<char> payload;
+    EncodeMap(mat, type, payload);
+    const uint64_t data_size = payload.size();
+    uint64_t end_of_sections = MAP_CONTAINER_ALIGNMENT;
+    int index = -1;
+    for (int i = 0; i < header.num_layers; ++i) {
+        end_of_sections = std::max(end_of_sections, entries[i].offset + entries[i].capacity);
+        if (strncmp(entries[i].name, layer.c_str(), sizeof(entries[i].name)) == 0) {
+            index = i;
+        }
+    }
+    if (index < 0) {
+        if (header.num_layers == MAP_CONTAINER_MAX_LAYERS) {
+            std::cout << "Too many layers in " << container_path << std::endl;
+            fclose(outimage);
+            return -1;
+        }
+        index = header.num_layers++;
+        strncpy(entries[index].name, layer.c_str(), sizeof(entries[index].name) - 1);
+        entries[index].capacity = 0;
+    }
+
+    MapLayerEntry &entry = entries[index];
+    if (entry.capacity < data_size) {
+        entry.offset = end_of_sections;
+        entry.capacity = (data_size + MAP_CONTAINER_ALIGNMENT - 1) / MAP_CONTAINER_ALIGNMENT * MAP_CONTAINER_ALIGNMENT;
+    }
+    entry.type = type;
+    entry.rows = mat.rows;
+    entry.cols = mat.cols;
+    entry.channels = mat.channels();
+
+    bool written = SeekFile(outimage, entry.offset) && fwrite(payload.data(), 1, payload.size(), outimage) == payload.size();
+    // The index goes last, so it never points at a section that was not written.
+    written = written && SeekFile(outimage, 0) &&
+              fwrite(&header, sizeof(header), 1, outimage) == 1 &&
+              fwrite(entries, sizeof(entries), 1, outimage) == 1;
+    fclose(outimage);
+    if (!written) {
+        std::cout << "Error writing layer " << layer << " to " << container_path << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+static int writeDmbFile(const std::string &file_path, const int type, const cv::Mat &mat)
+{
+    releaseDmbMapping(file_path);
+
+    FILE *outimage;
+    outimage = fopen(file_path.c_str(), "wb");
+    if (!outimage) {
+        std::cout << "Error opening file " << file_path << std::endl;
+        return -1;
+    }
+
+    std::vector<char> payload;
+    EncodeMap(mat, type, payload);
+    const int32_t header[4] = {type, mat.rows, mat.cols, mat.channels()};
+    const bool written = fwrite(header, sizeof(int32_t), 4, outimage) == 4 &&
+                         fwrite(payload.data(), 1, payload.size(), outimage) == payload.size();
+    fclose(outimage);
+    if (!written) {
+        std::cout << "Error writing file " << file_path << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+int ConvertDmbToContainer(const std::string &result_folder)
+{
+    const char *layers[] = {"depths", "normals", "costs", "depths_geom", "normals_geom"};
+    const int channels[] = {1, 3, 1, 1, 3};
+    // The geometric maps are read by the fusion and are never quantized.
+    const bool fused[] = {false, false, false, true, true};
+    int num_converted = 0;
+    for (int i = 0; i < 5; ++i) {
+        const std::string file_path = result_folder + "/" + layers[i] + ".dmb";
+        cv::Mat mat;
+        MappedFileHandle handle;
+        if (mapDmbFile(file_path, MAP_LAYER_FLOAT32, channels[i], mat, handle) != 0) {
+            continue;
+        }
+        int type = MAP_LAYER_FLOAT32;
+        if (map_storage_params.quantized && !fused[i]) {
+            type = (channels[i] == 3) ? MAP_LAYER_OCT16 : MAP_LAYER_FP16;
+        }
+        if (writeContainerLayer(file_path, type, mat) != 0) {
+            return -1;
+        }
+        num_converted++;
+    }
+    return num_converted;
+}
+
+AsyncMapWriter::AsyncMapWriter(const size_t max_jobs) : max_jobs(max_jobs), stopping(false)
+{
+    worker = std::thread(&AsyncMapWriter::Run, this);
+}
+
+AsyncMapWriter::~AsyncMapWriter()
+{
+    if (worker.joinable()) {
+        Finish();
+    }
+}
+
+void AsyncMapWriter::Enqueue(const std::vector<std::string> &file_paths, const std::function<int()> &write)
+{
+    {
+        std::lock_guard<std::mutex> lock(pending_writes_mutex);
+        for (size_t i = 0; i < file_paths.size(); ++i) {
+            pending_writes.insert(PendingWriteKey(file_paths[i]));
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(jobs_mutex);
+    jobs_changed.wait(lock, [&]() { return jobs.size() < max_jobs; });
+    WriteJob job;
+    job.file_paths = file_paths;
+    job.write = write;
+    jobs.push_back(job);
+    jobs_changed.notify_all();
+}
+
+void AsyncMapWriter::Run()
+{
+    while (true) {
+        WriteJob job;
+        {
+            std::unique_lock<std::mutex> lock(jobs_mutex);
+            jobs_changed.wait(lock, [&]() { return stopping || !jobs.empty(); });
+            if (jobs.empty()) {
+                return;
+            }
+            job = jobs.front();
+            jobs.pop_front();
+            jobs_changed.notify_all();
+        }
+
+        const int status = job.write();
+
+        if (status != 0) {
+            std::lock_guard<std::mutex> lock(jobs_mutex);
+            failed_paths.push_back(job.file_paths.empty() ? std::string() : job.file_paths[0]);
+        }
+        {
+            std::lock_guard<std::mutex> lock(pending_writes_mutex);
+            for (size_t i = 0; i < job.file_paths.size(); ++i) {
+                pending_writes.erase(pending_writes.find(PendingWriteKey(job.file_paths[i])));
+            }
+        }
+        pending_writes_done.notify_all();
+    }
+}
+
+int AsyncMapWriter::Finish()
+{
+    {
+        std::lock_guard<std::mutex> lock(jobs_mutex);
+        stopping = true;
+    }
+    jobs_changed.notify_all();
+    if (worker.joinable()) {
+        worker.join();
+    }
+
+    for (size_t i = 0; i < failed_paths.size(); ++i) {
+        std::cout << "Failed to write " << failed_paths[i] << std::endl;
+    }
+    return (int)failed_paths.size();
+}
+
+void StoreColorPlyFileBinaryPointCloud (const std::string &plyFilePath, const std::vector<PointList> &pc)
+{
+    std::cout << "store 3D points to ply file" << std::endl;
+
+    FILE *outputPly;
+    outputPly=fopen(plyFilePath.c_str(), "wb");
 
     /*write header*/
     fprintf(outputPly, "ply\n");
@@ -429,29 +1555,623 @@ static float GetDisparity(const Camera &camera, const int2 &p, const float &dept
     return std::sqrt(point3D[0] * point3D[0] + point3D[1] * point3D[1] + point3D[2] * point3D[2]);
 }
 
-void CNVR::SetGeomConsistencyParams(bool multi_gemetry=false)
-{
-    params.geom_consistency = true;
-    params.max_iterations = 2;
-    if (multi_gemetry) {
-       params.multi_geometry = true;
+void CNVR::SetGeomConsistencyParams(bool multi_gemetry=false)
+{
+    params.geom_consistency = true;
+    params.max_iterations = 2;
+    if (multi_gemetry) {
+       params.multi_geometry = true;
+    }
+}
+
+void CNVR::SetHierarchyParams()
+{
+    params.hierarchy = true;
+}
+
+void CNVR::SetRepairParams() {
+    params.repair = true;
+}
+
+void CNVR::SetNormalLambda(int iteration) {
+    params.normal_lambda = 2*iteration;
+}
+
+void CNVR::SetTileParams(const int budget_mb)
+{
+    params.tile_budget = budget_mb;
+}
+
+void CNVR::SetDepthBoundsParams()
+{
+    params.coarse_bounds = true;
+}
+
+void CNVR::SetSparsePriorParams()
+{
+    params.sparse_prior = true;
+}
+
+void CNVR::SetCostCacheParams(const int budget_mb)
+{
+    params.cost_cache_budget = budget_mb;
+}
+
+void CNVR::SetCascadeParams()
+{
+    params.cascade = true;
+}
+
+void CNVR::SetSourcePyramidParams()
+{
+    params.source_levels = MAX_SOURCE_LEVELS;
+}
+
+void CNVR::SetImageStorageParams(const int storage)
+{
+    params.image_storage = storage;
+    params.image_scale = storage == IMAGE_STORAGE_UINT8 ? 255.0f : 1.0f;
+}
+
+void CNVR::SetAdaptiveParams()
+{
+    params.adaptive = true;
+}
+
+static int MatchingImageType(const int storage)
+{
+    if (storage == IMAGE_STORAGE_UINT8) {
+        return CV_8UC1;
+    }
+    if (storage == IMAGE_STORAGE_HALF) {
+        return CV_16FC1;
+    }
+    return CV_32FC1;
+}
+
+static const char *MatchingImageName(const int storage)
+{
+    if (storage == IMAGE_STORAGE_UINT8) {
+        return "uint8";
+    }
+    if (storage == IMAGE_STORAGE_HALF) {
+        return "fp16";
+    }
+    return "float";
+}
+
+// Copy of a grayscale image in the storage type of the matching images, uint8 values are rounded.
+static cv::Mat ConvertMatchingImage(const cv::Mat &image, const int storage)
+{
+    cv::Mat converted;
+    image.convertTo(converted, MatchingImageType(storage));
+    return converted;
+}
+
+// Camera of the image region rect, with the principal point moved to its origin.
+static Camera CropCamera(const Camera &camera, const cv::Rect &rect)
+{
+    Camera cropped = camera;
+    cropped.K[2] -= rect.x;
+    cropped.K[5] -= rect.y;
+    cropped.width = rect.width;
+    cropped.height = rect.height;
+    return cropped;
+}
+
+// Size of an image scaled down to fit into max_image_size, false if it already fits.
+static bool GetScaledSize(const int cols, const int rows, const int max_image_size, int &new_cols, int &new_rows)
+{
+    new_cols = cols;
+    new_rows = rows;
+    if (cols <= max_image_size && rows <= max_image_size) {
+        return false;
+    }
+
+    const float factor_x = static_cast<float>(max_image_size) / cols;
+    const float factor_y = static_cast<float>(max_image_size) / rows;
+    const float factor = factor_x<factor_y? factor_x: factor_y;
+
+    new_cols = std::round(cols * factor);
+    new_rows = std::round(rows * factor);
+    return true;
+}
+
+static void ScaleCamera(Camera &camera, const int new_cols, const int new_rows)
+{
+    const float scale_x = new_cols / static_cast<float>(camera.width);
+    const float scale_y = new_rows / static_cast<float>(camera.height);
+
+    camera.K[0] *= scale_x;
+    camera.K[2] *= scale_x;
+    camera.K[4] *= scale_y;
+    camera.K[5] *= scale_y;
+    camera.height = new_rows;
+    camera.width = new_cols;
+}
+
+
+static void CreateFolder(const std::string &folder)
+{
+#if defined(_WIN32)
+    std::string command = "mkdir \"" + folder + "\"";
+    if (_access(folder.c_str(), 0) != 0) {
+        system(command.c_str());
+    }
+#else
+    mkdir(folder.c_str(), 0777);
+#endif
+}
+
+struct ColmapImage {
+    int camera_id;
+    std::string name;
+    double R[9];
+    double t[3];
+    std::vector<int> points; // indices into the point list
+};
+
+struct ColmapIntrinsics {
+    int width;
+    int height;
+    double fx, fy, cx, cy;
+};
+
+// Sequential reader over a mapped COLMAP model file.
+struct ColmapReader {
+    const char *data;
+    size_t size;
+    size_t pos;
+
+    template <typename T> bool Read(T &value)
+    {
+        if (pos + sizeof(T) > size) {
+            return false;
+        }
+        memcpy(&value, data + pos, sizeof(T));
+        pos += sizeof(T);
+        return true;
+    }
+
+    bool Skip(const size_t num_bytes)
+    {
+        if (pos + num_bytes > size) {
+            return false;
+        }
+        pos += num_bytes;
+        return true;
+    }
+};
+
+static bool ReadColmapCameras(const std::string &path, std::map<int, ColmapIntrinsics> &intrinsics)
+{
+    // Number of parameters per COLMAP camera model id; the models with a
+    // single focal length store (f, cx, cy, ...), the others (fx, fy, cx, cy, ...).
+    const int num_params[] = {3, 4, 4, 5, 8, 8, 12, 5, 4, 5, 12};
+    const bool single_focal[] = {true, false, true, true, false, false, false, false, true, true, false};
+
+    MappedFile file;
+    if (!file.Open(path)) {
+        std::cout << "Error opening file " << path << std::endl;
+        return false;
+    }
+    ColmapReader reader = {file.data, file.size, 0};
+    uint64_t num_cameras = 0;
+    if (!reader.Read(num_cameras)) {
+        return false;
+    }
+    for (uint64_t i = 0; i < num_cameras; ++i) {
+        int32_t camera_id, model_id;
+        uint64_t width, height;
+        if (!reader.Read(camera_id) || !reader.Read(model_id) || !reader.Read(width) || !reader.Read(height) ||
+            model_id < 0 || model_id > 10) {
+            std::cout << "Invalid camera in " << path << std::endl;
+            return false;
+        }
+        double params[12];
+        for (int k = 0; k < num_params[model_id]; ++k) {
+            if (!reader.Read(params[k])) {
+                return false;
+            }
+        }
+        if (model_id > 1) {
+            std::cout << "Camera " << camera_id << " is not undistorted, its distortion parameters are ignored" << std::endl;
+        }
+        ColmapIntrinsics camera;
+        camera.width = (int)width;
+        camera.height = (int)height;
+        if (single_focal[model_id]) {
+            camera.fx = camera.fy = params[0];
+            camera.cx = params[1];
+            camera.cy = params[2];
+        }
+        else {
+            camera.fx = params[0];
+            camera.fy = params[1];
+            camera.cx = params[2];
+            camera.cy = params[3];
+        }
+        intrinsics[camera_id] = camera;
+    }
+    return true;
+}
+
+static bool ReadColmapImages(const std::string &path, std::vector<std::pair<int, ColmapImage> > &images, std::vector<std::vector<int64_t> > &point_ids)
+{
+    MappedFile file;
+    if (!file.Open(path)) {
+        std::cout << "Error opening file " << path << std::endl;
+        return false;
+    }
+    ColmapReader reader = {file.data, file.size, 0};
+    uint64_t num_images = 0;
+    if (!reader.Read(num_images)) {
+        return false;
+    }
+    for (uint64_t i = 0; i < num_images; ++i) {
+        int32_t image_id;
+        double q[4];
+        ColmapImage image;
+        bool valid = reader.Read(image_id);
+        for (int k = 0; k < 4 && valid; ++k) {
+            valid = reader.Read(q[k]);
+        }
+        for (int k = 0; k < 3 && valid; ++k) {
+            valid = reader.Read(image.t[k]);
+        }
+        valid = valid && reader.Read(image.camera_id);
+        while (valid) {
+            char c;
+            valid = reader.Read(c);
+            if (!valid || c == '\0') {
+                break;
+            }
+            image.name.push_back(c);
+        }
+        uint64_t num_points2D = 0;
+        if (!valid || !reader.Read(num_points2D) || reader.pos + num_points2D * 24 > reader.size) {
+            std::cout << "Invalid image in " << path << std::endl;
+            return false;
+        }
+        std::vector<int64_t> ids;
+        for (uint64_t k = 0; k < num_points2D; ++k) {
+            int64_t point_id;
+            reader.Skip(2 * sizeof(double));
+            reader.Read(point_id);
+            if (point_id >= 0) {
+                ids.push_back(point_id);
+            }
+        }
+
+        // Rotation from the (w, x, y, z) quaternion.
+        image.R[0] = 1 - 2 * q[2] * q[2] - 2 * q[3] * q[3];
+        image.R[1] = 2 * q[1] * q[2] - 2 * q[0] * q[3];
+        image.R[2] = 2 * q[3] * q[1] + 2 * q[0] * q[2];
+        image.R[3] = 2 * q[1] * q[2] + 2 * q[0] * q[3];
+        image.R[4] = 1 - 2 * q[1] * q[1] - 2 * q[3] * q[3];
+        image.R[5] = 2 * q[2] * q[3] - 2 * q[0] * q[1];
+        image.R[6] = 2 * q[3] * q[1] - 2 * q[0] * q[2];
+        image.R[7] = 2 * q[2] * q[3] + 2 * q[0] * q[1];
+        image.R[8] = 1 - 2 * q[1] * q[1] - 2 * q[2] * q[2];
+        images.push_back(std::make_pair((int)image_id, image));
+        point_ids.push_back(ids);
+    }
+    return true;
+}
+
+static bool ReadColmapPoints(const std::string &path, std::unordered_map<int64_t, int> &point_index, std::vector<double> &xyz, std::vector<int> &track_offsets, std::vector<int> &track_images)
+{
+    MappedFile file;
+    if (!file.Open(path)) {
+        std::cout << "Error opening file " << path << std::endl;
+        return false;
+    }
+    ColmapReader reader = {file.data, file.size, 0};
+    uint64_t num_points = 0;
+    if (!reader.Read(num_points)) {
+        return false;
+    }
+    point_index.reserve(num_points);
+    xyz.reserve(3 * num_points);
+    track_offsets.reserve(num_points + 1);
+    track_offsets.push_back(0);
+    for (uint64_t i = 0; i < num_points; ++i) {
+        uint64_t point_id, track_length;
+        double position[3];
+        bool valid = reader.Read(point_id);
+        for (int k = 0; k < 3 && valid; ++k) {
+            valid = reader.Read(position[k]);
+        }
+        // rgb and reprojection error
+        valid = valid && reader.Skip(3 + sizeof(double)) && reader.Read(track_length) &&
+                reader.pos + track_length * 8 <= reader.size;
+        if (!valid) {
+            std::cout << "Invalid point in " << path << std::endl;
+            return false;
+        }
+        const size_t track_begin = track_images.size();
+        for (uint64_t k = 0; k < track_length; ++k) {
+            int32_t image_id, point2D_idx;
+            reader.Read(image_id);
+            reader.Read(point2D_idx);
+            track_images.push_back(image_id);
+        }
+        // An image observing a point twice still shares it only once.
+        std::sort(track_images.begin() + track_begin, track_images.end());
+        track_images.erase(std::unique(track_images.begin() + track_begin, track_images.end()), track_images.end());
+
+        point_index[(int64_t)point_id] = (int)(track_offsets.size() - 1);
+        xyz.push_back(position[0]);
+        xyz.push_back(position[1]);
+        xyz.push_back(position[2]);
+        track_offsets.push_back((int)track_images.size());
+    }
+    return true;
+}
+
+// Reads the sparse COLMAP model of colmap_folder (sparse/{cameras,images,points3D}.bin
+// next to the undistorted images/) and writes the CNVR input layout into
+// dense_folder: cams/%08d_cam.txt, pair.txt and images/%08d.jpg. The view
+// scores follow colmap2mvsnet_acm.py (number of shared points, zero if the
+// 75th percentile triangulation angle is below 1 degree), but only the pairs
+// that share a track are visited.
+bool CNVR::Colmap2MVS(const std::string &colmap_folder, const std::string &dense_folder, std::vector<Problem> &problems)
+{
+    const std::string model_folder = colmap_folder + std::string("/sparse");
+    std::map<int, ColmapIntrinsics> intrinsics;
+    std::vector<std::pair<int, ColmapImage> > colmap_images;
+    std::vector<std::vector<int64_t> > image_point_ids;
+    std::unordered_map<int64_t, int> point_index;
+    std::vector<double> xyz;
+    std::vector<int> track_offsets;
+    std::vector<int> track_images;
+    if (!ReadColmapCameras(model_folder + "/cameras.bin", intrinsics) ||
+        !ReadColmapImages(model_folder + "/images.bin", colmap_images, image_point_ids) ||
+        !ReadColmapPoints(model_folder + "/points3D.bin", point_index, xyz, track_offsets, track_images)) {
+        return false;
+    }
+
+    // Images are numbered in the order of their COLMAP ids.
+    std::vector<int> order(colmap_images.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        order[i] = (int)i;
+    }
+    std::sort(order.begin(), order.end(), [&](const int a, const int b) { return colmap_images[a].first < colmap_images[b].first; });
+    const int num_images = (int)order.size();
+    std::vector<ColmapImage> images(num_images);
+    std::unordered_map<int, int> image_index;
+    for (int i = 0; i < num_images; ++i) {
+        images[i] = colmap_images[order[i]].second;
+        image_index[colmap_images[order[i]].first] = i;
+        for (size_t k = 0; k < image_point_ids[order[i]].size(); ++k) {
+            std::unordered_map<int64_t, int>::const_iterator it = point_index.find(image_point_ids[order[i]][k]);
+            if (it != point_index.end()) {
+                images[i].points.push_back(it->second);
+            }
+        }
+        if (intrinsics.find(images[i].camera_id) == intrinsics.end()) {
+            std::cout << "Image " << images[i].name << " has no camera" << std::endl;
+            return false;
+        }
+    }
+    for (size_t k = 0; k < track_images.size(); ++k) {
+        std::unordered_map<int, int>::const_iterator it = image_index.find(track_images[k]);
+        track_images[k] = (it != image_index.end()) ? it->second : -1;
+    }
+    std::cout << "Read " << num_images << " images and " << track_offsets.size() - 1 << " points from " << model_folder << std::endl;
+
+    std::vector<double3> centers(num_images);
+    for (int i = 0; i < num_images; ++i) {
+        const ColmapImage &image = images[i];
+        centers[i].x = -(image.R[0] * image.t[0] + image.R[3] * image.t[1] + image.R[6] * image.t[2]);
+        centers[i].y = -(image.R[1] * image.t[0] + image.R[4] * image.t[1] + image.R[7] * image.t[2]);
+        centers[i].z = -(image.R[2] * image.t[0] + image.R[5] * image.t[1] + image.R[8] * image.t[2]);
+    }
+
+    const int num_selected_views = std::min(20, num_images - 1);
+    std::vector<std::vector<std::pair<int, float> > > view_selection(num_images);
+    std::vector<float4> depth_ranges(num_images);
+    bool valid = true;
+#pragma omp parallel
+    {
+        std::vector<std::vector<float> > pair_angles(num_images);
+        std::vector<int> covisible;
+#pragma omp for schedule(dynamic)
+        for (int i = 0; i < num_images; ++i) {
+            const ColmapImage &image = images[i];
+            std::vector<float> depths;
+            covisible.clear();
+            for (size_t k = 0; k < image.points.size(); ++k) {
+                const int point = image.points[k];
+                const double *p = &xyz[3 * point];
+                depths.push_back((float)(image.R[6] * p[0] + image.R[7] * p[1] + image.R[8] * p[2] + image.t[2]));
+
+                const double3 ray_i = make_double3(centers[i].x - p[0], centers[i].y - p[1], centers[i].z - p[2]);
+                const double norm_i = sqrt(ray_i.x * ray_i.x + ray_i.y * ray_i.y + ray_i.z * ray_i.z);
+                for (int t = track_offsets[point]; t < track_offsets[point + 1]; ++t) {
+                    const int j = track_images[t];
+                    if (j < 0 || j == i) {
+                        continue;
+                    }
+                    const double3 ray_j = make_double3(centers[j].x - p[0], centers[j].y - p[1], centers[j].z - p[2]);
+                    const double norm_j = sqrt(ray_j.x * ray_j.x + ray_j.y * ray_j.y + ray_j.z * ray_j.z);
+                    const double cos_angle = (ray_i.x * ray_j.x + ray_i.y * ray_j.y + ray_i.z * ray_j.z) / (norm_i * norm_j);
+                    if (pair_angles[j].empty()) {
+                        covisible.push_back(j);
+                    }
+                    pair_angles[j].push_back((float)(acos(std::max(-1.0, std::min(1.0, cos_angle))) * 180.0 / CV_PI));
+                }
+            }
+
+            if (depths.empty()) {
+#pragma omp critical
+                {
+                    std::cout << "Image " << image.name << " observes no points" << std::endl;
+                    valid = false;
+                }
+                continue;
+            }
+            // Relaxed depth range, 192 depth planes as in colmap2mvsnet_acm.py
+            std::sort(depths.begin(), depths.end());
+            const float depth_min = depths[(size_t)(depths.size() * 0.01)] * 0.75f;
+            const float depth_max = depths[(size_t)(depths.size() * 0.99)] * 1.25f;
+            depth_ranges[i] = make_float4(depth_min, (depth_max - depth_min) / 191.0f, 192.0f, depth_max);
+
+            std::vector<std::pair<int, float> > &selection = view_selection[i];
+            for (size_t k = 0; k < covisible.size(); ++k) {
+                std::vector<float> &angles = pair_angles[covisible[k]];
+                const size_t percentile = (size_t)(angles.size() * 0.75);
+                std::nth_element(angles.begin(), angles.begin() + percentile, angles.end());
+                const float score = (angles[percentile] < 1.0f) ? 0.0f : (float)angles.size();
+                selection.push_back(std::make_pair(covisible[k], score));
+                angles.clear();
+            }
+            const size_t num_selected = std::min(selection.size(), (size_t)std::max(num_selected_views, 0));
+            std::partial_sort(selection.begin(), selection.begin() + num_selected, selection.end(),
+                [](const std::pair<int, float> &a, const std::pair<int, float> &b) {
+                    return a.second > b.second || (a.second == b.second && a.first < b.first);
+                });
+            selection.resize(num_selected);
+        }
+    }
+    if (!valid) {
+        return false;
+    }
+
+    CreateFolder(dense_folder);
+    CreateFolder(dense_folder + std::string("/cams"));
+    CreateFolder(dense_folder + std::string("/images"));
+    CreateFolder(dense_folder + std::string("/points"));
+
+    const std::string pair_path = dense_folder + std::string("/pair.txt");
+    FILE *pair_file = fopen(pair_path.c_str(), "w");
+    if (!pair_file) {
+        std::cout << "Error opening file " << pair_path << std::endl;
+        return false;
+    }
+    fprintf(pair_file, "%d\n", num_images);
+    problems.clear();
+    for (int i = 0; i < num_images; ++i) {
+        Problem problem;
+        problem.ref_image_id = i;
+        fprintf(pair_file, "%d\n%d ", i, (int)view_selection[i].size());
+        for (size_t k = 0; k < view_selection[i].size(); ++k) {
+            fprintf(pair_file, "%d %d ", view_selection[i][k].first, (int)view_selection[i][k].second);
+            if (view_selection[i][k].second > 0.0f) {
+                problem.src_image_ids.push_back(view_selection[i][k].first);
+            }
+        }
+        fprintf(pair_file, "\n");
+        problems.push_back(problem);
+    }
+    fclose(pair_file);
+
+    int num_failed = 0;
+#pragma omp parallel for schedule(dynamic) reduction(+:num_failed)
+    for (int i = 0; i < num_images; ++i) {
+        const ColmapImage &image = images[i];
+        const ColmapIntrinsics &camera = intrinsics.find(image.camera_id)->second;
+        std::stringstream cam_path;
+        cam_path << dense_folder << "/cams/" << std::setw(8) << std::setfill('0') << i << "_cam.txt";
+        FILE *cam_file = fopen(cam_path.str().c_str(), "w");
+        if (!cam_file) {
+            num_failed++;
+            continue;
+        }
+        fprintf(cam_file, "extrinsic\n");
+        for (int r = 0; r < 3; ++r) {
+            fprintf(cam_file, "%.17g %.17g %.17g %.17g \n", image.R[3 * r], image.R[3 * r + 1], image.R[3 * r + 2], image.t[r]);
+        }
+        fprintf(cam_file, "0 0 0 1 \n\nintrinsic\n");
+        fprintf(cam_file, "%.17g 0 %.17g \n0 %.17g %.17g \n0 0 1 \n", camera.fx, camera.cx, camera.fy, camera.cy);
+        fprintf(cam_file, "\n%f %f %f %f\n", depth_ranges[i].x, depth_ranges[i].y, depth_ranges[i].z, depth_ranges[i].w);
+        fclose(cam_file);
+
+        // Sparse prior: the points seen in at least three views, projected into this one.
+        std::stringstream points_path;
+        points_path << dense_folder << "/points/" << std::setw(8) << std::setfill('0') << i << "_points.txt";
+        std::vector<float3> points;
+        for (size_t k = 0; k < image.points.size(); ++k) {
+            const int point = image.points[k];
+            if (track_offsets[point + 1] - track_offsets[point] < 3) {
+                continue;
+            }
+            const double *X = &xyz[3 * point];
+            const double x = image.R[0] * X[0] + image.R[1] * X[1] + image.R[2] * X[2] + image.t[0];
+            const double y = image.R[3] * X[0] + image.R[4] * X[1] + image.R[5] * X[2] + image.t[1];
+            const double z = image.R[6] * X[0] + image.R[7] * X[1] + image.R[8] * X[2] + image.t[2];
+            if (z <= 0.0) {
+                continue;
+            }
+            points.push_back(make_float3((float)(camera.fx * x / z + camera.cx), (float)(camera.fy * y / z + camera.cy), (float)z));
+        }
+        FILE *points_file = fopen(points_path.str().c_str(), "w");
+        if (!points_file) {
+            num_failed++;
+            continue;
+        }
+        fprintf(points_file, "%d\n", (int)points.size());
+        for (size_t k = 0; k < points.size(); ++k) {
+            fprintf(points_file, "%f %f %f\n", points[k].x, points[k].y, points[k].z);
+        }
+        fclose(points_file);
+
+        // JPEG images are copied, other formats are converted. Up to date copies are kept.
+        const std::string src_path = colmap_folder + "/images/" + image.name;
+        std::stringstream image_path;
+        image_path << dense_folder << "/images/" << std::setw(8) << std::setfill('0') << i << ".jpg";
+        const FileStamp src_stamp = GetFileStamp(src_path);
+        const FileStamp dst_stamp = GetFileStamp(image_path.str());
+        if (src_stamp.size < 0) {
+            std::cout << "Error opening file " << src_path << std::endl;
+            num_failed++;
+            continue;
+        }
+        if (dst_stamp.size >= 0 && dst_stamp.mtime >= src_stamp.mtime) {
+            continue;
+        }
+        const std::string extension = (image.name.size() >= 4) ? image.name.substr(image.name.size() - 4) : std::string();
+        if (extension == ".jpg" || extension == ".JPG") {
+            std::ifstream src(src_path, std::ios::binary);
+            std::ofstream dst(image_path.str(), std::ios::binary);
+            dst << src.rdbuf();
+            if (!dst) {
+                num_failed++;
+            }
+        }
+        else if (!cv::imwrite(image_path.str(), cv::imread(src_path, cv::IMREAD_COLOR))) {
+            num_failed++;
+        }
     }
+    if (num_failed > 0) {
+        std::cout << num_failed << " views of " << colmap_folder << " could not be converted" << std::endl;
+        return false;
+    }
+    std::cout << "Converted " << num_images << " views into " << dense_folder << std::endl;
+    return true;
 }
 
-void CNVR::SetHierarchyParams()
+// points/%08d_points.txt: the number of points, then one "x y depth" line per
+// point in the pixel coordinates of the original image.
+static bool ReadSparsePoints(const std::string &file_path, std::vector<float3> &points)
 {
-    params.hierarchy = true;
-}
-
-void CNVR::SetRepairParams() {
-    params.repair = true;
-}
-
-void CNVR::SetNormalLambda(int iteration) {
-    params.normal_lambda = 2*iteration;
+    std::ifstream file(file_path);
+    int num_points = 0;
+    if (!(file >> num_points)) {
+        return false;
+    }
+    points.clear();
+    points.reserve(num_points);
+    for (int i = 0; i < num_points; ++i) {
+        float3 point;
+        if (!(file >> point.x >> point.y >> point.z)) {
+            return false;
+        }
+        points.push_back(point);
+    }
+    return true;
 }
 
-
 void CNVR::InputInitialization(const std::string &dense_folder, const std::vector<Problem> &problems, const int idx)
 {
     images.clear();
@@ -459,289 +2179,226 @@ void CNVR::InputInitialization(const std::string &dense_folder, const std::vecto
     const Problem problem = problems[idx];
 
     std::string image_folder = dense_folder + std::string("/images");
-    std::string cam_folder = dense_folder + std::string("/cams");
 
     std::stringstream image_path;
     image_path << image_folder << "/" << std::setw(8) << std::setfill('0') << problem.ref_image_id << ".jpg";
     cv::Mat_<uint8_t> image_uint = cv::imread(image_path.str(), cv::IMREAD_GRAYSCALE);
     cv::Mat image_float;
     image_uint.convertTo(image_float, CV_32FC1);
-    images.push_back(image_float);
-    std::stringstream cam_path;
-    cam_path << cam_folder << "/" << std::setw(8) << std::setfill('0') << problem.ref_image_id << "_cam.txt";
-    Camera camera = ReadCamera(cam_path.str());
+    Camera camera = GetSceneCamera(problem.ref_image_id);
     camera.height = image_float.rows;
     camera.width = image_float.cols;
+
+    // Scale cameras and images
+    int new_cols, new_rows;
+    if (GetScaledSize(image_float.cols, image_float.rows, problem.cur_image_size, new_cols, new_rows)) {
+        cv::Mat_<float> scaled_image_float;
+        cv::resize(image_float, scaled_image_float, cv::Size(new_cols,new_rows), 0, 0, cv::INTER_LINEAR);
+        image_float = scaled_image_float;
+        ScaleCamera(camera, new_cols, new_rows);
+    }
+    images.push_back(ConvertMatchingImage(image_float, params.image_storage));
     cameras.push_back(camera);
 
+    sparse_points.clear();
+    if (params.sparse_prior && !params.geom_consistency && !params.hierarchy) {
+        std::stringstream points_path;
+        points_path << dense_folder << "/points/" << std::setw(8) << std::setfill('0') << problem.ref_image_id << "_points.txt";
+        if (ReadSparsePoints(points_path.str(), sparse_points)) {
+            const float scale_x = camera.width / static_cast<float>(image_uint.cols);
+            const float scale_y = camera.height / static_cast<float>(image_uint.rows);
+            for (size_t i = 0; i < sparse_points.size(); ++i) {
+                sparse_points[i].x *= scale_x;
+                sparse_points[i].y *= scale_y;
+            }
+        }
+        else {
+            std::cout << "No sparse prior in " << points_path.str() << std::endl;
+            sparse_points.clear();
+        }
+    }
+    view_crops.clear();
+    view_crops.push_back(cv::Rect(0, 0, camera.width, camera.height));
+
+    params.depth_min = cameras[0].depth_min*0.6;
+    params.depth_max = cameras[0].depth_max*1.4;
+    std::cout << "depthe range: " << params.depth_min << " " << params.depth_max << std::endl;
+
+    // Only the footprint of the reference frustum is converted and kept of each source view.
+    size_t num_source_pixels = 0;
+    size_t num_kept_pixels = 0;
     size_t num_src_images = problem.src_image_ids.size();
     for (size_t i = 0; i < num_src_images; ++i) {
         std::stringstream image_path;
         image_path << image_folder << "/" << std::setw(8) << std::setfill('0') << problem.src_image_ids[i] << ".jpg";
         cv::Mat_<uint8_t> image_uint = cv::imread(image_path.str(), cv::IMREAD_GRAYSCALE);
-        cv::Mat image_float;
-        image_uint.convertTo(image_float, CV_32FC1);
-        images.push_back(image_float);
-        std::stringstream cam_path;
-        cam_path << cam_folder << "/" << std::setw(8) << std::setfill('0') << problem.src_image_ids[i] << "_cam.txt";
-        Camera camera = ReadCamera(cam_path.str());
-        camera.height = image_float.rows;
-        camera.width = image_float.cols;
-        cameras.push_back(camera);
-    }
-
-    // Scale cameras and images
-    int max_image_size = problems[idx].cur_image_size;
-    for (size_t i = 0; i < images.size(); ++i) {
-        if (i > 0) {
-            max_image_size = problems[problem.src_image_ids[i - 1]].cur_image_size;
+        Camera camera = GetSceneCamera(problem.src_image_ids[i]);
+        camera.height = image_uint.rows;
+        camera.width = image_uint.cols;
+
+        const int max_image_size = problems[problem.src_image_ids[i]].cur_image_size;
+        const bool scaled = GetScaledSize(image_uint.cols, image_uint.rows, max_image_size, new_cols, new_rows);
+        if (scaled) {
+            ScaleCamera(camera, new_cols, new_rows);
         }
-
-        if (images[i].cols <= max_image_size && images[i].rows <= max_image_size) {
-            continue;
+        const cv::Rect footprint = ComputeSourceFootprint(cameras[0], camera);
+        cv::Mat image;
+        if (scaled) {
+            // The scaled grid does not line up with the original pixels, crop after resizing.
+            cv::Mat full_image_float;
+            cv::Mat_<float> scaled_image_float;
+            image_uint.convertTo(full_image_float, CV_32FC1);
+            cv::resize(full_image_float, scaled_image_float, cv::Size(new_cols,new_rows), 0, 0, cv::INTER_LINEAR);
+            image = ConvertMatchingImage(scaled_image_float(footprint), params.image_storage);
         }
-
-        const float factor_x = static_cast<float>(max_image_size) / images[i].cols;
-        const float factor_y = static_cast<float>(max_image_size) / images[i].rows;
-        const float factor = factor_x<factor_y? factor_x: factor_y;
-
-        const int new_cols = std::round(images[i].cols * factor);
-        const int new_rows = std::round(images[i].rows * factor);
-
-        const float scale_x = new_cols / static_cast<float>(images[i].cols);
-        const float scale_y = new_rows / static_cast<float>(images[i].rows);
-
-        cv::Mat_<float> scaled_image_float;
-        cv::resize(images[i], scaled_image_float, cv::Size(new_cols,new_rows), 0, 0, cv::INTER_LINEAR);
-        images[i] = scaled_image_float.clone();
-
-        cameras[i].K[0] *= scale_x;
-        cameras[i].K[2] *= scale_x;
-        cameras[i].K[4] *= scale_y;
-        cameras[i].K[5] *= scale_y;
-        cameras[i].height = scaled_image_float.rows;
-        cameras[i].width = scaled_image_float.cols;
+        else {
+            image = ConvertMatchingImage(image_uint(footprint), params.image_storage);
+        }
+        num_source_pixels += camera.width * camera.height;
+        num_kept_pixels += footprint.area();
+        images.push_back(image);
+        cameras.push_back(CropCamera(camera, footprint));
+        view_crops.push_back(footprint);
+    }
+    if (num_source_pixels > 0) {
+        std::cout << "source footprints: " << static_cast<int>(100.0 * num_kept_pixels / num_source_pixels + 0.5) << "% of the source pixels" << std::endl;
     }
-    params.depth_min = cameras[0].depth_min*0.6;
-    params.depth_max = cameras[0].depth_max*1.4;
-    std::cout << "depthe range: " << params.depth_min << " " << params.depth_max << std::endl;
     params.num_images = (int)images.size();
     std::cout << "num images: " << params.num_images << std::endl;
+    size_t num_image_pixels = 0;
+    for (size_t i = 0; i < images.size(); ++i) {
+        num_image_pixels += images[i].total();
+    }
+    std::cout << "matching images: " << (num_image_pixels * images[0].elemSize() >> 10) << " KB as " << MatchingImageName(params.image_storage)
+              << ", " << (num_image_pixels * sizeof(float) >> 10) << " KB as float" << std::endl;
     params.disparity_min = cameras[0].K[0] * params.baseline / params.depth_max;
     params.disparity_max = cameras[0].K[0] * params.baseline / params.depth_min;
 
     if (params.geom_consistency) {
-        depths.clear();
-        normals0.clear();
+        geometries.clear();
 
-        std::stringstream result_path;
-        result_path << dense_folder << "/CNVR" << "/2333_" << std::setw(8) << std::setfill('0') << problem.ref_image_id;
-        std::string result_folder = result_path.str();
-        std::string suffix = "/depths.dmb";
+        std::string depth_suffix = "/depths.dmb";
+        std::string normal_suffix = "/normals.dmb";
         if (params.multi_geometry) {
-            suffix = "/depths_geom.dmb";
+            depth_suffix = "/depths_geom.dmb";
+            normal_suffix = "/normals_geom.dmb";
         }
-        std::string depth_path = result_folder + suffix;
-        cv::Mat_<float> ref_depth;
-        readDepthDmb(depth_path, ref_depth);
-        depths.push_back(ref_depth);
-        for (size_t i = 0; i < num_src_images; ++i) {
+        for (size_t i = 0; i <= num_src_images; ++i) {
+            const int image_id = i == 0 ? problem.ref_image_id : problem.src_image_ids[i - 1];
             std::stringstream result_path;
-            result_path << dense_folder << "/CNVR" << "/2333_" << std::setw(8) << std::setfill('0') << problem.src_image_ids[i];
+            result_path << dense_folder << "/CNVR" << "/2333_" << std::setw(8) << std::setfill('0') << image_id;
             std::string result_folder = result_path.str();
-            std::string depth_path = result_folder + suffix;
             cv::Mat_<float> depth;
-            readDepthDmb(depth_path, depth);
-            depths.push_back(depth);
-        }
-        suffix = "/normals.dmb";
-        if (params.multi_geometry) {
-            suffix = "/normals_geom.dmb";
-        }
-        std::stringstream result_path_;
-        result_path_<< dense_folder << "/CNVR" << "/2333_" << std::setw(8) << std::setfill('0') << problem.ref_image_id;
-        std::string result_folder_ = result_path_.str();
-        std::string normal_path = result_folder_ + suffix;
-        cv::Mat_<cv::Vec3f> ref_normal;
-        readNormalDmb(normal_path, ref_normal);
-        std::vector<cv::Mat> channels;
-        cv::split(ref_normal, channels);
-        normals0.push_back(channels[0]);
-        normals1.push_back(channels[1]);
-        normals2.push_back(channels[2]);
-
-        for (size_t i = 0; i < num_src_images; ++i) {
-            std::stringstream result_path__;
-            result_path__ << dense_folder << "/CNVR" << "/2333_" << std::setw(8) << std::setfill('0') << problem.src_image_ids[i];
-            std::string result_folder__ = result_path__.str();
-            std::string normal_path = result_folder__ + suffix;
             cv::Mat_<cv::Vec3f> normal;
-            readNormalDmb(normal_path, normal);
-            std::vector<cv::Mat> channels_;
-            cv::split(normal, channels_);
-            normals0.push_back(channels_[0]);
-            normals1.push_back(channels_[1]);
-            normals2.push_back(channels_[2]);
+            MappedFileHandle depth_handle, normal_handle;
+            mapDepthDmb(result_folder + depth_suffix, depth, depth_handle);
+            mapNormalDmb(result_folder + normal_suffix, normal, normal_handle);
+            if (i == 0) {
+                geometries.push_back(PackGeometry(depth, normal));
+            }
+            else {
+                geometries.push_back(PackGeometry(depth(view_crops[i]), normal(view_crops[i])));
+            }
         }
-
     }
 }
 
 void CNVR::CudaSpaceInitialization(const std::string &dense_folder, const Problem &problem)
+{
+    ReferenceTile tile;
+    tile.rect = cv::Rect(0, 0, cameras[0].width, cameras[0].height);
+    tile.core = tile.rect;
+    CudaSpaceInitialization(dense_folder, problem, tile);
+    ReleaseInputMaps();
+}
+
+void CNVR::CudaSpaceInitialization(const std::string &dense_folder, const Problem &problem, const ReferenceTile &tile)
 {
     num_images = (int)images.size();
+    workspace.Reset();
+
+    // A tile only needs the part of each source view its frustum projects onto.
+    const bool tiled = tile.rect.width != cameras[0].width || tile.rect.height != cameras[0].height;
+    std::vector<cv::Rect> crops(num_images);
+    tile_cameras.resize(num_images);
+    crops[0] = tile.rect;
+    tile_cameras[0] = CropCamera(cameras[0], tile.rect);
+    for (int i = 1; i < num_images; ++i) {
+        crops[i] = tiled ? ComputeSourceFootprint(tile_cameras[0], cameras[i]) : cv::Rect(0, 0, cameras[i].width, cameras[i].height);
+        tile_cameras[i] = CropCamera(cameras[i], crops[i]);
+    }
 
     for (int i = 0; i < num_images; ++i) {
-        int rows = images[i].rows;
-        int cols = images[i].cols;
-
-        cudaChannelFormatDesc channelDesc = cudaCreateChannelDesc(32, 0, 0, 0, cudaChannelFormatKindFloat);
-        cudaMallocArray(&cuArray[i], &channelDesc, cols, rows);
-        cudaMemcpy2DToArray (cuArray[i], 0, 0, images[i].ptr<float>(), images[i].step[0], cols*sizeof(float), rows, cudaMemcpyHostToDevice);
-
-        struct cudaResourceDesc resDesc;
-        memset(&resDesc, 0, sizeof(cudaResourceDesc));
-        resDesc.resType = cudaResourceTypeArray;
-        resDesc.res.array.array = cuArray[i];
-
-        struct cudaTextureDesc texDesc;
-        memset(&texDesc, 0, sizeof(cudaTextureDesc));
-        texDesc.addressMode[0] = cudaAddressModeWrap;
-        texDesc.addressMode[1] = cudaAddressModeWrap;
-        texDesc.filterMode = cudaFilterModeLinear;
-        texDesc.readMode  = cudaReadModeElementType;
-        texDesc.normalizedCoords = 0;
-
-        cudaCreateTextureObject(&(texture_objects_host.images[i]), &resDesc, &texDesc, NULL);
+        texture_objects_host[0].images[i] = workspace.UploadTexture(0, i, images[i](crops[i]));
     }
-    cudaMalloc((void**)&texture_objects_cuda, sizeof(cudaTextureObjects));
-    cudaMemcpy(texture_objects_cuda, &texture_objects_host, sizeof(cudaTextureObjects), cudaMemcpyHostToDevice);
-
-    cudaMalloc((void**)&cameras_cuda, sizeof(Camera) * (num_images));
-    cudaMemcpy(cameras_cuda, &cameras[0], sizeof(Camera) * (num_images), cudaMemcpyHostToDevice);
-
-    plane_hypotheses_host = new float4[cameras[0].height * cameras[0].width];
-    cudaMalloc((void**)&plane_hypotheses_cuda, sizeof(float4) * (cameras[0].height * cameras[0].width));
-    cudaMalloc((void**)&pre_plane_hypotheses_cuda, sizeof(float4) * (cameras[0].height * cameras[0].width));
-
-    costs_host = new float[cameras[0].height * cameras[0].width];
-    cudaMalloc((void**)&costs_cuda, sizeof(float) * (cameras[0].height * cameras[0].width));
-    cudaMalloc((void**)&pre_costs_cuda, sizeof(float) * (cameras[0].height * cameras[0].width));
-
-    cudaMalloc((void**)&rand_states_cuda, sizeof(curandState) * (cameras[0].height * cameras[0].width));
-    cudaMalloc((void**)&selected_views_cuda, sizeof(unsigned int) * (cameras[0].height * cameras[0].width));
-
-    if (params.geom_consistency) {
-        for (int i = 0; i < num_images; ++i) {
-            int rows = depths[i].rows;
-            int cols = depths[i].cols;
-
-            cudaChannelFormatDesc channelDesc = cudaCreateChannelDesc(32, 0, 0, 0, cudaChannelFormatKindFloat);
-            cudaMallocArray(&cuDepthArray[i], &channelDesc, cols, rows);
-            cudaMemcpy2DToArray (cuDepthArray[i], 0, 0, depths[i].ptr<float>(), depths[i].step[0], cols*sizeof(float), rows, cudaMemcpyHostToDevice);
-
-            struct cudaResourceDesc resDesc;
-            memset(&resDesc, 0, sizeof(cudaResourceDesc));
-            resDesc.resType = cudaResourceTypeArray;
-            resDesc.res.array.array = cuDepthArray[i];
-
-            struct cudaTextureDesc texDesc;
-            memset(&texDesc, 0, sizeof(cudaTextureDesc));
-            texDesc.addressMode[0] = cudaAddressModeWrap;
-            texDesc.addressMode[1] = cudaAddressModeWrap;
-            texDesc.filterMode = cudaFilterModeLinear;
-            texDesc.readMode  = cudaReadModeElementType;
-            texDesc.normalizedCoords = 0;
-
-            cudaCreateTextureObject(&(texture_depths_host.images[i]), &resDesc, &texDesc, NULL);
-        }
-        cudaMalloc((void**)&texture_depths_cuda, sizeof(cudaTextureObjects));
-        cudaMemcpy(texture_depths_cuda, &texture_depths_host, sizeof(cudaTextureObjects), cudaMemcpyHostToDevice);
-
-        //normal map dim0
-        for (int i = 0; i < num_images; ++i) {
-            int rows = normals0[i].rows;
-            int cols = normals0[i].cols;
-
-
-            cudaChannelFormatDesc channelDesc = cudaCreateChannelDesc(32, 0, 0, 0, cudaChannelFormatKindFloat);
-            cudaMallocArray(&cuNormal0Array[i], &channelDesc, cols, rows);
-            cudaMemcpy2DToArray(cuNormal0Array[i], 0, 0, normals0[i].ptr<float>(), normals0[i].step[0], cols * sizeof(float), rows, cudaMemcpyHostToDevice);
-
-            struct cudaResourceDesc resDesc;
-            memset(&resDesc, 0, sizeof(cudaResourceDesc));
-            resDesc.resType = cudaResourceTypeArray;
-            resDesc.res.array.array = cuNormal0Array[i];
-
-            struct cudaTextureDesc texDesc;
-            memset(&texDesc, 0, sizeof(cudaTextureDesc));
-            texDesc.addressMode[0] = cudaAddressModeWrap;
-            texDesc.addressMode[1] = cudaAddressModeWrap;
-            texDesc.filterMode = cudaFilterModeLinear;
-            texDesc.readMode = cudaReadModeElementType;
-            texDesc.normalizedCoords = 0;
-
-            cudaCreateTextureObject(&(texture_normals0_host.images[i]), &resDesc, &texDesc, NULL);
+    // Coarser levels of the sources, level l lives in texture kind l + 1 after the geometry.
+    for (int i = 1; i < num_images; ++i) {
+        cv::Mat level_image = images[i](crops[i]);
+        for (int level = 1; level < params.source_levels; ++level) {
+            cv::Mat down;
+            if (level_image.depth() == CV_16F) {
+                // pyrDown has no fp16 kernel.
+                cv::Mat level_float;
+                level_image.convertTo(level_float, CV_32F);
+                cv::pyrDown(level_float, down);
+                down.convertTo(down, CV_16F);
+            }
+            else {
+                cv::pyrDown(level_image, down);
+            }
+            texture_objects_host[level].images[i] = workspace.UploadTexture(level + 1, i, down);
+            level_image = down;
         }
-        cudaMalloc((void**)&texture_normals0_cuda, sizeof(cudaTextureObjects));
-        cudaMemcpy(texture_normals0_cuda, &texture_normals0_host, sizeof(cudaTextureObjects), cudaMemcpyHostToDevice);
-
-        //normal map dim1
-        for (int i = 0; i < num_images; ++i) {
-            int rows = normals1[i].rows;
-            int cols = normals1[i].cols;
-
-
-            cudaChannelFormatDesc channelDesc = cudaCreateChannelDesc(32, 0, 0, 0, cudaChannelFormatKindFloat);
-            cudaMallocArray(&cuNormal1Array[i], &channelDesc, cols, rows);
-            cudaMemcpy2DToArray(cuNormal1Array[i], 0, 0, normals1[i].ptr<float>(), normals1[i].step[0], cols * sizeof(float), rows, cudaMemcpyHostToDevice);
-
-            struct cudaResourceDesc resDesc;
-            memset(&resDesc, 0, sizeof(cudaResourceDesc));
-            resDesc.resType = cudaResourceTypeArray;
-            resDesc.res.array.array = cuNormal1Array[i];
-
-            struct cudaTextureDesc texDesc;
-            memset(&texDesc, 0, sizeof(cudaTextureDesc));
-            texDesc.addressMode[0] = cudaAddressModeWrap;
-            texDesc.addressMode[1] = cudaAddressModeWrap;
-            texDesc.filterMode = cudaFilterModeLinear;
-            texDesc.readMode = cudaReadModeElementType;
-            texDesc.normalizedCoords = 0;
+    }
+    texture_objects_cuda = workspace.AllocateDevice<cudaTextureObjects>(params.source_levels);
+    cudaMemcpy(texture_objects_cuda, texture_objects_host, sizeof(cudaTextureObjects) * params.source_levels, cudaMemcpyHostToDevice);
+
+    cameras_cuda = workspace.AllocateDevice<Camera>(num_images);
+    cudaMemcpy(cameras_cuda, &tile_cameras[0], sizeof(Camera) * (num_images), cudaMemcpyHostToDevice);
+
+    const int num_pixels = tile_cameras[0].height * tile_cameras[0].width;
+    plane_hypotheses_host = workspace.AllocateHost<float4>(num_pixels);
+    plane_hypotheses_cuda = workspace.AllocateDevice<float4>(num_pixels);
+    pre_plane_hypotheses_cuda = workspace.AllocateDevice<float4>(num_pixels);
+
+    costs_host = workspace.AllocateHost<float>(num_pixels);
+    selected_views_host = workspace.AllocateHost<unsigned int>(num_pixels);
+    costs_cuda = workspace.AllocateDevice<float>(num_pixels);
+    pre_costs_cuda = workspace.AllocateDevice<float>(num_pixels);
+
+    rand_states_cuda = workspace.AllocateDevice<curandState>(num_pixels);
+    selected_views_cuda = workspace.AllocateDevice<unsigned int>(num_pixels);
+    cost_evaluations_cuda = workspace.AllocateDevice<unsigned long long>(1);
+    convergence_cuda = workspace.AllocateDevice<ConvergenceStats>(1);
+    ComputeTileVisibility();
+
+    // Photometric costs per source view, plus depth and normal costs in geom passes.
+    const size_t num_cached_costs = static_cast<size_t>(num_images - 1) * (params.geom_consistency ? 3 : 1);
+    const size_t cost_cache_bytes = num_pixels * (num_cached_costs * sizeof(float) + sizeof(float4));
+    params.cost_cache = params.cost_cache_budget > 0 && cost_cache_bytes <= (static_cast<size_t>(params.cost_cache_budget) << 20);
+    view_costs_cuda = NULL;
+    cached_planes_cuda = NULL;
+    if (params.cost_cache) {
+        view_costs_cuda = workspace.AllocateDevice<float>(num_pixels * num_cached_costs);
+        cached_planes_cuda = workspace.AllocateDevice<float4>(num_pixels);
+    }
+    else if (params.cost_cache_budget > 0) {
+        std::cout << "cost cache disabled, it needs " << (cost_cache_bytes >> 20) << " MB" << std::endl;
+    }
 
-            cudaCreateTextureObject(&(texture_normals1_host.images[i]), &resDesc, &texDesc, NULL);
-        }
-        cudaMalloc((void**)&texture_normals1_cuda, sizeof(cudaTextureObjects));
-        cudaMemcpy(texture_normals1_cuda, &texture_normals1_host, sizeof(cudaTextureObjects), cudaMemcpyHostToDevice);
+    params.use_depth_bounds = false;
+    params.sparse_seeds = false;
+    depth_bounds_cuda = NULL;
+    if (!params.geom_consistency && !params.hierarchy && !sparse_points.empty()) {
+        SeedSparsePoints(tile.rect);
+    }
 
-        //normal map dim2
+    if (params.geom_consistency) {
         for (int i = 0; i < num_images; ++i) {
-            int rows = normals2[i].rows;
-            int cols = normals2[i].cols;
-
-
-            cudaChannelFormatDesc channelDesc = cudaCreateChannelDesc(32, 0, 0, 0, cudaChannelFormatKindFloat);
-            cudaMallocArray(&cuNormal2Array[i], &channelDesc, cols, rows);
-            cudaMemcpy2DToArray(cuNormal2Array[i], 0, 0, normals2[i].ptr<float>(), normals2[i].step[0], cols * sizeof(float), rows, cudaMemcpyHostToDevice);
-
-            struct cudaResourceDesc resDesc;
-            memset(&resDesc, 0, sizeof(cudaResourceDesc));
-            resDesc.resType = cudaResourceTypeArray;
-            resDesc.res.array.array = cuNormal2Array[i];
-
-            struct cudaTextureDesc texDesc;
-            memset(&texDesc, 0, sizeof(cudaTextureDesc));
-            texDesc.addressMode[0] = cudaAddressModeWrap;
-            texDesc.addressMode[1] = cudaAddressModeWrap;
-            texDesc.filterMode = cudaFilterModeLinear;
-            texDesc.readMode = cudaReadModeElementType;
-            texDesc.normalizedCoords = 0;
-
-            cudaCreateTextureObject(&(texture_normals2_host.images[i]), &resDesc, &texDesc, NULL);
+            texture_geometries_host.images[i] = workspace.UploadTexture(1, i, geometries[i](crops[i]));
         }
-        cudaMalloc((void**)&texture_normals2_cuda, sizeof(cudaTextureObjects));
-        cudaMemcpy(texture_normals2_cuda, &texture_normals2_host, sizeof(cudaTextureObjects), cudaMemcpyHostToDevice);
-
+        texture_geometries_cuda = workspace.AllocateDevice<cudaTextureObjects>(1);
+        cudaMemcpy(texture_geometries_cuda, &texture_geometries_host, sizeof(cudaTextureObjects), cudaMemcpyHostToDevice);
 
         std::stringstream result_path;
         result_path << dense_folder << "/CNVR" << "/2333_" << std::setw(8) << std::setfill('0') << problem.ref_image_id;
@@ -759,10 +2416,13 @@ void CNVR::CudaSpaceInitialization(const std::string &dense_folder, const Proble
         cv::Mat_<cv::Vec3f> ref_normal;
         cv::Mat_<float> ref_cost;
         cv::Mat_<float> ref_normal_cost;
-        readDepthDmb(depth_path, ref_depth);
-        depths.push_back(ref_depth);
-        readNormalDmb(normal_path, ref_normal);
-        readDepthDmb(cost_path, ref_cost);
+        MappedFileHandle ref_depth_handle, ref_normal_handle, ref_cost_handle;
+        mapDepthDmb(depth_path, ref_depth, ref_depth_handle);
+        mapNormalDmb(normal_path, ref_normal, ref_normal_handle);
+        mapDepthDmb(cost_path, ref_cost, ref_cost_handle);
+        ref_depth = ref_depth(tile.rect);
+        ref_normal = ref_normal(tile.rect);
+        ref_cost = ref_cost(tile.rect);
         int width = ref_depth.cols;
         int height = ref_depth.rows;
         for (int col = 0; col < width; ++col) {
@@ -783,63 +2443,414 @@ void CNVR::CudaSpaceInitialization(const std::string &dense_folder, const Proble
     }
 
     if (params.hierarchy) {
+        // The seeds of this scale are upsampled from the maps of the previous one in memory.
         std::stringstream result_path;
         result_path << dense_folder << "/CNVR" << "/2333_" << std::setw(8) << std::setfill('0') << problem.ref_image_id;
         std::string result_folder = result_path.str();
-        std::string depth_path = result_folder + "/depths.dmb";
+        std::string depth_path = result_folder + "/depths_geom.dmb";
         std::string normal_path = result_folder + "/normals_geom.dmb";
         std::string cost_path = result_folder + "/costs.dmb";
         cv::Mat_<float> ref_depth;
         cv::Mat_<cv::Vec3f> ref_normal;
         cv::Mat_<float> ref_cost;
-        readDepthDmb(depth_path, ref_depth);
-        depths.push_back(ref_depth);
-        readNormalDmb(normal_path, ref_normal);
-        readDepthDmb(cost_path, ref_cost);
+        MappedFileHandle ref_depth_handle, ref_normal_handle, ref_cost_handle;
+        mapDepthDmb(depth_path, ref_depth, ref_depth_handle);
+        mapNormalDmb(normal_path, ref_normal, ref_normal_handle);
+        mapDepthDmb(cost_path, ref_cost, ref_cost_handle);
         int width = ref_normal.cols;
         int height = ref_normal.rows;
-        scaled_plane_hypotheses_host= new float4[height * width];
-        cudaMalloc((void**)&scaled_plane_hypotheses_cuda, sizeof(float4) * height * width);
-        pre_costs_host = new float[height * width];
-        cudaMalloc((void**)&pre_costs_cuda, sizeof(float) * cameras[0].height * cameras[0].width);
-        if (width !=images[0].rows || height != images[0].cols) {
+        cv::Rect scaled_rect = tile.rect;
+        if (width != cameras[0].width || height != cameras[0].height) {
             params.upsample = true;
-            params.scaled_cols = width;
-            params.scaled_rows = height;
+            params.upsample_scale = 1.0 * width / cameras[0].width;
+            params.upsample_window = std::max(cameras[0].width / static_cast<float>(width), cameras[0].height / static_cast<float>(height));
+            // Crop the coarse maps to the tile plus the upsampling window.
+            const int margin = (params.upsample_window * params.upsample_window + 1) / 2 + 1;
+            const int x0 = std::max(0, static_cast<int>(std::floor(tile.rect.x * params.upsample_scale)) - margin);
+            const int y0 = std::max(0, static_cast<int>(std::floor(tile.rect.y * params.upsample_scale)) - margin);
+            const int x1 = std::min(width, static_cast<int>(std::ceil(tile.rect.br().x * params.upsample_scale)) + margin);
+            const int y1 = std::min(height, static_cast<int>(std::ceil(tile.rect.br().y * params.upsample_scale)) + margin);
+            scaled_rect = cv::Rect(x0, y0, x1 - x0, y1 - y0);
+            params.scaled_offset_x = tile.rect.x * params.upsample_scale - x0;
+            params.scaled_offset_y = tile.rect.y * params.upsample_scale - y0;
+            params.scaled_cols = scaled_rect.width;
+            params.scaled_rows = scaled_rect.height;
         }
         else {
             params.upsample = false;
         }
-        for (int col = 0; col < width; ++col) {
-            for (int row = 0; row < height; ++row) {
-                int center = row * width + col;
+        ref_depth = ref_depth(scaled_rect);
+        ref_normal = ref_normal(scaled_rect);
+        ref_cost = ref_cost(scaled_rect);
+
+        // One joint bilateral pass guided by the reference image gives depth and normal together.
+        cv::Mat_<float> seed_depth;
+        cv::Mat_<cv::Vec3f> seed_normal;
+        if (params.upsample) {
+            const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            cv::Mat_<float> guide;
+            images[0].convertTo(guide, CV_32FC1);
+            JointBilateralUpsampleHost(guide, tile.rect, ref_depth, ref_normal, params.upsample_window, params.upsample_scale,
+                                       cv::Point2f(params.scaled_offset_x, params.scaled_offset_y), seed_depth, seed_normal);
+            std::cout << "upsampling: " << ElapsedMs(start) << " ms" << std::endl;
+        }
+        else {
+            seed_depth = ref_depth;
+            seed_normal = ref_normal;
+        }
+        scaled_plane_hypotheses_host = workspace.AllocateHost<float4>(num_pixels);
+        scaled_plane_hypotheses_cuda = workspace.AllocateDevice<float4>(num_pixels);
+        pre_costs_host = workspace.AllocateHost<float>(num_pixels);
+        for (int row = 0; row < tile_cameras[0].height; ++row) {
+            for (int col = 0; col < tile_cameras[0].width; ++col) {
+                int center = row * tile_cameras[0].width + col;
                 float4 plane_hypothesis;
-                plane_hypothesis.x = ref_normal(row, col)[0];
-                plane_hypothesis.y = ref_normal(row, col)[1];
-                plane_hypothesis.z = ref_normal(row, col)[2];
-                if (params.upsample) {
-                    plane_hypothesis.w = ref_cost(row, col);
+                plane_hypothesis.x = seed_normal(row, col)[0];
+                plane_hypothesis.y = seed_normal(row, col)[1];
+                plane_hypothesis.z = seed_normal(row, col)[2];
+                plane_hypothesis.w = seed_depth(row, col);
+                scaled_plane_hypotheses_host[center] = plane_hypothesis;
+            }
+        }
+        cudaMemcpy(scaled_plane_hypotheses_cuda, scaled_plane_hypotheses_host, sizeof(float4) * num_pixels, cudaMemcpyHostToDevice);
+        if (params.coarse_bounds) {
+            ComputeDepthBounds(seed_depth, ref_cost);
+        }
+    }
+}
+
+void CNVR::ReleaseInputMaps()
+{
+    // Everything is on the device now; drop the packed maps.
+    geometries.clear();
+}
+
+cv::Rect CNVR::ComputeSourceFootprint(const Camera &ref_camera, const Camera &src_camera) const
+{
+    const cv::Rect frame(0, 0, src_camera.width, src_camera.height);
+    // The frustum is convex, so its projected corners bound the whole projection.
+    const float corner_depths[2] = {params.depth_min, params.depth_max};
+    float min_x = FLT_MAX, min_y = FLT_MAX, max_x = -FLT_MAX, max_y = -FLT_MAX;
+    for (int k = 0; k < 8; ++k) {
+        const int x = (k & 1) ? ref_camera.width : 0;
+        const int y = (k & 2) ? ref_camera.height : 0;
+        float3 X = Get3DPointonWorld(x, y, corner_depths[k >> 2], ref_camera);
+        float2 point;
+        float proj_depth;
+        ProjectonCamera(X, src_camera, point, proj_depth);
+        if (proj_depth <= 0.0f) {
+            return frame;
+        }
+        min_x = std::min(min_x, point.x);
+        min_y = std::min(min_y, point.y);
+        max_x = std::max(max_x, point.x);
+        max_y = std::max(max_y, point.y);
+    }
+    // Warped patches around the border pixels reach beyond the projected corners.
+    const float margin = 2.0f * params.patch_size * params.radius_increment;
+    min_x = std::max(min_x - margin, 0.0f);
+    min_y = std::max(min_y - margin, 0.0f);
+    max_x = std::min(max_x + margin, static_cast<float>(src_camera.width));
+    max_y = std::min(max_y + margin, static_cast<float>(src_camera.height));
+    if (min_x >= max_x || min_y >= max_y) {
+        // The view cannot see the tile, every projection falls outside it.
+        return cv::Rect(0, 0, 1, 1);
+    }
+    const cv::Rect footprint(cv::Point(static_cast<int>(std::floor(min_x)), static_cast<int>(std::floor(min_y))),
+                             cv::Point(static_cast<int>(std::ceil(max_x)), static_cast<int>(std::ceil(max_y))));
+    return footprint & frame;
+}
+
+// False when the frustum of the pixels in rect between depth_min and depth_max
+// projects outside the source image, so that no hypothesis can match there.
+static bool IsViewVisible(const Camera &ref_camera, const cv::Rect &rect, const Camera &src_camera, const float depth_min, const float depth_max)
+{
+    const float corner_depths[2] = {depth_min, depth_max};
+    float min_x = FLT_MAX, min_y = FLT_MAX, max_x = -FLT_MAX, max_y = -FLT_MAX;
+    int num_behind = 0;
+    for (int k = 0; k < 8; ++k) {
+        const int x = (k & 1) ? rect.x + rect.width - 1 : rect.x;
+        const int y = (k & 2) ? rect.y + rect.height - 1 : rect.y;
+        float3 X = Get3DPointonWorld(x, y, corner_depths[k >> 2], ref_camera);
+        float2 point;
+        float proj_depth;
+        ProjectonCamera(X, src_camera, point, proj_depth);
+        if (proj_depth <= 0.0f) {
+            num_behind++;
+            continue;
+        }
+        min_x = std::min(min_x, point.x);
+        min_y = std::min(min_y, point.y);
+        max_x = std::max(max_x, point.x);
+        max_y = std::max(max_y, point.y);
+    }
+    if (num_behind == 8) {
+        return false;
+    }
+    if (num_behind > 0) {
+        // The projection is unbounded.
+        return true;
+    }
+    const float slack = 1.0f;
+    return max_x >= -slack && min_x < src_camera.width + slack && max_y >= -slack && min_y < src_camera.height + slack;
+}
+
+void CNVR::ComputeTileVisibility()
+{
+    const Camera &ref_camera = tile_cameras[0];
+    const cv::Rect frame(0, 0, ref_camera.width, ref_camera.height);
+    const int tiles_x = (ref_camera.width + VISIBILITY_TILE_SIZE - 1) / VISIBILITY_TILE_SIZE;
+    const int tiles_y = (ref_camera.height + VISIBILITY_TILE_SIZE - 1) / VISIBILITY_TILE_SIZE;
+    const int num_tiles = tiles_x * tiles_y;
+    tile_views_host = workspace.AllocateHost<unsigned int>(num_tiles);
+    tile_views_cuda = workspace.AllocateDevice<unsigned int>(num_tiles);
+
+    // The cost vectors and view masks hold at most 32 source views.
+    const int num_src_images = std::min(num_images - 1, 32);
+    double num_evaluated_views = 0.0;
+#pragma omp parallel for schedule(dynamic) reduction(+:num_evaluated_views)
+    for (int tile = 0; tile < num_tiles; ++tile) {
+        const cv::Rect rect = cv::Rect((tile % tiles_x) * VISIBILITY_TILE_SIZE, (tile / tiles_x) * VISIBILITY_TILE_SIZE, VISIBILITY_TILE_SIZE, VISIBILITY_TILE_SIZE) & frame;
+        unsigned int views = 0;
+        int num_views = 0;
+        for (int i = 0; i < num_src_images; ++i) {
+            if (IsViewVisible(ref_camera, rect, tile_cameras[i + 1], params.depth_min, params.depth_max)) {
+                views |= 1u << i;
+                num_views++;
+            }
+        }
+        tile_views_host[tile] = views;
+        num_evaluated_views += static_cast<double>(num_views) * rect.area();
+    }
+    cudaMemcpy(tile_views_cuda, tile_views_host, sizeof(unsigned int) * num_tiles, cudaMemcpyHostToDevice);
+    std::cout << "evaluated views: " << num_evaluated_views / frame.area() << " of " << num_src_images << " per pixel" << std::endl;
+}
+
+// Search interval of every pixel around the upsampled depth of the previous scale:
+// the depth range of its neighbourhood, widened by the coarse matching cost.
+// Unreliable or missing estimates keep the global range.
+void CNVR::ComputeDepthBounds(const cv::Mat_<float> &prior_depth, const cv::Mat_<float> &prior_cost)
+{
+    const int width = tile_cameras[0].width;
+    const int height = tile_cameras[0].height;
+    const float scale = params.upsample ? params.upsample_scale : 1.0f;
+    const float offset_x = params.upsample ? params.scaled_offset_x : 0.0f;
+    const float offset_y = params.upsample ? params.scaled_offset_y : 0.0f;
+    const float max_cost = 1.0f;
+    const float min_margin = 0.01f;
+    const float cost_margin = 0.1f;
+
+    // One coarse pixel in every direction.
+    const int radius = std::max(1, static_cast<int>(std::ceil(1.0f / scale)));
+    const cv::Mat element = cv::Mat::ones(2 * radius + 1, 2 * radius + 1, CV_8U);
+    cv::Mat_<float> valid_depth = prior_depth.clone();
+    for (int row = 0; row < height; ++row) {
+        for (int col = 0; col < width; ++col) {
+            if (!(valid_depth(row, col) > 0.0f)) {
+                valid_depth(row, col) = FLT_MAX;
+            }
+        }
+    }
+    cv::Mat_<float> min_depth, max_depth;
+    cv::erode(valid_depth, min_depth, element);
+    cv::dilate(prior_depth, max_depth, element);
+
+    float2 *depth_bounds_host = workspace.AllocateHost<float2>(width * height);
+    depth_bounds_cuda = workspace.AllocateDevice<float2>(width * height);
+    double bounded_range = 0.0;
+#pragma omp parallel for reduction(+:bounded_range)
+    for (int row = 0; row < height; ++row) {
+        const int cost_row = std::min(std::max(static_cast<int>(row * scale + offset_y), 0), prior_cost.rows - 1);
+        for (int col = 0; col < width; ++col) {
+            const int cost_col = std::min(std::max(static_cast<int>(col * scale + offset_x), 0), prior_cost.cols - 1);
+            const float cost = prior_cost(cost_row, cost_col);
+            float2 bound = make_float2(params.depth_min, params.depth_max);
+            if (cost < max_cost && min_depth(row, col) < FLT_MAX && max_depth(row, col) > 0.0f) {
+                const float margin = min_margin + cost_margin * std::max(cost, 0.0f);
+                bound.x = std::max(params.depth_min, min_depth(row, col) * (1.0f - margin));
+                bound.y = std::min(params.depth_max, max_depth(row, col) * (1.0f + margin));
+                if (bound.x >= bound.y) {
+                    bound = make_float2(params.depth_min, params.depth_max);
                 }
-                else {
-                    plane_hypothesis.w = ref_depth(row, col);
+            }
+            depth_bounds_host[row * width + col] = bound;
+            bounded_range += bound.y - bound.x;
+        }
+    }
+    cudaMemcpy(depth_bounds_cuda, depth_bounds_host, sizeof(float2) * width * height, cudaMemcpyHostToDevice);
+    params.use_depth_bounds = true;
+    std::cout << "depth bounds: " << 100.0 * bounded_range / (static_cast<double>(width) * height * (params.depth_max - params.depth_min))
+              << "% of the depth range per pixel" << std::endl;
+}
+
+// Seeds the pixels around every SfM point with its depth. Cells that hold enough
+// points, counting their neighbour cells, search only around the depths found there.
+void CNVR::SeedSparsePoints(const cv::Rect &rect)
+{
+    const int width = tile_cameras[0].width;
+    const int height = tile_cameras[0].height;
+    const int num_pixels = width * height;
+    const int cells_x = (width + SPARSE_CELL_SIZE - 1) / SPARSE_CELL_SIZE;
+    const int cells_y = (height + SPARSE_CELL_SIZE - 1) / SPARSE_CELL_SIZE;
+    const int min_cell_points = 3;
+    const float margin = 0.1f;
+
+    std::vector<float> cell_min(cells_x * cells_y, FLT_MAX);
+    std::vector<float> cell_max(cells_x * cells_y, 0.0f);
+    std::vector<int> cell_count(cells_x * cells_y, 0);
+    for (int i = 0; i < num_pixels; ++i) {
+        plane_hypotheses_host[i] = make_float4(0.0f, 0.0f, 0.0f, 0.0f);
+    }
+    int num_seeds = 0;
+    for (size_t i = 0; i < sparse_points.size(); ++i) {
+        const int x = static_cast<int>(sparse_points[i].x) - rect.x;
+        const int y = static_cast<int>(sparse_points[i].y) - rect.y;
+        const float depth = sparse_points[i].z;
+        if (x < 0 || x >= width || y < 0 || y >= height || depth < params.depth_min || depth > params.depth_max) {
+            continue;
+        }
+        const int cell = (y / SPARSE_CELL_SIZE) * cells_x + x / SPARSE_CELL_SIZE;
+        cell_min[cell] = std::min(cell_min[cell], depth);
+        cell_max[cell] = std::max(cell_max[cell], depth);
+        cell_count[cell]++;
+        for (int dy = -1; dy <= 1; ++dy) {
+            for (int dx = -1; dx <= 1; ++dx) {
+                if (x + dx >= 0 && x + dx < width && y + dy >= 0 && y + dy < height) {
+                    plane_hypotheses_host[(y + dy) * width + x + dx].w = depth;
                 }
-                scaled_plane_hypotheses_host[center] = plane_hypothesis;
             }
         }
+        num_seeds++;
+    }
+    if (num_seeds == 0) {
+        return;
+    }
+    cudaMemcpy(plane_hypotheses_cuda, plane_hypotheses_host, sizeof(float4) * num_pixels, cudaMemcpyHostToDevice);
+    params.sparse_seeds = true;
+
+    std::vector<float2> cell_bounds(cells_x * cells_y, make_float2(params.depth_min, params.depth_max));
+    int num_bounded_cells = 0;
+    for (int cy = 0; cy < cells_y; ++cy) {
+        for (int cx = 0; cx < cells_x; ++cx) {
+            float depth_min = FLT_MAX;
+            float depth_max = 0.0f;
+            int count = 0;
+            for (int ny = std::max(cy - 1, 0); ny <= std::min(cy + 1, cells_y - 1); ++ny) {
+                for (int nx = std::max(cx - 1, 0); nx <= std::min(cx + 1, cells_x - 1); ++nx) {
+                    const int cell = ny * cells_x + nx;
+                    depth_min = std::min(depth_min, cell_min[cell]);
+                    depth_max = std::max(depth_max, cell_max[cell]);
+                    count += cell_count[cell];
+                }
+            }
+            if (count >= min_cell_points) {
+                cell_bounds[cy * cells_x + cx].x = std::max(params.depth_min, depth_min * (1.0f - margin));
+                cell_bounds[cy * cells_x + cx].y = std::min(params.depth_max, depth_max * (1.0f + margin));
+                num_bounded_cells++;
+            }
+        }
+    }
+    if (num_bounded_cells > 0) {
+        float2 *depth_bounds_host = workspace.AllocateHost<float2>(num_pixels);
+        depth_bounds_cuda = workspace.AllocateDevice<float2>(num_pixels);
+        for (int row = 0; row < height; ++row) {
+            for (int col = 0; col < width; ++col) {
+                depth_bounds_host[row * width + col] = cell_bounds[(row / SPARSE_CELL_SIZE) * cells_x + col / SPARSE_CELL_SIZE];
+            }
+        }
+        cudaMemcpy(depth_bounds_cuda, depth_bounds_host, sizeof(float2) * num_pixels, cudaMemcpyHostToDevice);
+        params.use_depth_bounds = true;
+    }
+    std::cout << "sparse prior: " << num_seeds << " seeds, " << num_bounded_cells << " of " << cells_x * cells_y << " cells bounded" << std::endl;
+}
 
-        for (int col = 0; col < cameras[0].width; ++col) {
-            for (int row = 0; row < cameras[0].height; ++row) {
-                int center = row * cameras[0].width + col;
-                float4 plane_hypothesis;
-                plane_hypothesis.w = ref_depth(row, col);
-                plane_hypotheses_host[center] = plane_hypothesis;
+size_t CNVR::EstimateTileBytes(const cv::Rect &rect) const
+{
+    // Device planes, costs, views and random states plus the host copies of the results.
+    size_t pixel_bytes = 3 * sizeof(float4) + 2 * sizeof(float) + sizeof(unsigned int) + sizeof(curandState);
+    pixel_bytes += sizeof(float4) + sizeof(float) + sizeof(unsigned int);
+    if (params.hierarchy) {
+        pixel_bytes += 2 * sizeof(float4) + sizeof(float);
+    }
+    if ((params.hierarchy && params.coarse_bounds) || (params.sparse_prior && !params.geom_consistency)) {
+        pixel_bytes += 2 * sizeof(float2);
+    }
+    // One matching image per view, plus the packed depth and normal map in geom passes.
+    const size_t image_bytes = CV_ELEM_SIZE(MatchingImageType(params.image_storage));
+    const size_t texel_bytes = params.geom_consistency ? image_bytes + 2 * sizeof(float) : image_bytes;
+    size_t bytes = rect.area() * (pixel_bytes + texel_bytes);
+
+    const Camera ref_camera = CropCamera(cameras[0], rect);
+    for (size_t i = 1; i < cameras.size(); ++i) {
+        const size_t area = ComputeSourceFootprint(ref_camera, cameras[i]).area();
+        bytes += area * texel_bytes;
+        // The coarser source levels add at most a third of the full resolution image.
+        if (params.source_levels > 1) {
+            bytes += area * image_bytes / 3;
+        }
+    }
+    return bytes;
+}
+
+std::vector<ReferenceTile> CNVR::PlanTiles()
+{
+    const cv::Rect frame(0, 0, cameras[0].width, cameras[0].height);
+    std::vector<ReferenceTile> tiles;
+    const size_t budget = static_cast<size_t>(params.tile_budget) << 20;
+    const size_t frame_bytes = EstimateTileBytes(frame);
+    if (params.tile_budget <= 0 || frame_bytes <= budget) {
+        ReferenceTile tile;
+        tile.rect = frame;
+        tile.core = frame;
+        tiles.push_back(tile);
+        return tiles;
+    }
+
+    // Start from the grid the whole-image estimate suggests and split the longer
+    // core side until the largest tile, overlap included, fits the budget.
+    const float ratio = std::sqrt(static_cast<float>(frame_bytes) / budget);
+    const float aspect = std::sqrt(static_cast<float>(frame.width) / frame.height);
+    int num_cols = std::max(1, static_cast<int>(ratio * aspect));
+    int num_rows = std::max(1, static_cast<int>(ratio / aspect));
+    const int overlap = params.tile_overlap;
+    size_t max_bytes = 0;
+    while (true) {
+        const int core_width = (frame.width + num_cols - 1) / num_cols;
+        const int core_height = (frame.height + num_rows - 1) / num_rows;
+        tiles.clear();
+        max_bytes = 0;
+        for (int row = 0; row < num_rows; ++row) {
+            for (int col = 0; col < num_cols; ++col) {
+                ReferenceTile tile;
+                tile.core = cv::Rect(col * core_width, row * core_height, core_width, core_height) & frame;
+                if (tile.core.area() == 0) {
+                    continue;
+                }
+                tile.rect = cv::Rect(tile.core.x - overlap, tile.core.y - overlap, tile.core.width + 2 * overlap, tile.core.height + 2 * overlap) & frame;
+                max_bytes = std::max(max_bytes, EstimateTileBytes(tile.rect));
+                tiles.push_back(tile);
             }
         }
-        cudaMemcpy(scaled_plane_hypotheses_cuda, scaled_plane_hypotheses_host, sizeof(float4) * height * width, cudaMemcpyHostToDevice);
-        cudaMemcpy(plane_hypotheses_cuda, plane_hypotheses_host, sizeof(float4) * cameras[0].width * cameras[0].height, cudaMemcpyHostToDevice);
+        if (max_bytes <= budget) {
+            break;
+        }
+        if (core_width <= overlap && core_height <= overlap) {
+            std::cout << "Tile budget of " << params.tile_budget << " MB is too small, tiles exceed it" << std::endl;
+            break;
+        }
+        if (core_width >= core_height) {
+            num_cols++;
+        }
+        else {
+            num_rows++;
+        }
     }
+    std::cout << "Tiling " << frame.width << "x" << frame.height << " into " << tiles.size() << " tiles, at most "
+              << (max_bytes >> 20) << " MB each" << std::endl;
+    return tiles;
 }
 
+
 int CNVR::GetReferenceImageWidth()
 {
     return cameras[0].width;
@@ -865,124 +2876,137 @@ float CNVR::GetCost(const int index)
     return costs_host[index];
 }
 
-
- void JBUAddImageToTextureFloatGray ( std::vector<cv::Mat_<float>>  &imgs, cudaTextureObject_t texs[], cudaArray *cuArray[], const int &numSelViews)
+void CNVR::GetResultMaps(cv::Mat_<float> &depths, cv::Mat_<cv::Vec3f> &normals, cv::Mat_<float> &costs, cv::Mat_<int> &selected_views)
 {
-    for (int i=0; i<numSelViews; i++) {
-        int index = i;
-        int rows = imgs[index].rows;
-        int cols = imgs[index].cols;
-        // Create channel with floating point type
-        cudaChannelFormatDesc channelDesc = cudaCreateChannelDesc (32, 0, 0,  0, cudaChannelFormatKindFloat);
-        // Allocate array with correct size and number of channels
-        cudaMallocArray(&cuArray[i], &channelDesc, cols, rows);
-        cudaMemcpy2DToArray (cuArray[i], 0, 0, imgs[index].ptr<float>(), imgs[index].step[0], cols*sizeof(float), rows, cudaMemcpyHostToDevice);
-
-        // Specify texture
-        struct cudaResourceDesc resDesc;
-        memset(&resDesc, 0, sizeof(cudaResourceDesc));
-        resDesc.resType         = cudaResourceTypeArray;
-        resDesc.res.array.array = cuArray[i];
-
-        // Specify texture object parameters
-        struct cudaTextureDesc texDesc;
-        memset(&texDesc, 0, sizeof(cudaTextureDesc));
-        texDesc.addressMode[0]   = cudaAddressModeWrap;
-        texDesc.addressMode[1]   = cudaAddressModeWrap;
-        texDesc.filterMode       = cudaFilterModeLinear;
-        texDesc.readMode         = cudaReadModeElementType;
-        texDesc.normalizedCoords = 0;
+    const int width = tile_cameras[0].width;
+    const int height = tile_cameras[0].height;
+
+    // plane_hypotheses_host holds (normal, depth) per pixel in row-major order.
+    cv::Mat planes(height, width, CV_32FC4, plane_hypotheses_host);
+    depths.create(height, width);
+    normals.create(height, width);
+    cv::Mat outputs[] = {normals, depths};
+    const int from_to[] = {0, 0, 1, 1, 2, 2, 3, 3};
+    cv::mixChannels(&planes, 1, outputs, 2, from_to, 4);
+    costs = cv::Mat(height, width, CV_32FC1, costs_host).clone();
+    selected_views = cv::Mat(height, width, CV_32SC1, selected_views_host).clone();
+}
 
-        // Create texture object
-        cudaCreateTextureObject(&(texs[i]), &resDesc, &texDesc, NULL);
+// Whether the sweeps of this pass, over all tiles, lowered the mean cost so
+// little that another geom pass is not worth running.
+bool CNVR::PassConverged() const
+{
+    if (!params.adaptive || pass_pixels <= 0.0) {
+        return false;
     }
-    return;
+    const double improvement = pass_cost_improvement / pass_pixels;
+    std::cout << "pass: " << pass_changed_pixels / pass_pixels << " plane changes per pixel, mean cost -" << improvement << std::endl;
+    return improvement < params.converged_pass_improvement;
 }
 
- JBU::JBU(){}
-
- JBU::~JBU()
- {
-     free(depth_h);
-
-     cudaFree(depth_d);
-     cudaFree(jp_d);
-     cudaFree(jt_d);
- }
 
- void JBU::InitializeParameters(int n)
- {
-     depth_h = (float*)malloc(sizeof(float) * n);
-
-     cudaMalloc ((void**)&depth_d,  sizeof(float) * n);
-
-     cudaMalloc((void**)&jp_d, sizeof(JBUParameters) * 1);
-     cudaMemcpy(jp_d, &jp_h, sizeof(JBUParameters) * 1, cudaMemcpyHostToDevice);
-
-     cudaMalloc((void**)&jt_d, sizeof(JBUTexObj) * 1);
-     cudaMemcpy(jt_d, &jt_h, sizeof(JBUTexObj) * 1, cudaMemcpyHostToDevice);
-     cudaDeviceSynchronize();
- }
-
-void RunJBU(const cv::Mat_<float>  &scaled_image_float, const cv::Mat_<float> &src_depthmap, const std::string &dense_folder , const Problem &problem)
+// Joint bilateral upsampling of the seeds of the previous scale, for the
+// output pixels of rect in the guide. Coarse pixel of output (x, y) is (x, y) * scale + offset. The
+// spatial Gaussian is separable and only depends on the output column or row,
+// so its factors are tabulated once together with the clamped tap positions.
+// Range weights come from a table over guide differences in
+// 1 / JBU_RANGE_LUT_STEPS intensity steps. Normals are upsampled in the same
+// pass when src_normals is given.
+void JointBilateralUpsampleHost(const cv::Mat_<float> &guide, const cv::Rect &rect, const cv::Mat_<float> &src_depthmap, const cv::Mat_<cv::Vec3f> &src_normals,
+                                const int Imagescale, const float scale, const cv::Point2f &offset, cv::Mat_<float> &depthmap, cv::Mat_<cv::Vec3f> &normals)
 {
-    uint32_t rows = scaled_image_float.rows;
-    uint32_t cols = scaled_image_float.cols;
-    int Imagescale = scaled_image_float.rows / src_depthmap.rows>scaled_image_float.cols / src_depthmap.cols? scaled_image_float.rows / src_depthmap.rows: scaled_image_float.cols / src_depthmap.cols;
-
-    if (Imagescale == 1) {
-        std::cout << "Image.rows = Depthmap.rows" << std::endl;
-        return;
+    const int rows = rect.height;
+    const int cols = rect.width;
+    const bool with_normals = !src_normals.empty();
+    const float sigmad = 0.50;
+    const float sigmar = 25.5;
+    const int num_neighbors = (Imagescale * Imagescale + 1) / 2;
+    const int win = 2 * num_neighbors + 1;
+
+    std::vector<int> src_x(cols * win), guide_x(cols * win);
+    std::vector<float> weight_x(cols * win);
+    for (int x = 0; x < cols; ++x) {
+        const float o_x = x * scale + offset.x;
+        for (int i = -num_neighbors; i <= num_neighbors; ++i) {
+            int r_x = o_x + i;
+            r_x = std::max(0, std::min(r_x, src_depthmap.cols - 1));
+            const float d = o_x - r_x;
+            src_x[x * win + i + num_neighbors] = r_x;
+            guide_x[x * win + i + num_neighbors] = std::max(0, std::min(rect.x + x + i, guide.cols - 1));
+            weight_x[x * win + i + num_neighbors] = exp(-d * d / (2 * sigmad * sigmad));
+        }
     }
-
-    std::vector<cv::Mat_<float> > imgs(JBU_NUM);
-    imgs[0] = scaled_image_float.clone();
-    imgs[1] = src_depthmap.clone();
-
-    JBU jbu;
-    jbu.jp_h.height = rows;
-    jbu.jp_h.width = cols;
-    jbu.jp_h.s_height = src_depthmap.rows;
-    jbu.jp_h.s_width = src_depthmap.cols;
-    jbu.jp_h.Imagescale = Imagescale;
-    JBUAddImageToTextureFloatGray(imgs, jbu.jt_h.imgs, jbu.cuArray, JBU_NUM);
-
-    jbu.InitializeParameters(rows * cols);
-    jbu.CudaRun();
-
-    cv::Mat_<float> depthmap = cv::Mat::zeros( rows, cols, CV_32FC1 );
-
-    for (uint32_t i = 0; i < cols; ++i) {
-        for(uint32_t j = 0; j < rows; ++j) {
-            int center = i + cols * j;
-            if (jbu.depth_h[center] != jbu.depth_h[center]) {
-                std::cout << "wrong!" << std::endl;
-            }
-            depthmap (j, i) = jbu.depth_h[center];
+    std::vector<int> src_y(rows * win), guide_y(rows * win);
+    std::vector<float> weight_y(rows * win);
+    for (int y = 0; y < rows; ++y) {
+        const float o_y = y * scale + offset.y;
+        for (int j = -num_neighbors; j <= num_neighbors; ++j) {
+            int r_y = o_y + j;
+            r_y = std::max(0, std::min(r_y, src_depthmap.rows - 1));
+            const float d = o_y - r_y;
+            src_y[y * win + j + num_neighbors] = r_y;
+            guide_y[y * win + j + num_neighbors] = std::max(0, std::min(rect.y + y + j, guide.rows - 1));
+            weight_y[y * win + j + num_neighbors] = exp(-d * d / (2 * sigmad * sigmad));
         }
     }
-
-    cv::Mat_<float> disp0 = depthmap.clone();
-    std::stringstream result_path;
-#if defined(_WIN32)
-    result_path << dense_folder << "\\CNVR" << "\\2333_" << std::setw(8) << std::setfill('0') << problem.ref_image_id;
-    std::string result_folder =  result_path.str();
-    std::string command = "mkdir " + result_folder;
-    if(_access(result_folder.c_str(), 0) != 0){
-        system(command.c_str());
+    const int max_range_index = 255 * JBU_RANGE_LUT_STEPS;
+    std::vector<float> range_lut(max_range_index + 1);
+    for (int k = 0; k <= max_range_index; ++k) {
+        const float d = static_cast<float>(k) / JBU_RANGE_LUT_STEPS;
+        range_lut[k] = exp(-d * d / (2 * sigmar * sigmar));
     }
-#else
-    result_path << dense_folder << "/CNVR" << "/2333_" << std::setw(8) << std::setfill('0') << problem.ref_image_id;
-    std::string result_folder =  result_path.str();
-    mkdir(result_folder.c_str(), 777);
-#endif
 
-    std::string depth_path = result_folder + "/depths.dmb";
-    writeDepthDmb ( depth_path, disp0 );
-
-    for (int i=0; i < JBU_NUM; i++) {
-        CUDA_SAFE_CALL( cudaDestroyTextureObject(jbu.jt_h.imgs[i]) );
-        CUDA_SAFE_CALL( cudaFreeArray(jbu.cuArray[i]) );
+    depthmap.create(rows, cols);
+    if (with_normals) {
+        normals.create(rows, cols);
+    }
+    const int num_tiles = (rows + JBU_TILE_ROWS - 1) / JBU_TILE_ROWS;
+#pragma omp parallel for schedule(dynamic)
+    for (int tile = 0; tile < num_tiles; ++tile) {
+        std::vector<float> tap_weights(win);
+        const int row_end = std::min(rows, (tile + 1) * JBU_TILE_ROWS);
+        for (int y = tile * JBU_TILE_ROWS; y < row_end; ++y) {
+            const float *guide_row = guide.ptr<float>(rect.y + y) + rect.x;
+            float *depth_row = depthmap.ptr<float>(y);
+            for (int x = 0; x < cols; ++x) {
+                const float ref_pix = guide_row[x];
+                const int *tap_src_x = &src_x[x * win];
+                const int *tap_guide_x = &guide_x[x * win];
+                const float *tap_weight_x = &weight_x[x * win];
+                float total_val = 0.0f, normalizing_factor = 0.0f;
+                float total_normal[3] = {0.0f, 0.0f, 0.0f};
+                for (int j = 0; j < win; ++j) {
+                    const float *src_row = src_depthmap.ptr<float>(src_y[y * win + j]);
+                    const float *neighbor_row = guide.ptr<float>(guide_y[y * win + j]);
+                    const float weight_row = weight_y[y * win + j];
+                    float row_val = 0.0f, row_factor = 0.0f;
+#pragma omp simd reduction(+:row_val, row_factor)
+                    for (int i = 0; i < win; ++i) {
+                        const int range_index = std::min(static_cast<int>(fabs(ref_pix - neighbor_row[tap_guide_x[i]]) * JBU_RANGE_LUT_STEPS + 0.5f), max_range_index);
+                        tap_weights[i] = tap_weight_x[i] * range_lut[range_index];
+                        row_factor += tap_weights[i];
+                        row_val += src_row[tap_src_x[i]] * tap_weights[i];
+                    }
+                    normalizing_factor += weight_row * row_factor;
+                    total_val += weight_row * row_val;
+                    if (with_normals) {
+                        const cv::Vec3f *normal_row = src_normals.ptr<cv::Vec3f>(src_y[y * win + j]);
+                        for (int i = 0; i < win; ++i) {
+                            const cv::Vec3f &normal = normal_row[tap_src_x[i]];
+                            const float weight = weight_row * tap_weights[i];
+                            total_normal[0] += normal[0] * weight;
+                            total_normal[1] += normal[1] * weight;
+                            total_normal[2] += normal[2] * weight;
+                        }
+                    }
+                }
+                depth_row[x] = total_val / normalizing_factor;
+                if (with_normals) {
+                    // Normalizing the direction makes the division by the weight sum unnecessary.
+                    const float length = std::sqrt(total_normal[0] * total_normal[0] + total_normal[1] * total_normal[1] + total_normal[2] * total_normal[2]);
+                    normals(y, x) = cv::Vec3f(total_normal[0] / length, total_normal[1] / length, total_normal[2] / length);
+                }
+            }
+        }
     }
-    cudaDeviceSynchronize();
 }
@@ -61,6 +61,25 @@ __device__  int isSet(unsigned int input, const unsigned int n)
     return (input >> n) & 1;
 }
 
+__device__ bool IsSamePlane(const float4 a, const float4 b)
+{
+    return a.x == b.x && a.y == b.y && a.z == b.z && a.w == b.w;
+}
+
+__device__ float2 GetDepthBound(const float2 *depth_bounds, const int center, const PatchMatchParams params)
+{
+    if (params.use_depth_bounds) {
+        return depth_bounds[center];
+    }
+    return make_float2(params.depth_min, params.depth_max);
+}
+
+__device__ unsigned int GetVisibleViews(const unsigned int *tile_views, const int width, const int2 p)
+{
+    const int tiles_x = (width + VISIBILITY_TILE_SIZE - 1) / VISIBILITY_TILE_SIZE;
+    return tile_views[(p.y / VISIBILITY_TILE_SIZE) * tiles_x + p.x / VISIBILITY_TILE_SIZE];
+}
+
 __device__ void Mat33DotVec3(const float mat[9], const float4 vec, float4 *result)
 {
   result->x = mat[0] * vec.x + mat[1] * vec.y + mat[2] * vec.z;
@@ -147,18 +166,6 @@ __device__ float GetDistance2Origin(const Camera camera, const int2 p, const flo
     return -(normal.x * X[0] + normal.y * X[1] + normal.z * X[2]);
 }
 
-__device__   float SpatialGauss(float x1, float y1, float x2, float y2, float sigma, float mu = 0.0)
-{
-    float dis = pow(x1 - x2, 2) + pow(y1 - y2, 2) - mu;
-    return exp(-1.0 * dis / (2 * sigma * sigma));
-}
-
-__device__  float RangeGauss(float x, float sigma, float mu = 0.0)
-{
-    float x_p = x - mu;
-    return exp(-1.0 * (x_p * x_p) / (2 * sigma * sigma));
-}
-
 __device__ float ComputeDepthfromPlaneHypothesis(const Camera camera, const float4 plane_hypothesis, const int2 p)
 {
     return -plane_hypothesis.w * camera.K[0] / ((p.x - camera.K[2]) * plane_hypothesis.x + (camera.K[0] / camera.K[4]) * (p.y - camera.K[5]) * plane_hypothesis.y + camera.K[0] * plane_hypothesis.z);
@@ -448,10 +455,39 @@ __device__ float ComputeBilateralWeightInverse(const float x_dist, const float y
 }
 
 
+// Matching image intensity at texel coordinates (x, y). Normalized uint8
+// textures are scaled back to the 0..255 range of float and fp16 images.
+__device__ float SampleImage(const cudaTextureObject_t image, const float x, const float y, const PatchMatchParams &params)
+{
+    return tex2D<float>(image, x, y) * params.image_scale;
+}
+
+// Pyramid level of a source view for the taps around p. The longer Jacobian column of
+// the homography at p gives the source pixels covered by one tap step; each level
+// halves the resolution, so a level is taken once a step covers two of its pixels.
+__device__ int SelectSourceLevel(const float *H, const int2 p, const float2 pt, const PatchMatchParams params)
+{
+    if (params.source_levels <= 1) {
+        return 0;
+    }
+    const float w = H[6] * p.x + H[7] * p.y + H[8];
+    const float dudx = (H[0] - pt.x * H[6]) / w;
+    const float dvdx = (H[3] - pt.y * H[6]) / w;
+    const float dudy = (H[1] - pt.x * H[7]) / w;
+    const float dvdy = (H[4] - pt.y * H[7]) / w;
+    const float step = params.radius_increment * sqrt(max(dudx * dudx + dvdx * dvdx, dudy * dudy + dvdy * dvdy));
+    int level = 0;
+    while (level + 1 < params.source_levels && step >= (float)(2 << level)) {
+        level++;
+    }
+    return level;
+}
+
 // CNCC  and viewing ray restriction
-__device__ float ComputeBilateralNCC(const cudaTextureObject_t ref_image, const Camera ref_camera, const cudaTextureObject_t src_image, const Camera src_camera, const int2 p, const float4 plane_hypothesis, const PatchMatchParams params)
+__device__ float ComputeBilateralNCC(const cudaTextureObjects *texture_objects, const Camera ref_camera, const int src_id, const Camera src_camera, const int2 p, const float4 plane_hypothesis, const PatchMatchParams params)
 {
     const float cost_max = 2.0f;
+    const cudaTextureObject_t ref_image = texture_objects[0].images[0];
     int radius = params.patch_size / 2;
 
     float H[9];
@@ -477,6 +513,9 @@ __device__ float ComputeBilateralNCC(const cudaTextureObject_t ref_image, const
     if (Vec3DotVec3(plane_hypothesis_src, view_direction) >= 0.0f) {
         return cost_max;
     }
+    const int level = SelectSourceLevel(H, p, pt, params);
+    const cudaTextureObject_t src_image = texture_objects[level].images[src_id];
+    const float level_scale = 1.0f / (1 << level);
     float cost = 0.0f;
     {
         float sum_ref = 0.0f;
@@ -485,8 +524,8 @@ __device__ float ComputeBilateralNCC(const cudaTextureObject_t ref_image, const
         float sum_src_src = 0.0f;
         float sum_ref_src = 0.0f;
         float bilateral_weight_sum = 0.0f;
-        const float ref_center_pix = tex2D<float>(ref_image, p.x + 0.5f, p.y + 0.5f);
-        const float src_center_pix = tex2D<float>(src_image, pt.x + 0.5f, pt.y + 0.5f);
+        const float ref_center_pix = SampleImage(ref_image, p.x + 0.5f, p.y + 0.5f, params);
+        const float src_center_pix = SampleImage(src_image, pt.x * level_scale + 0.5f, pt.y * level_scale + 0.5f, params);
 
         for (int i = -radius; i < radius + 1; i += params.radius_increment) {
             float sum_ref_row = 0.0f;
@@ -498,9 +537,9 @@ __device__ float ComputeBilateralNCC(const cudaTextureObject_t ref_image, const
 
             for (int j = -radius; j < radius + 1; j += params.radius_increment) {
                 const int2 ref_pt = make_int2(p.x + i, p.y + j);
-                const float ref_pix = tex2D<float>(ref_image, ref_pt.x + 0.5f, ref_pt.y + 0.5f);
+                const float ref_pix = SampleImage(ref_image, ref_pt.x + 0.5f, ref_pt.y + 0.5f, params);
                 float2 src_pt = ComputeCorrespondingPoint(H, ref_pt);
-                const float src_pix = tex2D<float>(src_image, src_pt.x + 0.5f, src_pt.y + 0.5f);
+                const float src_pix = SampleImage(src_image, src_pt.x * level_scale + 0.5f, src_pt.y * level_scale + 0.5f, params);
                 float weight(1);
                 if (params.repair == false) {
                     weight = ComputeBilateralWeight(i, j, ref_pix, ref_center_pix, params.sigma_spatial, params.sigma_color);
@@ -554,6 +593,263 @@ __device__ float ComputeBilateralNCC(const cudaTextureObject_t ref_image, const
 }
 
 
+// ComputeBilateralNCC for several planes of the same pixel and source view. The
+// reference taps and their bilateral weights are sampled once, only the source
+// sums are kept per plane. Sums are accumulated in the same order, the costs are
+// identical to single evaluations. The plane loops run over MAX_BATCH_HYPOTHESES
+// and are unrolled, so the per-plane arrays are indexed by constants and can stay
+// in registers; planes past num_hypotheses are never valid.
+__device__ void ComputeBilateralNCCBatch(const cudaTextureObjects *texture_objects, const Camera ref_camera, const int src_id, const Camera src_camera, const int2 p, const float4 *plane_hypotheses, const int num_hypotheses, float *costs, const PatchMatchParams params)
+{
+    const float cost_max = 2.0f;
+    const cudaTextureObject_t ref_image = texture_objects[0].images[0];
+    int radius = params.patch_size / 2;
+
+    float H[MAX_BATCH_HYPOTHESES][9];
+    float src_center_pix[MAX_BATCH_HYPOTHESES];
+    cudaTextureObject_t src_images[MAX_BATCH_HYPOTHESES];
+    float level_scales[MAX_BATCH_HYPOTHESES];
+    bool valid[MAX_BATCH_HYPOTHESES];
+    int num_valid = 0;
+    #pragma unroll
+    for (int k = 0; k < MAX_BATCH_HYPOTHESES; ++k) {
+        valid[k] = false;
+        if (k >= num_hypotheses) {
+            continue;
+        }
+        float4 plane_hypothesis_src;
+        ComputeHomography2(ref_camera, src_camera, plane_hypotheses[k], H[k], plane_hypothesis_src);
+        const float3 ptz = ComputeCorrespondingPoint3(H[k], p);
+        const float2 pt = make_float2(ptz.x, ptz.y);
+        // depth > 0, inside the source image and no viewing ray conflict
+        valid[k] = !(ptz.z < 0) && !(pt.x >= src_camera.width || pt.x < 0.0f || pt.y >= src_camera.height || pt.y < 0.0f)
+            && !(Vec3DotVec3(plane_hypothesis_src, GetViewDirectionfloat(src_camera, pt, 1.0f)) >= 0.0f);
+        costs[k] = cost_max;
+        if (valid[k]) {
+            const int level = SelectSourceLevel(H[k], p, pt, params);
+            src_images[k] = texture_objects[level].images[src_id];
+            level_scales[k] = 1.0f / (1 << level);
+            src_center_pix[k] = SampleImage(src_images[k], pt.x * level_scales[k] + 0.5f, pt.y * level_scales[k] + 0.5f, params);
+            num_valid++;
+        }
+    }
+    if (num_valid == 0) {
+        return;
+    }
+
+    float sum_ref = 0.0f;
+    float sum_ref_ref = 0.0f;
+    float bilateral_weight_sum = 0.0f;
+    float sum_src[MAX_BATCH_HYPOTHESES] = {0.0f};
+    float sum_src_src[MAX_BATCH_HYPOTHESES] = {0.0f};
+    float sum_ref_src[MAX_BATCH_HYPOTHESES] = {0.0f};
+    const float ref_center_pix = SampleImage(ref_image, p.x + 0.5f, p.y + 0.5f, params);
+
+    for (int i = -radius; i < radius + 1; i += params.radius_increment) {
+        float sum_ref_row = 0.0f;
+        float sum_ref_ref_row = 0.0f;
+        float bilateral_weight_sum_row = 0.0f;
+        float sum_src_row[MAX_BATCH_HYPOTHESES] = {0.0f};
+        float sum_src_src_row[MAX_BATCH_HYPOTHESES] = {0.0f};
+        float sum_ref_src_row[MAX_BATCH_HYPOTHESES] = {0.0f};
+
+        for (int j = -radius; j < radius + 1; j += params.radius_increment) {
+            const int2 ref_pt = make_int2(p.x + i, p.y + j);
+            const float ref_pix = SampleImage(ref_image, ref_pt.x + 0.5f, ref_pt.y + 0.5f, params);
+            float weight(1);
+            if (params.repair == false) {
+                weight = ComputeBilateralWeight(i, j, ref_pix, ref_center_pix, params.sigma_spatial, params.sigma_color);
+            }
+            sum_ref_row += weight * ref_pix;
+            sum_ref_ref_row += weight * ref_pix * ref_pix;
+            bilateral_weight_sum_row += weight;
+
+            #pragma unroll
+            for (int k = 0; k < MAX_BATCH_HYPOTHESES; ++k) {
+                if (!valid[k]) {
+                    continue;
+                }
+                const float2 src_pt = ComputeCorrespondingPoint(H[k], ref_pt);
+                const float src_pix = SampleImage(src_images[k], src_pt.x * level_scales[k] + 0.5f, src_pt.y * level_scales[k] + 0.5f, params);
+                sum_src_row[k] += weight * src_pix;
+                sum_src_src_row[k] += weight * src_pix * src_pix;
+                sum_ref_src_row[k] += weight * ref_pix * src_pix;
+            }
+        }
+
+        sum_ref += sum_ref_row;
+        sum_ref_ref += sum_ref_ref_row;
+        bilateral_weight_sum += bilateral_weight_sum_row;
+        #pragma unroll
+        for (int k = 0; k < MAX_BATCH_HYPOTHESES; ++k) {
+            sum_src[k] += sum_src_row[k];
+            sum_src_src[k] += sum_src_src_row[k];
+            sum_ref_src[k] += sum_ref_src_row[k];
+        }
+    }
+    const float inv_bilateral_weight_sum = 1.0f / bilateral_weight_sum;
+    sum_ref *= inv_bilateral_weight_sum;
+    sum_ref_ref *= inv_bilateral_weight_sum;
+    const float var_ref = sum_ref_ref - sum_ref * sum_ref;
+    const float kMinVar = 1e-3f;
+
+    #pragma unroll
+    for (int k = 0; k < MAX_BATCH_HYPOTHESES; ++k) {
+        if (!valid[k]) {
+            continue;
+        }
+        const float src_sum = sum_src[k] * inv_bilateral_weight_sum;
+        const float src_src_sum = sum_src_src[k] * inv_bilateral_weight_sum;
+        const float ref_src_sum = sum_ref_src[k] * inv_bilateral_weight_sum;
+        const float var_src = src_src_sum - src_sum * src_sum;
+        if (var_ref < kMinVar || var_src < kMinVar) {
+            continue;
+        }
+        if (params.repair) {
+            // CNCC
+            const float var_ref_center = sum_ref_ref - 2 * ref_center_pix * sum_ref + ref_center_pix * ref_center_pix;
+            const float var_src_center = src_src_sum - 2 * src_center_pix[k] * src_sum + src_center_pix[k] * src_center_pix[k];
+            const float covar_src_ref_center = ref_src_sum - src_center_pix[k] * sum_ref - ref_center_pix * src_sum + ref_center_pix * src_center_pix[k];
+            const float var_ref_src_center = sqrt(var_ref_center * var_src_center);
+            costs[k] = max(0.0f, min(cost_max, 1.0f - covar_src_ref_center / var_ref_src_center));
+        }
+        else {
+            // NCC
+            const float covar_src_ref = ref_src_sum - sum_ref * src_sum;
+            const float var_ref_src = sqrt(var_ref * var_src);
+            costs[k] = max(0.0f, min(cost_max, 1.0f - covar_src_ref / var_ref_src));
+        }
+    }
+}
+
+
+// Lower bound of 1 - NCC from the sparse taps of a patch. With a and b the
+// weighted, centered reference and source vectors, split into the sparse part
+// S and the rest R, Cauchy-Schwarz on R gives
+//   NCC^2 <= 1 - (|a_S|^2 - <a_S, b_S>^2 / |b_S|^2) / |a|^2
+// for any source values on R. full_ref is |a|^2, sparse_ref |a_S|^2,
+// sparse_covar <a_S, b_S> and sparse_src |b_S|^2.
+__device__ float ComputeSparseNCCLowerBound(const float full_ref, const float sparse_ref, const float sparse_covar, const float sparse_src)
+{
+    if (!(full_ref > 0.0f)) {
+        return 0.0f;
+    }
+    const float explained = sparse_src > 0.0f ? min(sparse_ref, sparse_covar * sparse_covar / sparse_src) : 0.0f;
+    const float ncc_sq = 1.0f - max(0.0f, sparse_ref - explained) / full_ref;
+    return max(0.0f, 1.0f - sqrt(min(1.0f, max(0.0f, ncc_sq))));
+}
+
+// Lower bounds of the ComputeBilateralNCCBatch costs from the taps on every
+// cascade_increment-th row and column. The reference taps are summed over the
+// full patch, the source is only sampled on the sparse taps. Pyramid levels
+// are selected for the full tap spacing, so the sparse taps read the same
+// source pixels as the full evaluation.
+__device__ void ComputeBilateralNCCBoundBatch(const cudaTextureObjects *texture_objects, const Camera ref_camera, const int src_id, const Camera src_camera, const int2 p, const float4 *plane_hypotheses, const int num_hypotheses, float *bounds, const PatchMatchParams params)
+{
+    const float cost_max = 2.0f;
+    const cudaTextureObject_t ref_image = texture_objects[0].images[0];
+    int radius = params.patch_size / 2;
+    const int sparse_increment = params.radius_increment * params.cascade_increment;
+
+    float H[MAX_BATCH_HYPOTHESES][9];
+    float src_center_pix[MAX_BATCH_HYPOTHESES];
+    cudaTextureObject_t src_images[MAX_BATCH_HYPOTHESES];
+    float level_scales[MAX_BATCH_HYPOTHESES];
+    bool valid[MAX_BATCH_HYPOTHESES];
+    int num_valid = 0;
+    #pragma unroll
+    for (int k = 0; k < MAX_BATCH_HYPOTHESES; ++k) {
+        valid[k] = false;
+        if (k >= num_hypotheses) {
+            continue;
+        }
+        float4 plane_hypothesis_src;
+        ComputeHomography2(ref_camera, src_camera, plane_hypotheses[k], H[k], plane_hypothesis_src);
+        const float3 ptz = ComputeCorrespondingPoint3(H[k], p);
+        const float2 pt = make_float2(ptz.x, ptz.y);
+        valid[k] = !(ptz.z < 0) && !(pt.x >= src_camera.width || pt.x < 0.0f || pt.y >= src_camera.height || pt.y < 0.0f)
+            && !(Vec3DotVec3(plane_hypothesis_src, GetViewDirectionfloat(src_camera, pt, 1.0f)) >= 0.0f);
+        bounds[k] = cost_max;
+        if (valid[k]) {
+            const int level = SelectSourceLevel(H[k], p, pt, params);
+            src_images[k] = texture_objects[level].images[src_id];
+            level_scales[k] = 1.0f / (1 << level);
+            src_center_pix[k] = SampleImage(src_images[k], pt.x * level_scales[k] + 0.5f, pt.y * level_scales[k] + 0.5f, params);
+            num_valid++;
+        }
+    }
+    if (num_valid == 0) {
+        return;
+    }
+
+    // Pixels are taken relative to the patch centers, which keeps the sums of squares small.
+    float sum_ref = 0.0f;
+    float sum_ref_ref = 0.0f;
+    float bilateral_weight_sum = 0.0f;
+    float sparse_sum_ref = 0.0f;
+    float sparse_sum_ref_ref = 0.0f;
+    float sparse_weight_sum = 0.0f;
+    float sparse_sum_src[MAX_BATCH_HYPOTHESES] = {0.0f};
+    float sparse_sum_src_src[MAX_BATCH_HYPOTHESES] = {0.0f};
+    float sparse_sum_ref_src[MAX_BATCH_HYPOTHESES] = {0.0f};
+    const float ref_center_pix = SampleImage(ref_image, p.x + 0.5f, p.y + 0.5f, params);
+
+    for (int i = -radius; i < radius + 1; i += params.radius_increment) {
+        const bool sparse_row = (i + radius) % sparse_increment == 0;
+        for (int j = -radius; j < radius + 1; j += params.radius_increment) {
+            const int2 ref_pt = make_int2(p.x + i, p.y + j);
+            const float ref_pix = SampleImage(ref_image, ref_pt.x + 0.5f, ref_pt.y + 0.5f, params);
+            float weight(1);
+            if (params.repair == false) {
+                weight = ComputeBilateralWeight(i, j, ref_pix, ref_center_pix, params.sigma_spatial, params.sigma_color);
+            }
+            const float ref_diff = ref_pix - ref_center_pix;
+            sum_ref += weight * ref_diff;
+            sum_ref_ref += weight * ref_diff * ref_diff;
+            bilateral_weight_sum += weight;
+            if (!sparse_row || (j + radius) % sparse_increment != 0) {
+                continue;
+            }
+            sparse_sum_ref += weight * ref_diff;
+            sparse_sum_ref_ref += weight * ref_diff * ref_diff;
+            sparse_weight_sum += weight;
+
+            #pragma unroll
+            for (int k = 0; k < MAX_BATCH_HYPOTHESES; ++k) {
+                if (!valid[k]) {
+                    continue;
+                }
+                const float2 src_pt = ComputeCorrespondingPoint(H[k], ref_pt);
+                const float src_diff = SampleImage(src_images[k], src_pt.x * level_scales[k] + 0.5f, src_pt.y * level_scales[k] + 0.5f, params) - src_center_pix[k];
+                sparse_sum_src[k] += weight * src_diff;
+                sparse_sum_src_src[k] += weight * src_diff * src_diff;
+                sparse_sum_ref_src[k] += weight * ref_diff * src_diff;
+            }
+        }
+    }
+    // Flat patches get cost_max in the full evaluation, which is above any bound, so
+    // no variance check is needed here.
+    const float full_ref = sum_ref_ref - sum_ref * sum_ref / bilateral_weight_sum;
+
+    #pragma unroll
+    for (int k = 0; k < MAX_BATCH_HYPOTHESES; ++k) {
+        if (!valid[k]) {
+            continue;
+        }
+        if (params.repair) {
+            // CNCC, both patches are centered at their center pixels.
+            bounds[k] = ComputeSparseNCCLowerBound(sum_ref_ref, sparse_sum_ref_ref, sparse_sum_ref_src[k], sparse_sum_src_src[k]);
+        }
+        else {
+            // NCC, both patches are centered at their weighted means.
+            const float sparse_ref = sparse_sum_ref_ref - sparse_sum_ref * sparse_sum_ref / sparse_weight_sum;
+            const float sparse_src = sparse_sum_src_src[k] - sparse_sum_src[k] * sparse_sum_src[k] / sparse_weight_sum;
+            const float sparse_covar = sparse_sum_ref_src[k] - sparse_sum_ref * sparse_sum_src[k] / sparse_weight_sum;
+            bounds[k] = ComputeSparseNCCLowerBound(full_ref, sparse_ref, sparse_covar, sparse_src);
+        }
+    }
+}
+
 __device__ float ComputeColorWeight(const float pix, const float center_pix, const float sigma_color)
 {
     //const float spatial_dist = sqrt(x_dist * x_dist + y_dist * y_dist);
@@ -562,7 +858,7 @@ __device__ float ComputeColorWeight(const float pix, const float center_pix, con
 }
 
 
-__device__ float ComputeMultiViewInitialCostandSelectedViews(const cudaTextureObject_t *images, const Camera *cameras, const int2 p, const float4 plane_hypothesis, unsigned int *selected_views, const PatchMatchParams params)
+__device__ float ComputeMultiViewInitialCostandSelectedViews(const cudaTextureObjects *texture_objects, const Camera *cameras, const int2 p, const float4 plane_hypothesis, unsigned int *selected_views, const unsigned int visible_views, const PatchMatchParams params)
 {
     float cost_max = 2.0f;
     float cost_vector[32] = {2.0f};
@@ -571,7 +867,10 @@ __device__ float ComputeMultiViewInitialCostandSelectedViews(const cudaTextureOb
     int num_valid_views = 0;
 
     for (int i = 1; i < params.num_images; ++i) {
-        float c = ComputeBilateralNCC(images[0], cameras[0], images[i], cameras[i], p, plane_hypothesis, params);
+        float c = cost_max;
+        if (isSet(visible_views, i - 1)) {
+            c = ComputeBilateralNCC(texture_objects, cameras[0], i, cameras[i], p, plane_hypothesis, params);
+        }
         cost_vector[i - 1] = c;
         cost_vector_copy[i - 1] = c;
         cost_count++;
@@ -602,10 +901,38 @@ __device__ float ComputeMultiViewInitialCostandSelectedViews(const cudaTextureOb
     }
 }
 
-__device__ void ComputeMultiViewCostVector(const cudaTextureObject_t *images, const Camera *cameras, const int2 p, const float4 plane_hypothesis, float *cost_vector, const PatchMatchParams params)
+// Views the tile of p cannot see would return cost_max after the projection, they are skipped.
+// cost_vectors[k] receives the costs of plane k, all planes share the reference patch per view.
+__device__ void ComputeMultiViewCostVectors(const cudaTextureObjects *texture_objects, const Camera *cameras, const int2 p, const float4 *plane_hypotheses, const int num_hypotheses, float *const *cost_vectors, const unsigned int visible_views, const PatchMatchParams params)
+{
+    for (int i = 1; i < params.num_images; ++i) {
+        float costs[MAX_BATCH_HYPOTHESES];
+        if (isSet(visible_views, i - 1)) {
+            ComputeBilateralNCCBatch(texture_objects, cameras[0], i, cameras[i], p, plane_hypotheses, num_hypotheses, costs, params);
+        }
+#pragma unroll
+        for (int k = 0; k < MAX_BATCH_HYPOTHESES; ++k) {
+            if (k < num_hypotheses) {
+                cost_vectors[k][i - 1] = isSet(visible_views, i - 1) ? costs[k] : 2.0f;
+            }
+        }
+    }
+}
+
+// Lower bounds of the ComputeMultiViewCostVectors costs, see ComputeBilateralNCCBoundBatch.
+__device__ void ComputeMultiViewCostBoundVectors(const cudaTextureObjects *texture_objects, const Camera *cameras, const int2 p, const float4 *plane_hypotheses, const int num_hypotheses, float *const *bound_vectors, const unsigned int visible_views, const PatchMatchParams params)
 {
     for (int i = 1; i < params.num_images; ++i) {
-        cost_vector[i - 1] = ComputeBilateralNCC(images[0], cameras[0], images[i], cameras[i], p, plane_hypothesis, params);
+        float bounds[MAX_BATCH_HYPOTHESES];
+        if (isSet(visible_views, i - 1)) {
+            ComputeBilateralNCCBoundBatch(texture_objects, cameras[0], i, cameras[i], p, plane_hypotheses, num_hypotheses, bounds, params);
+        }
+#pragma unroll
+        for (int k = 0; k < MAX_BATCH_HYPOTHESES; ++k) {
+            if (k < num_hypotheses) {
+                bound_vectors[k][i - 1] = isSet(visible_views, i - 1) ? bounds[k] : 2.0f;
+            }
+        }
     }
 }
 
@@ -648,19 +975,51 @@ __device__ void ProjectonCamera_cu(const float3 PointX, const Camera camera, flo
     point.y = (camera.K[3] * tmp.x + camera.K[4] * tmp.y + camera.K[5] * tmp.z) / depth;
 }
 
-__device__ float ComputeDepthConsistencyCost(const cudaTextureObject_t depth_image, const Camera ref_camera, const Camera src_camera, const float4 plane_hypothesis, const int2 p)
+// Inverse of the 16-bit octahedral code packed by PackGeometry on the host,
+// 0x80008000 marks a missing (zero) normal.
+__device__ float4 DecodeGeometryNormal(const unsigned int code)
+{
+    if (code == 0x80008000u) {
+        return make_float4(0.0f, 0.0f, 0.0f, 0.0f);
+    }
+    float x = (short)(code & 0xffff) / 32767.0f;
+    float y = (short)(code >> 16) / 32767.0f;
+    const float z = 1.0f - fabs(x) - fabs(y);
+    if (z < 0.0f) {
+        const float unfolded_x = (1.0f - fabs(y)) * (x < 0.0f ? -1.0f : 1.0f);
+        const float unfolded_y = (1.0f - fabs(x)) * (y < 0.0f ? -1.0f : 1.0f);
+        x = unfolded_x;
+        y = unfolded_y;
+    }
+    const float norm = sqrt(x * x + y * y + z * z);
+    return make_float4(x / norm, y / norm, z / norm, 0.0f);
+}
+
+// Depth and normal consistency with one source view: the point is projected once
+// and depth and normal come from the same packed texel.
+__device__ void ComputeGeometryConsistencyCosts(const cudaTextureObject_t geometry_image, const Camera ref_camera, const Camera src_camera, const float4 plane_hypothesis, const int2 p, const bool with_normal, float *depth_cost, float *normal_cost)
 {
-    const float max_cost = 3.0f;
+    const float max_depth_cost = 3.0f;
+    const float max_normal_cost = 2.0f;
     float depth = ComputeDepthfromPlaneHypothesis(ref_camera, plane_hypothesis, p);
     float3 forward_point = Get3DPointonWorld_cu(p.x, p.y, depth, ref_camera);
 
     float2 src_pt;
     float src_d;
     ProjectonCamera_cu(forward_point, src_camera, src_pt, src_d);
-    const float src_depth = tex2D<float>(depth_image, (int)src_pt.x + 0.5f, (int)src_pt.y + 0.5f);
+    const uint2 geometry = tex2D<uint2>(geometry_image, (int)src_pt.x + 0.5f, (int)src_pt.y + 0.5f);
+    const float src_depth = __uint_as_float(geometry.x);
+
+    if (with_normal) {
+        const float4 plane_hypothesis_ref = TransformNormal(ref_camera, plane_hypothesis);
+        const float4 plane_hypothesis_src = DecodeGeometryNormal(geometry.y);
+        const float normal_crossview_diff = fabs(plane_hypothesis_ref.x - plane_hypothesis_src.x) + fabs(plane_hypothesis_ref.y - plane_hypothesis_src.y) + fabs(plane_hypothesis_ref.z - plane_hypothesis_src.z);
+        *normal_cost = min(max_normal_cost, normal_crossview_diff);
+    }
 
     if (src_depth == 0.0f) {
-        return max_cost;
+        *depth_cost = max_depth_cost;
+        return;
     }
 
     float3 src_3D_pt = Get3DPointonWorld_cu(src_pt.x, src_pt.y, src_depth, src_camera);
@@ -671,69 +1030,30 @@ __device__ float ComputeDepthConsistencyCost(const cudaTextureObject_t depth_ima
 
     const float diff_col = p.x - backward_point.x;
     const float diff_row = p.y - backward_point.y;
-    return min(max_cost, sqrt(diff_col * diff_col + diff_row * diff_row));
-}
-
-__device__ float ComputeNormConsistencyCost(const cudaTextureObject_t normal_image0, const cudaTextureObject_t normal_image1, const cudaTextureObject_t normal_image2, const Camera ref_camera, const Camera src_camera, const float4 plane_hypothesis, const int2 p)
-{
-    const float max_cost = 2.0f;
-
-    float depth = ComputeDepthfromPlaneHypothesis(ref_camera, plane_hypothesis, p);
-    float3 forward_point = Get3DPointonWorld_cu(p.x, p.y, depth, ref_camera);
-
-    float2 src_pt;
-    float src_d;
-    ProjectonCamera_cu(forward_point, src_camera, src_pt, src_d);
-
-    float4 plane_hypothesis_ref;
-    plane_hypothesis_ref = TransformNormal(ref_camera, plane_hypothesis);
-    float4 plane_hypothesis_src;
-    plane_hypothesis_src.x = tex2D<float>(normal_image0, (int)src_pt.x + 0.5f, (int)src_pt.y + 0.5f);
-    plane_hypothesis_src.y = tex2D<float>(normal_image1, (int)src_pt.x + 0.5f, (int)src_pt.y + 0.5f);
-    plane_hypothesis_src.z = tex2D<float>(normal_image2, (int)src_pt.x + 0.5f, (int)src_pt.y + 0.5f);
-    float normal_crossview_diff = fabs(plane_hypothesis_ref.x - plane_hypothesis_src.x) + fabs(plane_hypothesis_ref.y - plane_hypothesis_src.y) + fabs(plane_hypothesis_ref.z - plane_hypothesis_src.z);
-
-    return min(max_cost, normal_crossview_diff);
+    *depth_cost = min(max_depth_cost, sqrt(diff_col * diff_col + diff_row * diff_row));
 }
 
-__device__ void ComputeMultiViewDepthCostVector(const cudaTextureObject_t* depth_images,
+__device__ void ComputeMultiViewGeometryCostVectors(const cudaTextureObject_t* geometry_images,
                                                 const Camera* cameras,
                                                 const int2 p,
                                                 const float4 plane_hypothesis,
                                                 float* cost_vector_depth,
-                                                const PatchMatchParams params) 
-{
-    for (int i = 1; i < params.num_images; ++i) {
-        if (params.geom_consistency) {
-            cost_vector_depth[i - 1] = ComputeDepthConsistencyCost(depth_images[i], cameras[0], cameras[i], plane_hypothesis, p);
-        }
-        else {
-            cost_vector_depth[i - 1] = 3.0f;
-        }
-    }
-}
-
-__device__ void ComputeMultiViewNormCostVector(const cudaTextureObject_t* normal_image0,
-                                                const cudaTextureObject_t* normal_image1,
-                                                const  cudaTextureObject_t* normal_image2,
-                                                const Camera* cameras,
-                                                const int2 p,
-                                                const float4 plane_hypothesis,
                                                 float* cost_vector_norm,
+                                                const unsigned int visible_views,
                                                 const PatchMatchParams params)
 {
+    const bool with_normal = params.normal_lambda > 0;
     for (int i = 1; i < params.num_images; ++i) {
-        if (params.geom_consistency && params.normal_lambda > 0) {
-            cost_vector_norm[i - 1] = ComputeNormConsistencyCost(normal_image0[i], normal_image1[i], normal_image2[i], cameras[0], cameras[i], plane_hypothesis, p);
-        }
-        else {
-            cost_vector_norm[i - 1] = 2.0f;
+        cost_vector_depth[i - 1] = 3.0f;
+        cost_vector_norm[i - 1] = 2.0f;
+        if (params.geom_consistency && isSet(visible_views, i - 1)) {
+            ComputeGeometryConsistencyCosts(geometry_images[i], cameras[0], cameras[i], plane_hypothesis, p, with_normal, &cost_vector_depth[i - 1], &cost_vector_norm[i - 1]);
         }
     }
 }
 
 
-__global__ void RandomInitialization(cudaTextureObjects *texture_objects, Camera *cameras, float4 *plane_hypotheses,  float4 *scaled_plane_hypotheses, float *costs ,float *pre_costs,  curandState *rand_states, unsigned int *selected_views, const PatchMatchParams params)
+__global__ void RandomInitialization(cudaTextureObjects *texture_objects, Camera *cameras, float4 *plane_hypotheses,  float4 *scaled_plane_hypotheses, float *costs ,float *pre_costs,  curandState *rand_states, unsigned int *selected_views, const unsigned int *tile_views, const float2 *depth_bounds, const PatchMatchParams params)
 {
     const int2 p = make_int2(blockIdx.x * blockDim.x + threadIdx.x, blockIdx.y * blockDim.y + threadIdx.y);
     int width = cameras[0].width;
@@ -744,134 +1064,137 @@ __global__ void RandomInitialization(cudaTextureObjects *texture_objects, Camera
     }
 
     const int center = p.y * width + p.x;
+    const unsigned int visible_views = GetVisibleViews(tile_views, width, p);
     curand_init(clock64(), p.y, p.x, &rand_states[center]);
 
     if (!params.geom_consistency && !params.hierarchy ) {
-        plane_hypotheses[center] = GenerateRandomPlaneHypothesis(cameras[0], p, &rand_states[center], params.depth_min, params.depth_max);
-        costs[center] = ComputeMultiViewInitialCostandSelectedViews(texture_objects[0].images, cameras, p, plane_hypotheses[center], &selected_views[center], params);
+        const float2 depth_bound = GetDepthBound(depth_bounds, center, params);
+        const float seed_depth = params.sparse_seeds ? plane_hypotheses[center].w : 0.0f;
+        if (seed_depth > 0.0f) {
+            // Depth of a sparse SfM point, only the normal is random.
+            plane_hypotheses[center] = GenerateRandomPlaneHypothesis(cameras[0], p, &rand_states[center], seed_depth, seed_depth);
+        }
+        else {
+            plane_hypotheses[center] = GenerateRandomPlaneHypothesis(cameras[0], p, &rand_states[center], depth_bound.x, depth_bound.y);
+        }
+        costs[center] = ComputeMultiViewInitialCostandSelectedViews(texture_objects, cameras, p, plane_hypotheses[center], &selected_views[center], visible_views, params);
     }
     else {
-        if(params.upsample) {
-            const float scale = 1.0 * params.scaled_cols / width;
-            const float sigmad = 0.50;
-            const float sigmar = 25.5;
-            const int Imagescale = max(width / params.scaled_cols , height / params.scaled_rows);
-            const int WinWidth =Imagescale * Imagescale + 1;
-            int num_neighbors = WinWidth / 2;
-
-            const float o_y = p.y * scale;
-            const float o_x = p.x * scale;
-            const float refPix = tex2D<float>(texture_objects[0].images[0], p.x + 0.5f, p.y + 0.5f);
-            int r_y = 0;
-            int r_ys = 0;
-            int r_x = 0;
-            int r_xs = 0;
-            float sgauss = 0.0, rgauss = 0.0, totalgauss = 0.0;
-            float c_total_val = 0.0, normalizing_factor = 0.0;
-            float  srcPix = 0, neighborPix = 0;
-            float4 srcNorm;
-            float4 n_total_val;
-            n_total_val.x = 0; n_total_val.y = 0; n_total_val.z = 0; n_total_val.w = 0;
-            for (int j = -num_neighbors; j <= num_neighbors; ++j) {
-                // source
-                r_y = o_y + j;
-                r_y = (r_y > 0 ? (r_y < params.scaled_rows ? r_y : params.scaled_rows - 1) : 0) ;
-                // reference
-                r_ys = p.y + j;
-                for (int i = -num_neighbors; i <= num_neighbors; ++i) {
-                    // source
-                    r_x = o_x + i;
-                    r_x = (r_x > 0 ? (r_x < params.scaled_cols? r_x : params.scaled_cols - 1) : 0);
-                    const int s_center = r_y*params.scaled_cols+r_x;
-                    if (s_center >=  params.scaled_rows * params.scaled_cols) {
-                        printf("Illegal: %d, %d, %f, %f (%d, %d)\n", r_x, r_y, o_x, o_y, params.scaled_cols,  params.scaled_rows);
-                    }
-                    srcPix = scaled_plane_hypotheses[s_center].w;
-                    srcNorm = scaled_plane_hypotheses[s_center];
-                    // refIm
-                    r_xs = p.x + i;
-                    neighborPix = tex2D<float>(texture_objects[0].images[0], r_xs + 0.5f, r_ys + 0.5f);
-
-                    sgauss = SpatialGauss(o_x, o_y, r_x, r_y, sigmad);
-                    rgauss = RangeGauss(fabs(refPix - neighborPix), sigmar);
-                    totalgauss = sgauss * rgauss;
-                    normalizing_factor += totalgauss;
-                    c_total_val += srcPix * totalgauss;
-                    mul4((&srcNorm), totalgauss);
-                    n_total_val.x  = n_total_val.x + srcNorm.x;
-                    n_total_val.y  = n_total_val.y + srcNorm.y;
-                    n_total_val.z  = n_total_val.z + srcNorm.z;
-                }
-            }
-            costs[center] = c_total_val / normalizing_factor;
-            vecdiv4((&n_total_val), normalizing_factor);
-            NormalizeVec3(&n_total_val);
-
-            costs[center] = ComputeMultiViewInitialCostandSelectedViews(texture_objects[0].images, cameras, p, plane_hypotheses[center], &selected_views[center], params);
-            pre_costs[center] = costs[center];
-
-            float4 plane_hypothesis = n_total_val;
-            plane_hypothesis = TransformNormal2RefCam(cameras[0], plane_hypothesis);
-            float depth = plane_hypotheses[center].w;
-            plane_hypothesis.w = GetDistance2Origin(cameras[0], p, depth, plane_hypothesis);
-            plane_hypotheses[center] = plane_hypothesis;
-            costs[center] = ComputeMultiViewInitialCostandSelectedViews(texture_objects[0].images, cameras, p, plane_hypotheses[center], &selected_views[center], params);
-         }
-         else {
-             float4 plane_hypothesis;
-             if (params.hierarchy) {
-                 plane_hypothesis = scaled_plane_hypotheses[center];
-             }
-             else {
-                 plane_hypothesis = plane_hypotheses[center];
-             }
-             plane_hypothesis = TransformNormal2RefCam(cameras[0], plane_hypothesis);
-             float depth = plane_hypothesis.w;
-             plane_hypothesis.w = GetDistance2Origin(cameras[0], p, depth, plane_hypothesis);
-             plane_hypotheses[center] = plane_hypothesis;
-             costs[center] = ComputeMultiViewInitialCostandSelectedViews(texture_objects[0].images, cameras, p, plane_hypotheses[center], &selected_views[center], params);
-         }
+        // Geometric passes start from the planes of the last pass, hierarchy passes from the upsampled seeds.
+        float4 plane_hypothesis;
+        if (params.hierarchy) {
+            plane_hypothesis = scaled_plane_hypotheses[center];
+        }
+        else {
+            plane_hypothesis = plane_hypotheses[center];
+        }
+        plane_hypothesis = TransformNormal2RefCam(cameras[0], plane_hypothesis);
+        float depth = plane_hypothesis.w;
+        if (params.hierarchy) {
+            // Hierarchy updates have to beat the upsampled depth on a fronto-parallel plane.
+            float4 fronto_parallel = make_float4(0.0f, 0.0f, -1.0f, 0.0f);
+            fronto_parallel.w = GetDistance2Origin(cameras[0], p, depth, fronto_parallel);
+            pre_costs[center] = ComputeMultiViewInitialCostandSelectedViews(texture_objects, cameras, p, fronto_parallel, &selected_views[center], visible_views, params);
+        }
+        plane_hypothesis.w = GetDistance2Origin(cameras[0], p, depth, plane_hypothesis);
+        plane_hypotheses[center] = plane_hypothesis;
+        costs[center] = ComputeMultiViewInitialCostandSelectedViews(texture_objects, cameras, p, plane_hypotheses[center], &selected_views[center], visible_views, params);
     }
 }
 
-__device__ void PlaneHypothesisRefinement(const cudaTextureObject_t *images, const cudaTextureObject_t* depth_images, const cudaTextureObject_t* normal0_images, const cudaTextureObject_t *normal1_images, const cudaTextureObject_t* normal2_images, const Camera *cameras, float4 *plane_hypothesis, float4* plane_hypotheses, float *depth, float *cost, curandState *rand_state, const float *view_weights, const float weight_norm, const int2 p, const PatchMatchParams params)
+// Returns the number of planes that got the full photometric cost.
+__device__ int PlaneHypothesisRefinement(const cudaTextureObjects *texture_objects, const cudaTextureObject_t* geometry_images, const Camera *cameras, float4 *plane_hypothesis, float4* plane_hypotheses, float *depth, float *cost, curandState *rand_state, const float *view_weights, const float weight_norm, const unsigned int weighted_views, const float2 depth_bound, const int2 p, const PatchMatchParams params)
 {
     float perturbation = 0.02f;
     // float lambda_mm = 0.9f;
-    float depth_rand = curand_uniform(rand_state) * (params.depth_max - params.depth_min) + params.depth_min;
+    // Restarts and perturbations stay inside the search interval of the pixel.
+    const float depth_min = depth_bound.x;
+    const float depth_max = depth_bound.y;
+    float depth_rand = curand_uniform(rand_state) * (depth_max - depth_min) + depth_min;
     float4 plane_hypothesis_rand = GenerateRandomNormal(cameras[0], p, rand_state, *depth);
     float depth_perturbed = *depth;
     float depth_min_perturbed = (1 - perturbation) * depth_perturbed;
     float depth_max_perturbed = (1 + perturbation) * depth_perturbed;
-    if (depth_min_perturbed < params.depth_min || depth_min_perturbed > params.depth_max) {
-        depth_min_perturbed = params.depth_min;
+    if (depth_min_perturbed < depth_min || depth_min_perturbed > depth_max) {
+        depth_min_perturbed = depth_min;
     }
-    if (depth_max_perturbed < params.depth_min || depth_max_perturbed > params.depth_max) {
-        depth_max_perturbed = params.depth_max;
+    if (depth_max_perturbed < depth_min || depth_max_perturbed > depth_max) {
+        depth_max_perturbed = depth_max;
     }
     do {
         depth_perturbed = curand_uniform(rand_state) * (depth_max_perturbed - depth_min_perturbed) + depth_min_perturbed;
-    } while (depth_perturbed < params.depth_min || depth_perturbed > params.depth_max);
+    } while (depth_perturbed < depth_min || depth_perturbed > depth_max);
     float4 plane_hypothesis_perturbed = GeneratePerturbedNormal(cameras[0], p, *plane_hypothesis, rand_state, perturbation * M_PI);
 
     const int num_planes = 5;
     float depths[num_planes] = {depth_rand, *depth, depth_rand, *depth, depth_perturbed};
     float4 normals[num_planes] = {*plane_hypothesis, plane_hypothesis_rand, plane_hypothesis_rand, plane_hypothesis_perturbed, *plane_hypothesis};
 
+    float4 temp_plane_hypotheses[num_planes];
+    float cost_vectors[num_planes][32];
+    bool candidates[num_planes];
+    for (int i = 0; i < num_planes; ++i) {
+        temp_plane_hypotheses[i] = normals[i];
+        temp_plane_hypotheses[i].w = GetDistance2Origin(cameras[0], p, depths[i], temp_plane_hypotheses[i]);
+        // Planes outside the depth range are never taken, their costs are not needed.
+        const float depth_before = ComputeDepthfromPlaneHypothesis(cameras[0], temp_plane_hypotheses[i], p);
+        candidates[i] = depth_before >= params.depth_min && depth_before <= params.depth_max;
+    }
+
+    float4 batch_planes[num_planes];
+    float *batch_cost_vectors[num_planes];
+    int num_batch_planes = 0;
+    if (params.cascade) {
+        // Lower bounds from the sparse taps first. The weighted photometric bound is a
+        // lower bound of the refinement cost, the geometric terms are non-negative,
+        // so a plane whose bound reaches the current cost can never be taken.
+        for (int i = 0; i < num_planes; ++i) {
+            if (candidates[i]) {
+                batch_planes[num_batch_planes] = temp_plane_hypotheses[i];
+                batch_cost_vectors[num_batch_planes] = cost_vectors[i];
+                num_batch_planes++;
+            }
+        }
+        ComputeMultiViewCostBoundVectors(texture_objects, cameras, p, batch_planes, num_batch_planes, batch_cost_vectors, weighted_views, params);
+        for (int i = 0; i < num_planes; ++i) {
+            if (!candidates[i]) {
+                continue;
+            }
+            float cost_bound = 0.0f;
+            for (int j = 0; j < params.num_images - 1; ++j) {
+                if (view_weights[j] > 0) {
+                    cost_bound += view_weights[j] * cost_vectors[i][j];
+                }
+            }
+            candidates[i] = cost_bound / weight_norm - params.cascade_tolerance < *cost;
+        }
+    }
+
+    num_batch_planes = 0;
+    for (int i = 0; i < num_planes; ++i) {
+        if (candidates[i]) {
+            batch_planes[num_batch_planes] = temp_plane_hypotheses[i];
+            batch_cost_vectors[num_batch_planes] = cost_vectors[i];
+            num_batch_planes++;
+        }
+    }
+    ComputeMultiViewCostVectors(texture_objects, cameras, p, batch_planes, num_batch_planes, batch_cost_vectors, weighted_views, params);
+
     for (int i = 0; i < num_planes; ++i) {
-        float cost_vector[32] = {2.0f};
+        if (!candidates[i]) {
+            continue;
+        }
+        const float *cost_vector = cost_vectors[i];
         float cost_depth_vector[32] = { 3.0f };
         float cost_norm_vector[32] = { 2.0f };
-        float4 temp_plane_hypothesis = normals[i];
-        temp_plane_hypothesis.w = GetDistance2Origin(cameras[0], p, depths[i], temp_plane_hypothesis);
-        ComputeMultiViewCostVector(images, cameras, p, temp_plane_hypothesis, cost_vector, params);
-        ComputeMultiViewDepthCostVector(depth_images, cameras, p, temp_plane_hypothesis, cost_depth_vector, params);
+        const float4 temp_plane_hypothesis = temp_plane_hypotheses[i];
+        ComputeMultiViewGeometryCostVectors(geometry_images, cameras, p, temp_plane_hypothesis, cost_depth_vector, cost_norm_vector, weighted_views, params);
 
         float temp_cost = 0.0f;
         for (int j = 0; j < params.num_images - 1; ++j) {
             if (view_weights[j] > 0) {
                 if (params.geom_consistency) {    
-                    temp_cost += view_weights[j] * (cost_vector[j] + 0.2 * cost_depth_vector[j] + 0.2 * params.normal_lambda * cost_norm_vector[i]);
+                    temp_cost += view_weights[j] * (cost_vector[j] + 0.2 * cost_depth_vector[j] + 0.2 * params.normal_lambda * cost_norm_vector[j]);
                 }
                 else {
                     temp_cost += view_weights[j] * cost_vector[j];
@@ -886,9 +1209,10 @@ __device__ void PlaneHypothesisRefinement(const cudaTextureObject_t *images, con
             *cost = temp_cost;
         }
     }
+    return num_batch_planes;
 }
 
-__device__ void CheckerboardPropagation(const cudaTextureObject_t *images, const cudaTextureObject_t *depths, const cudaTextureObject_t* normals0, const cudaTextureObject_t* normals1, const cudaTextureObject_t* normals2, const Camera *cameras, float4 *plane_hypotheses, float4* pre_plane_hypotheses, float *costs, float *pre_costs, curandState *rand_states, unsigned int *selected_views, const int2 p, const PatchMatchParams params, const int iter)
+__device__ void CheckerboardPropagation(const cudaTextureObjects *texture_objects, const cudaTextureObject_t *geometries, const Camera *cameras, float4 *plane_hypotheses, float4* pre_plane_hypotheses, float *costs, float *pre_costs, curandState *rand_states, unsigned int *selected_views, const unsigned int *tile_views, const float2 *depth_bounds, float *view_costs, float4 *cached_planes, unsigned long long *cost_evaluations, ConvergenceStats *convergence, const int2 p, const PatchMatchParams params, const int iter)
 {
     int width = cameras[0].width;
     int height = cameras[0].height;
@@ -897,6 +1221,7 @@ __device__ void CheckerboardPropagation(const cudaTextureObject_t *images, const
     }
 
     const int center = p.y * width + p.x;
+    const unsigned int visible_views = GetVisibleViews(tile_views, width, p);
     int left_near = center - 1;
     int left_far = center - 3;
     int right_near = center + 1;
@@ -934,9 +1259,7 @@ __device__ void CheckerboardPropagation(const cudaTextureObject_t *images, const
             }
         }
         up_far = costMinPoint;
-        ComputeMultiViewCostVector(images, cameras, p, plane_hypotheses[up_far], cost_array[1], params);
-        ComputeMultiViewDepthCostVector(depths, cameras, p, plane_hypotheses[up_far], cost_array_depth[1], params);
-        ComputeMultiViewNormCostVector(normals0, normals1, normals2, cameras, p, plane_hypotheses[up_far], cost_array_norm[1], params);
+        ComputeMultiViewGeometryCostVectors(geometries, cameras, p, plane_hypotheses[up_far], cost_array_depth[1], cost_array_norm[1], visible_views, params);
     }
 
     //down_far
@@ -955,9 +1278,7 @@ __device__ void CheckerboardPropagation(const cudaTextureObject_t *images, const
             }
         }
         down_far = costMinPoint;
-        ComputeMultiViewCostVector(images, cameras, p, plane_hypotheses[down_far], cost_array[3], params);
-        ComputeMultiViewDepthCostVector(depths, cameras, p, plane_hypotheses[down_far], cost_array_depth[3], params);
-        ComputeMultiViewNormCostVector(normals0, normals1, normals2, cameras, p, plane_hypotheses[down_far], cost_array_norm[3], params);
+        ComputeMultiViewGeometryCostVectors(geometries, cameras, p, plane_hypotheses[down_far], cost_array_depth[3], cost_array_norm[3], visible_views, params);
     }
 
     //left_far
@@ -976,9 +1297,7 @@ __device__ void CheckerboardPropagation(const cudaTextureObject_t *images, const
             }
         }
         left_far = costMinPoint;
-        ComputeMultiViewCostVector(images, cameras, p, plane_hypotheses[left_far], cost_array[5], params);
-        ComputeMultiViewDepthCostVector(depths, cameras, p, plane_hypotheses[left_far], cost_array_depth[5], params);
-        ComputeMultiViewNormCostVector(normals0, normals1, normals2, cameras, p, plane_hypotheses[left_far], cost_array_norm[5], params);
+        ComputeMultiViewGeometryCostVectors(geometries, cameras, p, plane_hypotheses[left_far], cost_array_depth[5], cost_array_norm[5], visible_views, params);
     }
 
     //right_far
@@ -997,9 +1316,7 @@ __device__ void CheckerboardPropagation(const cudaTextureObject_t *images, const
             }
         }
         right_far = costMinPoint;
-        ComputeMultiViewCostVector(images, cameras, p, plane_hypotheses[right_far], cost_array[7], params);
-        ComputeMultiViewDepthCostVector(depths, cameras, p, plane_hypotheses[right_far], cost_array_depth[7], params);
-        ComputeMultiViewNormCostVector(normals0, normals1, normals2, cameras, p, plane_hypotheses[right_far], cost_array_norm[7], params);
+        ComputeMultiViewGeometryCostVectors(geometries, cameras, p, plane_hypotheses[right_far], cost_array_depth[7], cost_array_norm[7], visible_views, params);
     }
 
     int near_len = 10;
@@ -1027,9 +1344,7 @@ __device__ void CheckerboardPropagation(const cudaTextureObject_t *images, const
             }
         }
         up_near = costMinPoint;
-        ComputeMultiViewCostVector(images, cameras, p, plane_hypotheses[up_near], cost_array[0], params);
-        ComputeMultiViewDepthCostVector(depths, cameras, p, plane_hypotheses[up_near], cost_array_depth[0], params);
-        ComputeMultiViewNormCostVector(normals0, normals1, normals2, cameras, p, plane_hypotheses[up_near], cost_array_norm[0], params);
+        ComputeMultiViewGeometryCostVectors(geometries, cameras, p, plane_hypotheses[up_near], cost_array_depth[0], cost_array_norm[0], visible_views, params);
     }
 
     //down_near
@@ -1055,9 +1370,7 @@ __device__ void CheckerboardPropagation(const cudaTextureObject_t *images, const
             }
         }
         down_near = costMinPoint;
-        ComputeMultiViewCostVector(images, cameras, p, plane_hypotheses[down_near], cost_array[2], params);
-        ComputeMultiViewDepthCostVector(depths, cameras, p, plane_hypotheses[down_near], cost_array_depth[2], params);
-        ComputeMultiViewNormCostVector(normals0, normals1, normals2, cameras, p, plane_hypotheses[down_near], cost_array_norm[2], params);
+        ComputeMultiViewGeometryCostVectors(geometries, cameras, p, plane_hypotheses[down_near], cost_array_depth[2], cost_array_norm[2], visible_views, params);
     }
 
     //left_near
@@ -1083,9 +1396,7 @@ __device__ void CheckerboardPropagation(const cudaTextureObject_t *images, const
             }
         }
         left_near = costMinPoint;
-        ComputeMultiViewCostVector(images, cameras, p, plane_hypotheses[left_near], cost_array[4], params);
-        ComputeMultiViewDepthCostVector(depths, cameras, p, plane_hypotheses[left_near], cost_array_depth[4], params);
-        ComputeMultiViewNormCostVector(normals0, normals1, normals2, cameras, p, plane_hypotheses[left_near], cost_array_norm[4], params);
+        ComputeMultiViewGeometryCostVectors(geometries, cameras, p, plane_hypotheses[left_near], cost_array_depth[4], cost_array_norm[4], visible_views, params);
     }
 
     //right_near
@@ -1111,13 +1422,33 @@ __device__ void CheckerboardPropagation(const cudaTextureObject_t *images, const
             }
         }
         right_near = costMinPoint;
-        ComputeMultiViewCostVector(images, cameras, p, plane_hypotheses[right_near], cost_array[6], params);
-        ComputeMultiViewDepthCostVector(depths, cameras, p, plane_hypotheses[right_near], cost_array_depth[6], params);
-        ComputeMultiViewNormCostVector(normals0, normals1, normals2, cameras, p, plane_hypotheses[right_near], cost_array_norm[6], params);
+        ComputeMultiViewGeometryCostVectors(geometries, cameras, p, plane_hypotheses[right_near], cost_array_depth[6], cost_array_norm[6], visible_views, params);
     }
 
     const int positions[8] = {up_near, up_far, down_near, down_far, left_near, left_far, right_near, right_far};
 
+    float cost_vector_now[32] = {2.0f};
+    const float4 plane_hypothesis_center = plane_hypotheses[center];
+    const bool cached_now = params.cost_cache && IsSamePlane(cached_planes[center], plane_hypothesis_center);
+    // The valid neighbours and the current plane share one pass over the reference patch per view.
+    float4 batch_planes[MAX_BATCH_HYPOTHESES];
+    float *batch_cost_vectors[MAX_BATCH_HYPOTHESES];
+    int num_batch_planes = 0;
+    for (int i = 0; i < 8; ++i) {
+        if (flag[i]) {
+            batch_planes[num_batch_planes] = plane_hypotheses[positions[i]];
+            batch_cost_vectors[num_batch_planes] = cost_array[i];
+            num_batch_planes++;
+        }
+    }
+    if (params.cost_cache && !cached_now) {
+        // The cache keeps the costs of all views, the weights change every iteration.
+        batch_planes[num_batch_planes] = plane_hypothesis_center;
+        batch_cost_vectors[num_batch_planes] = cost_vector_now;
+        num_batch_planes++;
+    }
+    ComputeMultiViewCostVectors(texture_objects, cameras, p, batch_planes, num_batch_planes, batch_cost_vectors, visible_views, params);
+
      //Multi-hypothesis Joint View Selection
     float view_weights[32] = {0.0f};
     float view_selection_priors[32] = {0.0f};
@@ -1204,12 +1535,43 @@ __device__ void CheckerboardPropagation(const cudaTextureObject_t *images, const
 
     const int min_cost_idx = FindMinCostIndex(final_costs, 8);
 
-    float cost_vector_now[32] = {2.0f};
+    // Views without weight do not contribute to cost_now and the refinement.
+    const unsigned int weighted_views = visible_views & temp_selected_views;
+    const unsigned int now_views = params.cost_cache ? visible_views : weighted_views;
+    unsigned int num_evaluations = __popc(visible_views) * num_batch_planes;
+
     float cost_vector_depth_now[32] = { 3.0f };
     float cost_vector_norm_now[32] = { 2.0f };
-    ComputeMultiViewCostVector(images, cameras, p, plane_hypotheses[center], cost_vector_now, params);
-    ComputeMultiViewDepthCostVector(depths, cameras, p, plane_hypotheses[center], cost_vector_depth_now, params);
-    ComputeMultiViewNormCostVector(normals0, normals1, normals2, cameras, p, plane_hypotheses[center], cost_vector_norm_now, params);
+    const int num_src_images = params.num_images - 1;
+    const int num_pixels = width * height;
+    if (cached_now) {
+        // The plane did not change since its costs were stored.
+        for (int i = 0; i < num_src_images; ++i) {
+            cost_vector_now[i] = view_costs[i * num_pixels + center];
+            if (params.geom_consistency) {
+                cost_vector_depth_now[i] = view_costs[(num_src_images + i) * num_pixels + center];
+                cost_vector_norm_now[i] = view_costs[(2 * num_src_images + i) * num_pixels + center];
+            }
+        }
+    }
+    else {
+        if (!params.cost_cache) {
+            float *cost_vector_now_ptr = cost_vector_now;
+            ComputeMultiViewCostVectors(texture_objects, cameras, p, &plane_hypothesis_center, 1, &cost_vector_now_ptr, weighted_views, params);
+            num_evaluations += __popc(weighted_views);
+        }
+        ComputeMultiViewGeometryCostVectors(geometries, cameras, p, plane_hypothesis_center, cost_vector_depth_now, cost_vector_norm_now, now_views, params);
+        if (params.cost_cache) {
+            for (int i = 0; i < num_src_images; ++i) {
+                view_costs[i * num_pixels + center] = cost_vector_now[i];
+                if (params.geom_consistency) {
+                    view_costs[(num_src_images + i) * num_pixels + center] = cost_vector_depth_now[i];
+                    view_costs[(2 * num_src_images + i) * num_pixels + center] = cost_vector_norm_now[i];
+                }
+            }
+            cached_planes[center] = plane_hypothesis_center;
+        }
+    }
     float cost_now = 0.0f;
     for (int i = 0; i < params.num_images - 1; ++i) {
         if (params.geom_consistency) {
@@ -1240,8 +1602,12 @@ __device__ void CheckerboardPropagation(const cudaTextureObject_t *images, const
         }
     }
 
-    PlaneHypothesisRefinement(images, depths, normals0, normals1, normals2,cameras, &plane_hypotheses_now, plane_hypotheses, &depth_now, &cost_now, &rand_states[center], view_weights, weight_norm, p, params);
-    
+    const int num_refined_planes = PlaneHypothesisRefinement(texture_objects, geometries, cameras, &plane_hypotheses_now, plane_hypotheses, &depth_now, &cost_now, &rand_states[center], view_weights, weight_norm, weighted_views, GetDepthBound(depth_bounds, center, params), p, params);
+    num_evaluations += num_refined_planes * __popc(weighted_views);
+    atomicAdd(cost_evaluations, static_cast<unsigned long long>(num_evaluations));
+
+    const float4 plane_before = plane_hypotheses[center];
+    const float cost_before = costs[center];
     if (params.hierarchy) {
         if (cost_now < pre_costs[center] - 0.1f) {
             costs[center] = cost_now;
@@ -1262,9 +1628,17 @@ __device__ void CheckerboardPropagation(const cudaTextureObject_t *images, const
         costs[center] = cost_now;
         plane_hypotheses[center] = plane_hypotheses_now;
     }
+
+    if (params.adaptive) {
+        const float4 plane_after = plane_hypotheses[center];
+        if (plane_after.x != plane_before.x || plane_after.y != plane_before.y || plane_after.z != plane_before.z || plane_after.w != plane_before.w) {
+            atomicAdd(&convergence->changed_pixels, 1u);
+            atomicAdd(&convergence->cost_improvement, cost_before - costs[center]);
+        }
+    }
 }
 
-__global__ void BlackPixelUpdate(cudaTextureObjects *texture_objects, cudaTextureObjects *texture_depths, cudaTextureObjects* texture_normals0, cudaTextureObjects* texture_normals1, cudaTextureObjects* texture_normals2, Camera *cameras, float4 *plane_hypotheses, float4* pre_plane_hypotheses, float *costs,  float *pre_costs,  curandState *rand_states, unsigned int *selected_views, const PatchMatchParams params, const int iter)
+__global__ void BlackPixelUpdate(cudaTextureObjects *texture_objects, cudaTextureObjects *texture_geometries, Camera *cameras, float4 *plane_hypotheses, float4* pre_plane_hypotheses, float *costs,  float *pre_costs,  curandState *rand_states, unsigned int *selected_views, const unsigned int *tile_views, const float2 *depth_bounds, float *view_costs, float4 *cached_planes, unsigned long long *cost_evaluations, ConvergenceStats *convergence, const PatchMatchParams params, const int iter)
 {
     int2 p = make_int2(blockIdx.x * blockDim.x + threadIdx.x, blockIdx.y * blockDim.y + threadIdx.y);
     if (threadIdx.x % 2 == 0) {
@@ -1272,10 +1646,10 @@ __global__ void BlackPixelUpdate(cudaTextureObjects *texture_objects, cudaTextur
     } else {
         p.y = p.y * 2 + 1;
     }
-    CheckerboardPropagation(texture_objects[0].images, texture_depths[0].images, texture_normals0[0].images, texture_normals1[0].images, texture_normals2[0].images, cameras, plane_hypotheses,pre_plane_hypotheses, costs, pre_costs, rand_states, selected_views, p, params, iter);
+    CheckerboardPropagation(texture_objects, texture_geometries[0].images, cameras, plane_hypotheses,pre_plane_hypotheses, costs, pre_costs, rand_states, selected_views, tile_views, depth_bounds, view_costs, cached_planes, cost_evaluations, convergence, p, params, iter);
 }
 
-__global__ void RedPixelUpdate(cudaTextureObjects *texture_objects, cudaTextureObjects *texture_depths, cudaTextureObjects* texture_normals0, cudaTextureObjects* texture_normals1, cudaTextureObjects* texture_normals2,  Camera *cameras, float4 *plane_hypotheses, float4* pre_plane_hypotheses, float *costs,  float *pre_costs, curandState *rand_states, unsigned int *selected_views, const PatchMatchParams params, const int iter)
+__global__ void RedPixelUpdate(cudaTextureObjects *texture_objects, cudaTextureObjects *texture_geometries, Camera *cameras, float4 *plane_hypotheses, float4* pre_plane_hypotheses, float *costs,  float *pre_costs, curandState *rand_states, unsigned int *selected_views, const unsigned int *tile_views, const float2 *depth_bounds, float *view_costs, float4 *cached_planes, unsigned long long *cost_evaluations, ConvergenceStats *convergence, const PatchMatchParams params, const int iter)
 {
     int2 p = make_int2(blockIdx.x * blockDim.x + threadIdx.x, blockIdx.y * blockDim.y + threadIdx.y);
     if (threadIdx.x % 2 == 0) {
@@ -1284,7 +1658,7 @@ __global__ void RedPixelUpdate(cudaTextureObjects *texture_objects, cudaTextureO
         p.y = p.y * 2;
     }
 
-    CheckerboardPropagation(texture_objects[0].images, texture_depths[0].images, texture_normals0[0].images, texture_normals1[0].images, texture_normals2[0].images, cameras, plane_hypotheses, pre_plane_hypotheses, costs, pre_costs, rand_states, selected_views, p, params, iter);
+    CheckerboardPropagation(texture_objects, texture_geometries[0].images, cameras, plane_hypotheses, pre_plane_hypotheses, costs, pre_costs, rand_states, selected_views, tile_views, depth_bounds, view_costs, cached_planes, cost_evaluations, convergence, p, params, iter);
 }
 
 __global__ void GetDepthandNormal(Camera *cameras, float4 *plane_hypotheses, const PatchMatchParams params)
@@ -1316,10 +1690,25 @@ __global__ void RecordPreCost(float* costs, float* pre_costs, Camera* cameras, f
     pre_plane_hypotheses[center] = plane_hypotheses[center];
 }
 
+// Reads and clears the counters of the last sweep and adds them to the pass.
+// A sweep has converged when it replaced few planes and barely lowered the mean cost.
+bool CNVR::SweepConverged(const char *phase, const int iteration, const int num_pixels)
+{
+    ConvergenceStats stats;
+    cudaMemcpy(&stats, convergence_cuda, sizeof(ConvergenceStats), cudaMemcpyDeviceToHost);
+    cudaMemset(convergence_cuda, 0, sizeof(ConvergenceStats));
+    pass_changed_pixels += stats.changed_pixels;
+    pass_cost_improvement += stats.cost_improvement;
+    const float changed = static_cast<float>(stats.changed_pixels) / num_pixels;
+    const float improvement = stats.cost_improvement / num_pixels;
+    printf("%s: %d, %.2f%% planes changed, mean cost -%.4f\n", phase, iteration, 100.0f * changed, improvement);
+    return changed < params.converged_fraction && improvement < params.converged_improvement;
+}
+
 void CNVR::RunPatchMatch()
 {
-    const int width = cameras[0].width;
-    const int height = cameras[0].height;
+    const int width = tile_cameras[0].width;
+    const int height = tile_cameras[0].height;
 
     int BLOCK_W = 32;
     int BLOCK_H = (BLOCK_W / 2);
@@ -1343,124 +1732,74 @@ void CNVR::RunPatchMatch()
     block_size_checkerboard.z = 1;
 
     int max_iterations = params.max_iterations;
+    if (params.cost_cache) {
+        // NaN planes never match, every pixel computes its costs once.
+        cudaMemset(cached_planes_cuda, 0xFF, sizeof(float4) * width * height);
+    }
+
+    cudaEvent_t propagation_start, propagation_stop;
+    cudaEventCreate(&propagation_start);
+    cudaEventCreate(&propagation_stop);
 
-    RandomInitialization<<<grid_size_randinit, block_size_randinit>>>(texture_objects_cuda, cameras_cuda, plane_hypotheses_cuda, scaled_plane_hypotheses_cuda, costs_cuda, pre_costs_cuda, rand_states_cuda, selected_views_cuda, params);
+    RandomInitialization<<<grid_size_randinit, block_size_randinit>>>(texture_objects_cuda, cameras_cuda, plane_hypotheses_cuda, scaled_plane_hypotheses_cuda, costs_cuda, pre_costs_cuda, rand_states_cuda, selected_views_cuda, tile_views_cuda, depth_bounds_cuda, params);
     CUDA_SAFE_CALL(cudaDeviceSynchronize());
+    cudaMemset(cost_evaluations_cuda, 0, sizeof(unsigned long long));
+    cudaMemset(convergence_cuda, 0, sizeof(ConvergenceStats));
+    pass_pixels += static_cast<double>(width) * height;
+    int num_sweeps = 0;
+    cudaEventRecord(propagation_start);
     for (int i = 0; i < max_iterations; ++i) {
-        BlackPixelUpdate << <grid_size_checkerboard, block_size_checkerboard >> > (texture_objects_cuda, texture_depths_cuda, texture_normals0_cuda, texture_normals1_cuda, texture_normals2_cuda, cameras_cuda, plane_hypotheses_cuda, pre_plane_hypotheses_cuda, costs_cuda, pre_costs_cuda, rand_states_cuda, selected_views_cuda, params, i);
+        BlackPixelUpdate << <grid_size_checkerboard, block_size_checkerboard >> > (texture_objects_cuda, texture_geometries_cuda, cameras_cuda, plane_hypotheses_cuda, pre_plane_hypotheses_cuda, costs_cuda, pre_costs_cuda, rand_states_cuda, selected_views_cuda, tile_views_cuda, depth_bounds_cuda, view_costs_cuda, cached_planes_cuda, cost_evaluations_cuda, convergence_cuda, params, i);
         CUDA_SAFE_CALL(cudaDeviceSynchronize());
-        RedPixelUpdate << <grid_size_checkerboard, block_size_checkerboard >> > (texture_objects_cuda, texture_depths_cuda, texture_normals0_cuda, texture_normals1_cuda, texture_normals2_cuda, cameras_cuda, plane_hypotheses_cuda, pre_plane_hypotheses_cuda, costs_cuda, pre_costs_cuda, rand_states_cuda, selected_views_cuda, params, i);
+        RedPixelUpdate << <grid_size_checkerboard, block_size_checkerboard >> > (texture_objects_cuda, texture_geometries_cuda, cameras_cuda, plane_hypotheses_cuda, pre_plane_hypotheses_cuda, costs_cuda, pre_costs_cuda, rand_states_cuda, selected_views_cuda, tile_views_cuda, depth_bounds_cuda, view_costs_cuda, cached_planes_cuda, cost_evaluations_cuda, convergence_cuda, params, i);
         CUDA_SAFE_CALL(cudaDeviceSynchronize());
-        printf("iteration: %d\n", i);
+        num_sweeps++;
+        if (!params.adaptive) {
+            printf("iteration: %d\n", i);
+        }
+        else if (SweepConverged("iteration", i, width * height) && i + 1 < max_iterations) {
+            printf("converged, %d iterations skipped\n", max_iterations - i - 1);
+            break;
+        }
     }
     params.repair = true;
+    if (params.cost_cache) {
+        // Repair iterations score with CNCC, the stored NCC costs are stale.
+        cudaMemset(cached_planes_cuda, 0xFF, sizeof(float4) * width * height);
+    }
     RecordPreCost <<<grid_size_randinit, block_size_randinit >>> (costs_cuda, pre_costs_cuda, cameras_cuda, plane_hypotheses_cuda, pre_plane_hypotheses_cuda);
     CUDA_SAFE_CALL(cudaDeviceSynchronize());
     for (int i = 0; i < params.repair_iter; ++i) {
-        BlackPixelUpdate << <grid_size_checkerboard, block_size_checkerboard >> > (texture_objects_cuda, texture_depths_cuda, texture_normals0_cuda, texture_normals1_cuda, texture_normals2_cuda, cameras_cuda, plane_hypotheses_cuda, pre_plane_hypotheses_cuda, costs_cuda, pre_costs_cuda, rand_states_cuda, selected_views_cuda, params, i);
+        BlackPixelUpdate << <grid_size_checkerboard, block_size_checkerboard >> > (texture_objects_cuda, texture_geometries_cuda, cameras_cuda, plane_hypotheses_cuda, pre_plane_hypotheses_cuda, costs_cuda, pre_costs_cuda, rand_states_cuda, selected_views_cuda, tile_views_cuda, depth_bounds_cuda, view_costs_cuda, cached_planes_cuda, cost_evaluations_cuda, convergence_cuda, params, i);
         CUDA_SAFE_CALL(cudaDeviceSynchronize());
-        RedPixelUpdate << <grid_size_checkerboard, block_size_checkerboard >> > (texture_objects_cuda, texture_depths_cuda, texture_normals0_cuda, texture_normals1_cuda, texture_normals2_cuda, cameras_cuda, plane_hypotheses_cuda, pre_plane_hypotheses_cuda, costs_cuda, pre_costs_cuda, rand_states_cuda, selected_views_cuda, params, i);
+        RedPixelUpdate << <grid_size_checkerboard, block_size_checkerboard >> > (texture_objects_cuda, texture_geometries_cuda, cameras_cuda, plane_hypotheses_cuda, pre_plane_hypotheses_cuda, costs_cuda, pre_costs_cuda, rand_states_cuda, selected_views_cuda, tile_views_cuda, depth_bounds_cuda, view_costs_cuda, cached_planes_cuda, cost_evaluations_cuda, convergence_cuda, params, i);
         CUDA_SAFE_CALL(cudaDeviceSynchronize());
-        printf("repair: %d\n", i);
+        num_sweeps++;
+        if (!params.adaptive) {
+            printf("repair: %d\n", i);
+        }
+        else if (SweepConverged("repair", i, width * height) && i + 2 < params.repair_iter) {
+            // The last repair iteration decides between the repaired and the recorded planes.
+            printf("converged, %d repair iterations skipped\n", params.repair_iter - i - 2);
+            i = params.repair_iter - 2;
+        }
     }
+    cudaEventRecord(propagation_stop);
+    cudaEventSynchronize(propagation_stop);
+    float propagation_ms = 0.0f;
+    cudaEventElapsedTime(&propagation_ms, propagation_start, propagation_stop);
+    const char *storage_names[] = {"float", "fp16", "uint8"};
+    printf("propagation: %.1f ms with %s images\n", propagation_ms, storage_names[params.image_storage]);
+    cudaEventDestroy(propagation_start);
+    cudaEventDestroy(propagation_stop);
+    unsigned long long cost_evaluations = 0;
+    cudaMemcpy(&cost_evaluations, cost_evaluations_cuda, sizeof(unsigned long long), cudaMemcpyDeviceToHost);
+    printf("photometric cost evaluations: %.1f per pixel and iteration\n", static_cast<double>(cost_evaluations) / (static_cast<double>(width) * height * num_sweeps));
 
     GetDepthandNormal<<<grid_size_randinit, block_size_randinit>>>(cameras_cuda, plane_hypotheses_cuda, params);
     CUDA_SAFE_CALL(cudaDeviceSynchronize());
     cudaMemcpy(plane_hypotheses_host, plane_hypotheses_cuda, sizeof(float4) * width * height, cudaMemcpyDeviceToHost);
     cudaMemcpy(costs_host, costs_cuda, sizeof(float) * width * height, cudaMemcpyDeviceToHost);
+    cudaMemcpy(selected_views_host, selected_views_cuda, sizeof(unsigned int) * width * height, cudaMemcpyDeviceToHost);
     CUDA_SAFE_CALL(cudaDeviceSynchronize());
 }
-
-__global__ void JBU_cu(JBUParameters *jp, JBUTexObj *jt, float *depth)
-{
-    const int2 p = make_int2 ( blockIdx.x * blockDim.x + threadIdx.x, blockIdx.y * blockDim.y + threadIdx.y );
-    const int rows = jp[0].height;
-    const int cols = jp[0].width;
-    const int center = p.y * cols + p.x;
-
-    if (p.x >= cols) {
-        return;
-    }
-    if (p.y >= rows) {
-        return;
-    }
-
-    const float scale  = 1.0 * jp[0].s_width / jp[0].width;
-    const float sigmad = 0.50;
-    const float sigmar = 25.5;
-    const int WinWidth = jp[0].Imagescale * jp[0].Imagescale + 1;
-    int num_neighbors = WinWidth / 2;
-
-    const float o_y = p.y * scale;
-    const float o_x = p.x * scale;
-    const float refPix = tex2D<float>(jt[0].imgs[0], p.x + 0.5f, p.y + 0.5f);
-    int r_y = 0;
-    int r_ys = 0;
-    int r_x = 0;
-    int r_xs = 0;
-    float sgauss = 0.0, rgauss = 0.0, totalgauss = 0.0;
-    float total_val = 0.0, normalizing_factor = 0.0;
-    float  srcPix = 0, neighborPix = 0;
-
-    for (int j = -num_neighbors; j <= num_neighbors; ++j) {
-        // source
-        r_y = o_y + j;
-        r_y = (r_y > 0 ? (r_y < jp[0].s_height ? r_y :jp[0].s_height - 1) : 0) ;
-        // reference
-        r_ys = p.y + j;
-        r_ys = (r_ys > 0 ? (r_ys < jp[0].height ? r_ys :jp[0].height - 1) : 0) ;
-        for (int i = -num_neighbors; i <= num_neighbors; ++i) {
-            // source
-            r_x = o_x + i;
-            r_x = (r_x > 0 ? (r_x < jp[0].s_width ? r_x : jp[0].s_width - 1) : 0);
-           srcPix = tex2D<float>(jt[0].imgs[1], r_x + 0.5f, r_y + 0.5f);
-            // refIm
-            r_xs = p.x + i;
-            r_xs = (r_xs > 0 ? (r_xs < jp[0].width ? r_xs :jp[0].width - 1) : 0) ;
-            neighborPix = tex2D<float>(jt[0].imgs[0], r_xs + 0.5f, r_ys + 0.5f);
-
-            sgauss = SpatialGauss(o_x, o_y, r_x, r_y, sigmad);
-            rgauss = RangeGauss(fabs(refPix - neighborPix), sigmar);
-            totalgauss = sgauss * rgauss;
-            normalizing_factor += totalgauss;
-            total_val += srcPix * totalgauss;
-        }
-    }
-
-    depth[center] = total_val / normalizing_factor;
-
-}
-
-void JBU::CudaRun()
-{
-    int rows = jp_h.height;
-    int cols = jp_h.width;
-
-    dim3 grid_size_initrand;
-    grid_size_initrand.x= (cols + 16 - 1) / 16;
-    grid_size_initrand.y=(rows + 16 - 1) / 16;
-    grid_size_initrand.z= 1;
-    dim3 block_size_initrand;
-    block_size_initrand.x = 16;
-    block_size_initrand.y = 16;
-    block_size_initrand.z = 1;
-
-    cudaEvent_t start, stop;
-    cudaEventCreate(&start);
-    cudaEventCreate(&stop);
-
-    cudaEventRecord(start);
-
-    cudaDeviceSynchronize();
-    JBU_cu<<< grid_size_initrand, block_size_initrand>>>(jp_d, jt_d, depth_d);
-    cudaDeviceSynchronize();
-
-    cudaMemcpy(depth_h, depth_d, sizeof(float) * rows * cols, cudaMemcpyDeviceToHost);
-    cudaDeviceSynchronize();
-
-    cudaEventRecord(stop);
-    cudaEventSynchronize(stop);
-    float milliseconds = 0;
-    cudaEventElapsedTime(&milliseconds, start, stop);
-    printf("Total time needed for computation: %f seconds\n", milliseconds / 1000.f);
-}
@@ -10,17 +10,122 @@
 
 int readDepthDmb(const std::string file_path, cv::Mat_<float> &depth);
 int readNormalDmb(const std::string file_path, cv::Mat_<cv::Vec3f> &normal);
-int writeDepthDmb(const std::string file_path, const cv::Mat_<float> depth);
-int writeNormalDmb(const std::string file_path, const cv::Mat_<cv::Vec3f> normal);
+// allow_quantized=false keeps float32 layers even with --quantized_maps.
+int writeDepthDmb(const std::string file_path, const cv::Mat_<float> depth, const bool allow_quantized = true);
+int writeNormalDmb(const std::string file_path, const cv::Mat_<cv::Vec3f> normal, const bool allow_quantized = true);
+
+// Read-only view of a whole file. Pages are mapped copy-on-write, so writing
+// through a mapped cv::Mat never reaches the file.
+class MappedFile {
+public:
+    MappedFile();
+    ~MappedFile();
+    bool Open(const std::string &file_path);
+    void Close();
+
+    char *data;
+    size_t size;
+private:
+#ifdef _WIN32
+    void *file_handle;
+    void *mapping_handle;
+#endif
+};
+typedef std::shared_ptr<MappedFile> MappedFileHandle;
+
+// Zero-copy .dmb readers: the returned cv::Mat points into the mapping, which
+// stays valid while the handle is held. Mappings are shared between callers
+// until the file is rewritten by writeDepthDmb/writeNormalDmb.
+int mapDepthDmb(const std::string file_path, cv::Mat_<float> &depth, MappedFileHandle &handle);
+int mapNormalDmb(const std::string file_path, cv::Mat_<cv::Vec3f> &normal, MappedFileHandle &handle);
+int mapMaskDmb(const std::string file_path, cv::Mat_<int> &mask, MappedFileHandle &handle);
+int writeMaskDmb(const std::string file_path, const cv::Mat_<int> mask);
+void releaseDmbMapping(const std::string file_path);
+
+// Storage of the intermediate per-view maps. With container set, the .dmb
+// paths above address layers of one page-aligned maps.cvm file per view.
+// With quantized set, depth and cost maps are written as fp16 relative to
+// their value range and normals as 16-bit octahedral codes.
+struct MapStorageParams {
+    bool container = false;
+    bool quantized = false;
+};
+void SetMapStorageParams(const MapStorageParams &storage_params);
+const MapStorageParams &GetMapStorageParams();
+int ConvertDmbToContainer(const std::string &result_folder);
+
+// Writes per-problem outputs on a dedicated thread. Enqueue blocks while
+// max_jobs writes are pending, and reading a map that is still queued waits
+// for its write. Finish returns the number of failed jobs.
+class AsyncMapWriter {
+public:
+    AsyncMapWriter(const size_t max_jobs = 4);
+    ~AsyncMapWriter();
+
+    void Enqueue(const std::vector<std::string> &file_paths, const std::function<int()> &write);
+    int Finish();
+
+private:
+    struct WriteJob {
+        std::vector<std::string> file_paths;
+        std::function<int()> write;
+    };
+    void Run();
+
+    size_t max_jobs;
+    bool stopping;
+    std::deque<WriteJob> jobs;
+    std::vector<std::string> failed_paths;
+    std::mutex jobs_mutex;
+    std::condition_variable jobs_changed;
+    std::thread worker;
+};
 
 Camera ReadCamera(const std::string &cam_path);
+bool ReadImageSize(const std::string &image_path, int &width, int &height);
+
+// Binary scene manifest (scene.bin in the dense folder) compiled from
+// pair.txt, cams/*_cam.txt and the image headers. It records the size and
+// modification time of every input and is rebuilt when one of them changes.
+struct FileStamp {
+    int64_t size;
+    int64_t mtime;
+};
+
+struct SceneView {
+    int32_t image_id;
+    int32_t width;
+    int32_t height;
+    int32_t num_pairs;
+    int32_t first_pair;
+    float R[9];
+    float t[3];
+    float K[9];
+    float depth_min;
+    float depth_max;
+    FileStamp cam_stamp;
+    FileStamp image_stamp;
+};
+
+struct ScenePair {
+    int32_t image_id;
+    float score;
+};
+
+bool LoadSceneManifest(const std::string &dense_folder);
+int GetNumSceneViews();
+const SceneView &GetSceneView(const int index);
+const SceneView *FindSceneView(const int image_id);
+const ScenePair *GetScenePairs(const SceneView &view);
+Camera GetSceneCamera(const int image_id);
 void  RescaleImageAndCamera(cv::Mat_<cv::Vec3b> &src, cv::Mat_<cv::Vec3b> &dst, cv::Mat_<float> &depth, Camera &camera);
 float3 Get3DPointonWorld(const int x, const int y, const float depth, const Camera camera);
 void ProjectonCamera(const float3 PointX, const Camera camera, float2 &point, float &depth);
 float GetAngle(const cv::Vec3f &v1, const cv::Vec3f &v2);
 void StoreColorPlyFileBinaryPointCloud (const std::string &plyFilePath, const std::vector<PointList> &pc);
 
-void RunJBU(const cv::Mat_<float>  &scaled_image_float, const cv::Mat_<float> &src_depthmap, const std::string &dense_folder , const Problem &problem);
+void JointBilateralUpsampleHost(const cv::Mat_<float> &guide, const cv::Rect &rect, const cv::Mat_<float> &src_depthmap, const cv::Mat_<cv::Vec3f> &src_normals,
+                                const int Imagescale, const float scale, const cv::Point2f &offset, cv::Mat_<float> &depthmap, cv::Mat_<cv::Vec3f> &normals);
 
 #define CUDA_SAFE_CALL(error) CudaSafeCall(error, __FILE__, __LINE__)
 #define CUDA_CHECK_ERROR() CudaCheckError(__FILE__, __LINE__)
@@ -33,6 +138,17 @@ struct cudaTextureObjects {
     cudaTextureObject_t images[MAX_IMAGES];
 };
 
+// Planes a checkerboard sweep replaced and the summed cost decrease of those pixels.
+struct ConvergenceStats {
+    unsigned int changed_pixels;
+    float cost_improvement;
+};
+
+// Element types of the matching images.
+#define IMAGE_STORAGE_FLOAT 0
+#define IMAGE_STORAGE_HALF 1
+#define IMAGE_STORAGE_UINT8 2
+
 struct PatchMatchParams {
     int max_iterations = 4;
     int patch_size = 11;
@@ -50,6 +166,10 @@ struct PatchMatchParams {
 
     float scaled_cols;
     float scaled_rows; 
+    float upsample_scale = 1.0f; // coarse over fine pixel size of the full reference
+    float scaled_offset_x = 0.0f; // tile origin in the cropped coarse map
+    float scaled_offset_y = 0.0f;
+    int upsample_window = 1;
     float normal_lambda = 0; 
     float repair_t = 0; 
     int repair_iter = 3;
@@ -58,57 +178,167 @@ struct PatchMatchParams {
     bool hierarchy = false;
     bool upsample = false;
     bool repair = false;
+    bool coarse_bounds = false; // search intervals from the previous scale in hierarchy passes
+    bool use_depth_bounds = false; // per-pixel intervals are uploaded for this problem
+    bool sparse_prior = false; // seed the first pass from points/%08d_points.txt
+    bool sparse_seeds = false; // plane_hypotheses hold seed depths (w > 0) at initialization
+    int cost_cache_budget = 0; // MB for the per-view costs of the current planes, 0 disables them
+    bool cost_cache = false; // the cost cache fits the budget for this problem
+    bool cascade = false; // refinement planes are bounded on sparse taps before the full NCC
+    int cascade_increment = 2; // tap spacing of the sparse bound in units of radius_increment
+    float cascade_tolerance = 1e-4f; // rounding slack of the sparse bound
+    int source_levels = 1; // pyramid levels of the source images, 1 samples the full resolution only
+    int image_storage = IMAGE_STORAGE_FLOAT; // element type of the matching images on the host and the device
+    bool adaptive = false; // stop sweeps and geom passes that no longer improve the costs
+    float converged_fraction = 0.01f; // changed planes per pixel below which a sweep may count as converged
+    float converged_improvement = 0.002f; // mean cost decrease per pixel below which a sweep may count as converged
+    float converged_pass_improvement = 0.02f; // mean cost decrease per pixel of a pass below which further geom passes are skipped
+    float image_scale = 1.0f; // sampler factor back to 0..255 intensities, normalized uint8 textures read 0..1
+
+    int tile_budget = 0; // device working set in MB, 0 processes the whole image at once
+    int tile_overlap = 64; // pixels around each tile core that are matched but not kept
+};
+
+// A part of the reference image matched on its own. Only the core is kept,
+// the overlap gives propagation and the patches context across the seams.
+struct ReferenceTile {
+    cv::Rect rect;
+    cv::Rect core;
+};
+
+#define VISIBILITY_TILE_SIZE 32 // reference pixels per side of a view culling tile
+
+#define SPARSE_CELL_SIZE 64 // reference pixels per side of a sparse prior depth cell
+
+#define MAX_BATCH_HYPOTHESES 9 // planes scored together per source view, 8 neighbours and the current one
+
+#define MAX_SOURCE_LEVELS 3 // full resolution and two halvings of each source image
+
+#define WORKSPACE_TEXTURE_KINDS (MAX_SOURCE_LEVELS + 1) // images, packed depth and normal maps, coarser source levels
+
+// Grow-only bump allocator. A Reset that follows an overflow merges all
+// blocks into one, so after the largest problem every problem fits into a
+// single block. Host blocks are backed by huge pages where the system
+// allows it and are pinned for faster transfers.
+class WorkspaceArena {
+public:
+    WorkspaceArena(const bool device);
+    ~WorkspaceArena();
+
+    void *Allocate(const size_t bytes);
+    void Reset();
+
+    size_t num_requests;
+    size_t num_allocations;
+    double allocation_ms;
+    size_t capacity;
+
+    bool UsesHugePages() const;
+
+private:
+    struct Block {
+        char *data;
+        size_t size;
+        size_t used;
+        bool pinned;
+        bool huge_pages;
+    };
+    void AllocateBlock(const size_t bytes);
+    void FreeBlock(Block &block);
+
+    bool device;
+    std::vector<Block> blocks;
+};
+
+// Buffers shared by the problems of a run instead of allocating them per CNVR object.
+class CNVRWorkspace {
+public:
+    CNVRWorkspace();
+    ~CNVRWorkspace();
+
+    void Reset();
+    template <typename T> T *AllocateHost(const size_t count) { return (T*)host_arena.Allocate(sizeof(T) * count); }
+    template <typename T> T *AllocateDevice(const size_t count) { return (T*)device_arena.Allocate(sizeof(T) * count); }
+    cudaTextureObject_t UploadTexture(const int kind, const int index, const cv::Mat &image);
+    void PrintStats() const;
+
+private:
+    WorkspaceArena host_arena;
+    WorkspaceArena device_arena;
+    cudaArray *arrays[WORKSPACE_TEXTURE_KINDS][MAX_IMAGES];
+    cudaTextureObject_t textures[WORKSPACE_TEXTURE_KINDS][MAX_IMAGES];
+    int2 array_sizes[WORKSPACE_TEXTURE_KINDS][MAX_IMAGES];
+    int array_types[WORKSPACE_TEXTURE_KINDS][MAX_IMAGES];
+    size_t num_texture_requests;
+    size_t num_texture_allocations;
+    double texture_allocation_ms;
 };
 
 class CNVR {
 public:
-    CNVR();
+    CNVR(CNVRWorkspace &workspace);
     ~CNVR();
 
     void InputInitialization(const std::string &dense_folder, const std::vector<Problem> &problem, const int idx);
-    void Colmap2MVS(const std::string &dense_folder, std::vector<Problem> &problems);
+    static bool Colmap2MVS(const std::string &colmap_folder, const std::string &dense_folder, std::vector<Problem> &problems);
     void CudaSpaceInitialization(const std::string &dense_folder, const Problem &problem);
+    void CudaSpaceInitialization(const std::string &dense_folder, const Problem &problem, const ReferenceTile &tile);
+    void ReleaseInputMaps();
+    std::vector<ReferenceTile> PlanTiles();
     void RunPatchMatch();
     void SetGeomConsistencyParams(bool multi_geometry);
     void SetHierarchyParams();
     void SetRepairParams();
     void SetNormalLambda(int iteration);
+    void SetTileParams(const int budget_mb);
+    void SetDepthBoundsParams();
+    void SetSparsePriorParams();
+    void SetCostCacheParams(const int budget_mb);
+    void SetCascadeParams();
+    void SetSourcePyramidParams();
+    void SetImageStorageParams(const int storage);
+    void SetAdaptiveParams();
 
     int GetReferenceImageWidth();
     int GetReferenceImageHeight();
     cv::Mat GetReferenceImage();
     float4 GetPlaneHypothesis(const int index);
     float GetCost(const int index);
+    void GetResultMaps(cv::Mat_<float> &depths, cv::Mat_<cv::Vec3f> &normals, cv::Mat_<float> &costs, cv::Mat_<int> &selected_views);
+    bool PassConverged() const;
 private:
+    CNVRWorkspace &workspace;
     int num_images;
     std::vector<cv::Mat> images;
-    std::vector<cv::Mat> depths;
-    std::vector<cv::Mat> normals0;
-    std::vector<cv::Mat> normals1;
-    std::vector<cv::Mat> normals2;
+    std::vector<cv::Mat> geometries; // depth bits and octahedral normal code per pixel in geom passes
     std::vector<Camera> cameras;
-    cudaTextureObjects texture_objects_host;
-    cudaTextureObjects texture_depths_host;
-    cudaTextureObjects texture_normals0_host;
-    cudaTextureObjects texture_normals1_host;
-    cudaTextureObjects texture_normals2_host;
+    std::vector<Camera> tile_cameras;
+    std::vector<cv::Rect> view_crops; // kept part of each view, in scaled image coordinates
+    std::vector<float3> sparse_points; // x, y and depth of SfM points in the scaled reference
+    cudaTextureObjects texture_objects_host[MAX_SOURCE_LEVELS];
+    cudaTextureObjects texture_geometries_host;
     float4 *plane_hypotheses_host;
     float4 *scaled_plane_hypotheses_host;
     float *costs_host;
     float *pre_costs_host;
+    unsigned int *selected_views_host;
+    unsigned int *tile_views_host;
     PatchMatchParams params;
 
+    cv::Rect ComputeSourceFootprint(const Camera &ref_camera, const Camera &src_camera) const;
+    size_t EstimateTileBytes(const cv::Rect &rect) const;
+    void ComputeTileVisibility();
+    void ComputeDepthBounds(const cv::Mat_<float> &prior_depth, const cv::Mat_<float> &prior_cost);
+    void SeedSparsePoints(const cv::Rect &rect);
+    bool SweepConverged(const char *phase, const int iteration, const int num_pixels);
+
+    double pass_changed_pixels;
+    double pass_cost_improvement;
+    double pass_pixels;
+
     Camera *cameras_cuda;
-    cudaArray *cuArray[MAX_IMAGES];
-    cudaArray *cuDepthArray[MAX_IMAGES];
-    cudaArray* cuNormal0Array[MAX_IMAGES];
-    cudaArray* cuNormal1Array[MAX_IMAGES];
-    cudaArray* cuNormal2Array[MAX_IMAGES];
     cudaTextureObjects *texture_objects_cuda;
-    cudaTextureObjects *texture_depths_cuda;
-    cudaTextureObjects *texture_normals0_cuda;
-    cudaTextureObjects *texture_normals1_cuda;
-    cudaTextureObjects *texture_normals2_cuda;
+    cudaTextureObjects *texture_geometries_cuda;
     float4 *plane_hypotheses_cuda;
     float4 *pre_plane_hypotheses_cuda;
     float4 *scaled_plane_hypotheses_cuda;
@@ -116,46 +346,16 @@ private:
     float *pre_costs_cuda;
     curandState *rand_states_cuda;
     unsigned int *selected_views_cuda;
-    float *depths_cuda;
-    float *normals0_cuda;
-    float *normals1_cuda;
-    float *normals2_cuda;
+    unsigned int *tile_views_cuda;
+    float2 *depth_bounds_cuda;
+    float *view_costs_cuda;
+    float4 *cached_planes_cuda;
+    unsigned long long *cost_evaluations_cuda;
+    ConvergenceStats *convergence_cuda;
 };
 
 struct TexObj {
     cudaTextureObject_t imgs[MAX_IMAGES];
 };
 
-struct JBUParameters {
-    int height;
-    int width;
-    int s_height;
-    int s_width;
-    int Imagescale;
-};
-
-struct JBUTexObj {
-    cudaTextureObject_t imgs[JBU_NUM];
-};
-
-class JBU {
-public:
-    JBU();
-    ~JBU();
-
-    // Host Parameters
-    float *depth_h;
-    JBUTexObj jt_h;
-    JBUParameters jp_h;
-
-    // Device Parameters
-    float *depth_d;
-    cudaArray *cuArray[JBU_NUM]; // The first for reference image, and the second for stereo depth image
-    JBUTexObj *jt_d;
-    JBUParameters *jp_d;
-
-    void InitializeParameters(int n);
-    void CudaRun();
-};
-
 #endif // _CNVR_H_
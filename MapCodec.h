@@ -0,0 +1,115 @@
+#ifndef _MAP_CODEC_H_
+#define _MAP_CODEC_H_
+
+#include "opencv2/core/core.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+// Quantized layers (--quantized_maps):
+// MAP_LAYER_FP16 stores a float lower bound and scale followed by the fp16
+// values of (v - lower) / scale in [0, 1]. The bounds are the range of the
+// finite non-zero values of the map. Zero marks invalid pixels of depth maps
+// and is stored as the code MAP_HALF_ZERO, so for depth maps the range is the
+// one of the valid depths, within the depth range of the view. The absolute
+// error is at most scale / 4096 (half an fp16 ulp below 1) plus the float
+// rounding of lower + code * scale, zeros are exact.
+// Layers are decoded to float32 when they are read, so only the files and
+// the disk traffic shrink, not the maps in memory.
+// MAP_LAYER_OCT16 stores unit normals octahedrally mapped to two signed
+// bytes; the angular error is below 0.96 degrees and 0.34 degrees on average
+// over uniformly distributed directions. map_codec_check verifies both bounds.
+inline uint16_t FloatToHalf(const float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    const uint16_t sign = (bits >> 16) & 0x8000;
+    const uint32_t magnitude = bits & 0x7fffffff;
+    if (magnitude >= 0x7f800000) {
+        return sign | 0x7c00 | (magnitude > 0x7f800000 ? 0x200 : 0);
+    }
+    if (magnitude >= 0x477ff000) {
+        return sign | 0x7c00;
+    }
+    if (magnitude < 0x38800000) {
+        float subnormal;
+        memcpy(&subnormal, &magnitude, sizeof(subnormal));
+        return sign | (uint16_t)lrintf(subnormal * 16777216.0f);
+    }
+    return sign | (uint16_t)((magnitude + 0xfff + ((magnitude >> 13) & 1) - 0x38000000) >> 13);
+}
+
+inline float HalfToFloat(const uint16_t value)
+{
+    const uint32_t sign = (uint32_t)(value & 0x8000) << 16;
+    const uint32_t exponent = (value >> 10) & 0x1f;
+    const uint32_t mantissa = value & 0x3ff;
+    float result;
+    if (exponent == 0) {
+        result = mantissa / 16777216.0f;
+        return (sign != 0) ? -result : result;
+    }
+    const uint32_t bits = (exponent == 31) ? (sign | 0x7f800000 | (mantissa << 13)) : (sign | ((exponent + 112) << 23) | (mantissa << 13));
+    memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+#define MAP_HALF_ZERO 0x8000 // negative zero, (v - lower) / scale never produces it
+
+inline uint16_t EncodeRangeHalf(const float value, const float lower, const float scale)
+{
+    if (value == 0.0f) {
+        return MAP_HALF_ZERO;
+    }
+    return FloatToHalf((value - lower) / scale);
+}
+
+inline float DecodeRangeHalf(const uint16_t code, const float lower, const float scale)
+{
+    if (code == MAP_HALF_ZERO) {
+        return 0.0f;
+    }
+    return lower + HalfToFloat(code) * scale;
+}
+
+// Maps a unit normal to two octahedral coordinates in [-scale, scale].
+// Returns false for a zero normal, which has no code.
+inline bool EncodeOctNormal(const cv::Vec3f &normal, const float scale, int *code)
+{
+    const float sum = fabs(normal[0]) + fabs(normal[1]) + fabs(normal[2]);
+    if (!(sum > 0.0f)) {
+        code[0] = 0;
+        code[1] = 0;
+        return false;
+    }
+    float u = normal[0] / sum;
+    float v = normal[1] / sum;
+    if (normal[2] < 0.0f) {
+        const float folded_u = (1.0f - fabs(v)) * (u < 0.0f ? -1.0f : 1.0f);
+        const float folded_v = (1.0f - fabs(u)) * (v < 0.0f ? -1.0f : 1.0f);
+        u = folded_u;
+        v = folded_v;
+    }
+    code[0] = (int)lrintf(std::max(-1.0f, std::min(1.0f, u)) * scale);
+    code[1] = (int)lrintf(std::max(-1.0f, std::min(1.0f, v)) * scale);
+    return true;
+}
+
+inline cv::Vec3f DecodeOctNormal(const int8_t *code)
+{
+    float x = code[0] / 127.0f;
+    float y = code[1] / 127.0f;
+    const float z = 1.0f - fabs(x) - fabs(y);
+    if (z < 0.0f) {
+        const float unfolded_x = (1.0f - fabs(y)) * (x < 0.0f ? -1.0f : 1.0f);
+        const float unfolded_y = (1.0f - fabs(x)) * (y < 0.0f ? -1.0f : 1.0f);
+        x = unfolded_x;
+        y = unfolded_y;
+    }
+    const float norm = sqrt(x * x + y * y + z * z);
+    return cv::Vec3f(x / norm, y / norm, z / norm);
+}
+
+#endif // _MAP_CODEC_H_
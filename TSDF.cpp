@@ -0,0 +1,632 @@
+#include "TSDF.h"
+#include "CNVR.h"
+
+#include <unordered_set>
+
+static const int kCubeCorners[8][3] = {{0, 0, 0}, {1, 0, 0}, {1, 1, 0}, {0, 1, 0}, {0, 0, 1}, {1, 0, 1}, {1, 1, 1}, {0, 1, 1}};
+static const int kCubeEdges[12][2] = {{0, 1}, {1, 2}, {2, 3}, {3, 0}, {4, 5}, {5, 6}, {6, 7}, {7, 4}, {0, 4}, {1, 5}, {2, 6}, {3, 7}};
+static const int kCubeFaces[6][4] = {{0, 1, 2, 3}, {4, 5, 6, 7}, {0, 1, 5, 4}, {3, 2, 6, 7}, {0, 3, 7, 4}, {1, 2, 6, 5}};
+
+// Marching cubes triangle table, built once from the cube topology instead of
+// being hard coded. Ambiguous faces always keep the inside corners apart, so
+// two cubes sharing a face agree on its segments and the mesh stays closed.
+struct MarchingCubesTable {
+    std::vector<int> triangles[256];
+
+    MarchingCubesTable()
+    {
+        for (int cube_index = 0; cube_index < 256; ++cube_index) {
+            std::vector<int2> segments;
+            for (int f = 0; f < 6; ++f) {
+                int edges[4];
+                bool crossed[4];
+                int num_crossed = 0;
+                for (int k = 0; k < 4; ++k) {
+                    const int a = kCubeFaces[f][k];
+                    const int b = kCubeFaces[f][(k + 1) % 4];
+                    edges[k] = EdgeIndex(a, b);
+                    crossed[k] = IsInside(cube_index, a) != IsInside(cube_index, b);
+                    if (crossed[k]) {
+                        num_crossed++;
+                    }
+                }
+
+                if (num_crossed == 2) {
+                    int2 segment = make_int2(-1, -1);
+                    for (int k = 0; k < 4; ++k) {
+                        if (crossed[k]) {
+                            if (segment.x < 0) {
+                                segment.x = edges[k];
+                            } else {
+                                segment.y = edges[k];
+                            }
+                        }
+                    }
+                    segments.push_back(segment);
+                } else if (num_crossed == 4) {
+                    for (int k = 0; k < 4; ++k) {
+                        if (IsInside(cube_index, kCubeFaces[f][k])) {
+                            segments.push_back(make_int2(edges[(k + 3) % 4], edges[k]));
+                        }
+                    }
+                }
+            }
+
+            std::vector<bool> used(segments.size(), false);
+            for (size_t s = 0; s < segments.size(); ++s) {
+                if (used[s]) {
+                    continue;
+                }
+                used[s] = true;
+                std::vector<int> polygon;
+                polygon.push_back(segments[s].x);
+                polygon.push_back(segments[s].y);
+                bool closed = false;
+                while (!closed) {
+                    bool extended = false;
+                    for (size_t t = 0; t < segments.size(); ++t) {
+                        if (used[t]) {
+                            continue;
+                        }
+                        int next = -1;
+                        if (segments[t].x == polygon.back()) {
+                            next = segments[t].y;
+                        } else if (segments[t].y == polygon.back()) {
+                            next = segments[t].x;
+                        } else {
+                            continue;
+                        }
+                        used[t] = true;
+                        extended = true;
+                        if (next == polygon.front()) {
+                            closed = true;
+                        } else {
+                            polygon.push_back(next);
+                        }
+                        break;
+                    }
+                    if (!extended) {
+                        break;
+                    }
+                }
+
+                for (size_t k = 1; k + 1 < polygon.size(); ++k) {
+                    triangles[cube_index].push_back(polygon[0]);
+                    triangles[cube_index].push_back(polygon[k]);
+                    triangles[cube_index].push_back(polygon[k + 1]);
+                }
+            }
+        }
+    }
+
+    static bool IsInside(const int cube_index, const int corner)
+    {
+        return ((cube_index >> corner) & 1) != 0;
+    }
+
+    static int EdgeIndex(const int a, const int b)
+    {
+        for (int e = 0; e < 12; ++e) {
+            if ((kCubeEdges[e][0] == a && kCubeEdges[e][1] == b) || (kCubeEdges[e][0] == b && kCubeEdges[e][1] == a)) {
+                return e;
+            }
+        }
+        return -1;
+    }
+};
+
+// Binary PLY writer that streams vertices to disk. The element counts are
+// zero padded so the header can be rewritten in place once they are known.
+// Faces index the written vertices and are kept until Close, since PLY
+// stores them after all vertices.
+class PlyStreamWriter {
+public:
+    PlyStreamWriter() : file(NULL), num_vertices(0), with_faces(false) {}
+    ~PlyStreamWriter() { Close(); }
+
+    bool Open(const std::string &ply_path, const bool faces)
+    {
+        file = fopen(ply_path.c_str(), "wb");
+        if (!file) {
+            std::cout << "Error opening file " << ply_path << std::endl;
+            return false;
+        }
+        with_faces = faces;
+        num_vertices = 0;
+        WriteHeader();
+        return true;
+    }
+
+    void WriteVertices(const std::vector<PointList> &points)
+    {
+        for (size_t i = 0; i < points.size(); ++i) {
+            const float3 X = points[i].coord;
+            const float3 color = points[i].color;
+            const unsigned char b_color = (unsigned char)std::min(255.0f, std::max(0.0f, color.x));
+            const unsigned char g_color = (unsigned char)std::min(255.0f, std::max(0.0f, color.y));
+            const unsigned char r_color = (unsigned char)std::min(255.0f, std::max(0.0f, color.z));
+            fwrite(&X.x, sizeof(X.x), 1, file);
+            fwrite(&X.y, sizeof(X.y), 1, file);
+            fwrite(&X.z, sizeof(X.z), 1, file);
+            fwrite(&r_color, sizeof(char), 1, file);
+            fwrite(&g_color, sizeof(char), 1, file);
+            fwrite(&b_color, sizeof(char), 1, file);
+        }
+        num_vertices += points.size();
+    }
+
+    void WriteFace(const int a, const int b, const int c)
+    {
+        faces.push_back(a);
+        faces.push_back(b);
+        faces.push_back(c);
+    }
+
+    size_t GetNumVertices() const { return num_vertices; }
+
+    size_t Close()
+    {
+        if (!file) {
+            return num_vertices;
+        }
+        if (with_faces) {
+            const unsigned char face_size = 3;
+            for (size_t i = 0; i + 2 < faces.size(); i += 3) {
+                fwrite(&face_size, sizeof(unsigned char), 1, file);
+                fwrite(&faces[i], sizeof(int), 3, file);
+            }
+        }
+        fseek(file, 0, SEEK_SET);
+        WriteHeader();
+        fclose(file);
+        file = NULL;
+        return with_faces ? faces.size() / 3 : num_vertices;
+    }
+
+private:
+    void WriteHeader()
+    {
+        fprintf(file, "ply\n");
+        fprintf(file, "format binary_little_endian 1.0\n");
+        fprintf(file, "element vertex %010llu\n", (unsigned long long)num_vertices);
+        fprintf(file, "property float x\n");
+        fprintf(file, "property float y\n");
+        fprintf(file, "property float z\n");
+        fprintf(file, "property uchar red\n");
+        fprintf(file, "property uchar green\n");
+        fprintf(file, "property uchar blue\n");
+        if (with_faces) {
+            fprintf(file, "element face %010llu\n", (unsigned long long)(faces.size() / 3));
+            fprintf(file, "property list uchar int vertex_indices\n");
+        }
+        fprintf(file, "end_header\n");
+    }
+
+    FILE *file;
+    size_t num_vertices;
+    bool with_faces;
+    std::vector<int> faces;
+};
+
+static inline int FloorDiv(const int a, const int b)
+{
+    return (a >= 0) ? a / b : -((-a + b - 1) / b);
+}
+
+static inline uint64_t PackBlockKey(const int x, const int y, const int z)
+{
+    const uint64_t mask = (1 << 21) - 1;
+    return (((uint64_t)(x + (1 << 20)) & mask) << 42) | (((uint64_t)(y + (1 << 20)) & mask) << 21) | ((uint64_t)(z + (1 << 20)) & mask);
+}
+
+// Voxel edge from (x, y, z) one step along axis. Coordinates are voxel
+// indices within +-2^19, which covers the volumes block keys can address.
+static inline uint64_t PackEdgeKey(const int x, const int y, const int z, const int axis)
+{
+    const uint64_t mask = (1 << 20) - 1;
+    return (((uint64_t)(x + (1 << 19)) & mask) << 42) | (((uint64_t)(y + (1 << 19)) & mask) << 22) | (((uint64_t)(z + (1 << 19)) & mask) << 2) | (uint64_t)axis;
+}
+
+static inline int3 UnpackBlockKey(const uint64_t key)
+{
+    const uint64_t mask = (1 << 21) - 1;
+    int3 coord;
+    coord.x = (int)((key >> 42) & mask) - (1 << 20);
+    coord.y = (int)((key >> 21) & mask) - (1 << 20);
+    coord.z = (int)(key & mask) - (1 << 20);
+    return coord;
+}
+
+TSDFVolume::TSDFVolume(const float voxel_size, const float trunc) : voxel_size(voxel_size), trunc(trunc) {}
+
+void TSDFVolume::AllocateBlocks(const std::vector<TSDFView> &views)
+{
+    const float block_extent = voxel_size * TSDF_BLOCK_SIZE;
+    const int num_views = (int)views.size();
+    std::vector<std::vector<uint64_t> > view_keys(num_views);
+
+    // Every view marks the blocks crossed by its truncation band independently.
+#pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < num_views; ++i) {
+        const cv::Mat_<float> &depth = views[i].depth;
+        const Camera &camera = views[i].camera;
+        const int num_steps = std::max(1, (int)std::ceil(2.0f * trunc / (0.5f * block_extent)));
+        std::unordered_set<uint64_t> keys;
+        for (int r = 0; r < depth.rows; ++r) {
+            for (int c = 0; c < depth.cols; ++c) {
+                const float d = depth(r, c);
+                if (d <= trunc) {
+                    continue;
+                }
+                const float3 near_point = Get3DPointonWorld(c, r, d - trunc, camera);
+                const float3 far_point = Get3DPointonWorld(c, r, d + trunc, camera);
+                for (int s = 0; s <= num_steps; ++s) {
+                    const float t = (float)s / num_steps;
+                    const float x = near_point.x + t * (far_point.x - near_point.x);
+                    const float y = near_point.y + t * (far_point.y - near_point.y);
+                    const float z = near_point.z + t * (far_point.z - near_point.z);
+                    keys.insert(PackBlockKey((int)std::floor(x / block_extent), (int)std::floor(y / block_extent), (int)std::floor(z / block_extent)));
+                }
+            }
+        }
+        view_keys[i].assign(keys.begin(), keys.end());
+    }
+
+    std::vector<uint64_t> all_keys;
+    for (int i = 0; i < num_views; ++i) {
+        all_keys.insert(all_keys.end(), view_keys[i].begin(), view_keys[i].end());
+        std::vector<uint64_t>().swap(view_keys[i]);
+    }
+    // Sorted keys keep the block order, and hence the output, deterministic.
+    std::sort(all_keys.begin(), all_keys.end());
+    all_keys.erase(std::unique(all_keys.begin(), all_keys.end()), all_keys.end());
+
+    size_t num_new_blocks = 0;
+    for (size_t i = 0; i < all_keys.size(); ++i) {
+        if (block_hash.find(all_keys[i]) == block_hash.end()) {
+            num_new_blocks++;
+        }
+    }
+    blocks.reserve(blocks.size() + num_new_blocks);
+    for (size_t i = 0; i < all_keys.size(); ++i) {
+        if (block_hash.find(all_keys[i]) != block_hash.end()) {
+            continue;
+        }
+        block_hash[all_keys[i]] = (int)blocks.size();
+        blocks.push_back(TSDFBlock());
+        TSDFBlock &block = blocks.back();
+        block.coord = UnpackBlockKey(all_keys[i]);
+        for (int v = 0; v < TSDF_BLOCK_VOXELS; ++v) {
+            block.voxels[v].tsdf = 1.0f;
+            block.voxels[v].weight = 0.0f;
+            block.voxels[v].color[0] = 0.0f;
+            block.voxels[v].color[1] = 0.0f;
+            block.voxels[v].color[2] = 0.0f;
+        }
+    }
+}
+
+void TSDFVolume::Integrate(const std::vector<TSDFView> &views)
+{
+    const float block_extent = voxel_size * TSDF_BLOCK_SIZE;
+    const float block_radius = 0.5f * std::sqrt(3.0f) * block_extent;
+    const int num_blocks = (int)blocks.size();
+    const int num_views = (int)views.size();
+
+    // Blocks are owned by exactly one thread, so the voxel updates need no locking.
+#pragma omp parallel for schedule(dynamic, 64)
+    for (int b = 0; b < num_blocks; ++b) {
+        TSDFBlock &block = blocks[b];
+        float3 block_center;
+        block_center.x = (block.coord.x + 0.5f) * block_extent;
+        block_center.y = (block.coord.y + 0.5f) * block_extent;
+        block_center.z = (block.coord.z + 0.5f) * block_extent;
+
+        for (int i = 0; i < num_views; ++i) {
+            const Camera &camera = views[i].camera;
+            const cv::Mat_<float> &depth = views[i].depth;
+            const cv::Mat_<cv::Vec3b> &image = views[i].image;
+
+            float2 center_pt;
+            float center_depth;
+            ProjectonCamera(block_center, camera, center_pt, center_depth);
+            if (center_depth <= block_radius || center_depth - block_radius > camera.depth_max * 1.4f + trunc) {
+                continue;
+            }
+            const float radius_px = camera.K[0] * block_radius / (center_depth - block_radius);
+            if (center_pt.x < -radius_px || center_pt.y < -radius_px || center_pt.x >= depth.cols + radius_px || center_pt.y >= depth.rows + radius_px) {
+                continue;
+            }
+
+            for (int z = 0; z < TSDF_BLOCK_SIZE; ++z) {
+                for (int y = 0; y < TSDF_BLOCK_SIZE; ++y) {
+                    for (int x = 0; x < TSDF_BLOCK_SIZE; ++x) {
+                        float3 voxel_center;
+                        voxel_center.x = (block.coord.x * TSDF_BLOCK_SIZE + x + 0.5f) * voxel_size;
+                        voxel_center.y = (block.coord.y * TSDF_BLOCK_SIZE + y + 0.5f) * voxel_size;
+                        voxel_center.z = (block.coord.z * TSDF_BLOCK_SIZE + z + 0.5f) * voxel_size;
+                        float2 pt;
+                        float proj_depth;
+                        ProjectonCamera(voxel_center, camera, pt, proj_depth);
+                        if (proj_depth <= 0.0f) {
+                            continue;
+                        }
+                        const int u = int(pt.x + 0.5f);
+                        const int v = int(pt.y + 0.5f);
+                        if (u < 0 || u >= depth.cols || v < 0 || v >= depth.rows) {
+                            continue;
+                        }
+                        const float d = depth(v, u);
+                        if (d <= 0.0f) {
+                            continue;
+                        }
+                        const float sdf = d - proj_depth;
+                        if (sdf < -trunc) {
+                            continue;
+                        }
+                        const float tsdf = std::min(1.0f, sdf / trunc);
+
+                        TSDFVoxel &voxel = block.voxels[(z * TSDF_BLOCK_SIZE + y) * TSDF_BLOCK_SIZE + x];
+                        const float new_weight = voxel.weight + 1.0f;
+                        const cv::Vec3b &color = image(v, u);
+                        voxel.tsdf = (voxel.tsdf * voxel.weight + tsdf) / new_weight;
+                        voxel.color[0] = (voxel.color[0] * voxel.weight + color[0]) / new_weight;
+                        voxel.color[1] = (voxel.color[1] * voxel.weight + color[1]) / new_weight;
+                        voxel.color[2] = (voxel.color[2] * voxel.weight + color[2]) / new_weight;
+                        voxel.weight = new_weight;
+                    }
+                }
+            }
+        }
+    }
+}
+
+const TSDFVoxel *TSDFVolume::GetVoxel(const int x, const int y, const int z) const
+{
+    const int bx = FloorDiv(x, TSDF_BLOCK_SIZE);
+    const int by = FloorDiv(y, TSDF_BLOCK_SIZE);
+    const int bz = FloorDiv(z, TSDF_BLOCK_SIZE);
+    std::unordered_map<uint64_t, int>::const_iterator it = block_hash.find(PackBlockKey(bx, by, bz));
+    if (it == block_hash.end()) {
+        return NULL;
+    }
+    const int lx = x - bx * TSDF_BLOCK_SIZE;
+    const int ly = y - by * TSDF_BLOCK_SIZE;
+    const int lz = z - bz * TSDF_BLOCK_SIZE;
+    return &blocks[it->second].voxels[(lz * TSDF_BLOCK_SIZE + ly) * TSDF_BLOCK_SIZE + lx];
+}
+
+static PointList InterpolateSurfacePoint(const float3 X0, const TSDFVoxel &v0, const float3 X1, const TSDFVoxel &v1)
+{
+    const float t = v0.tsdf / (v0.tsdf - v1.tsdf);
+    PointList point;
+    point.coord = make_float3(X0.x + t * (X1.x - X0.x), X0.y + t * (X1.y - X0.y), X0.z + t * (X1.z - X0.z));
+    point.color = make_float3(v0.color[0] + t * (v1.color[0] - v0.color[0]), v0.color[1] + t * (v1.color[1] - v0.color[1]), v0.color[2] + t * (v1.color[2] - v0.color[2]));
+    return point;
+}
+
+size_t TSDFVolume::ExtractPoints(const std::string &ply_path, const float min_weight)
+{
+    PlyStreamWriter writer;
+    if (!writer.Open(ply_path, false)) {
+        return 0;
+    }
+
+    const int num_blocks = (int)blocks.size();
+    const int batch_size = 1024;
+    for (int start = 0; start < num_blocks; start += batch_size) {
+        const int end = std::min(start + batch_size, num_blocks);
+        std::vector<std::vector<PointList> > batch_points(end - start);
+
+#pragma omp parallel for schedule(dynamic, 16)
+        for (int b = start; b < end; ++b) {
+            const TSDFBlock &block = blocks[b];
+            std::vector<PointList> &points = batch_points[b - start];
+            for (int z = 0; z < TSDF_BLOCK_SIZE; ++z) {
+                for (int y = 0; y < TSDF_BLOCK_SIZE; ++y) {
+                    for (int x = 0; x < TSDF_BLOCK_SIZE; ++x) {
+                        const TSDFVoxel &voxel = block.voxels[(z * TSDF_BLOCK_SIZE + y) * TSDF_BLOCK_SIZE + x];
+                        if (voxel.weight < min_weight) {
+                            continue;
+                        }
+                        const int gx = block.coord.x * TSDF_BLOCK_SIZE + x;
+                        const int gy = block.coord.y * TSDF_BLOCK_SIZE + y;
+                        const int gz = block.coord.z * TSDF_BLOCK_SIZE + z;
+                        const float3 X0 = make_float3((gx + 0.5f) * voxel_size, (gy + 0.5f) * voxel_size, (gz + 0.5f) * voxel_size);
+                        for (int axis = 0; axis < 3; ++axis) {
+                            const TSDFVoxel *neighbor = GetVoxel(gx + (axis == 0), gy + (axis == 1), gz + (axis == 2));
+                            if (neighbor == NULL || neighbor->weight < min_weight) {
+                                continue;
+                            }
+                            if ((voxel.tsdf < 0.0f) == (neighbor->tsdf < 0.0f)) {
+                                continue;
+                            }
+                            const float3 X1 = make_float3(X0.x + (axis == 0) * voxel_size, X0.y + (axis == 1) * voxel_size, X0.z + (axis == 2) * voxel_size);
+                            points.push_back(InterpolateSurfacePoint(X0, voxel, X1, *neighbor));
+                        }
+                    }
+                }
+            }
+        }
+
+        for (size_t i = 0; i < batch_points.size(); ++i) {
+            writer.WriteVertices(batch_points[i]);
+        }
+    }
+
+    return writer.Close();
+}
+
+size_t TSDFVolume::ExtractMesh(const std::string &ply_path, const float min_weight)
+{
+    static const MarchingCubesTable table;
+
+    PlyStreamWriter writer;
+    if (!writer.Open(ply_path, true)) {
+        return 0;
+    }
+
+    // Triangle corners lie on voxel edges. Each edge becomes one vertex, shared
+    // by all cubes around it, also across blocks, so the mesh is welded.
+    std::unordered_map<uint64_t, int> edge_vertices;
+    const int num_blocks = (int)blocks.size();
+    const int batch_size = 1024;
+    for (int start = 0; start < num_blocks; start += batch_size) {
+        const int end = std::min(start + batch_size, num_blocks);
+        std::vector<std::vector<PointList> > batch_points(end - start);
+        std::vector<std::vector<uint64_t> > batch_edges(end - start);
+
+#pragma omp parallel for schedule(dynamic, 16)
+        for (int b = start; b < end; ++b) {
+            const TSDFBlock &block = blocks[b];
+            std::vector<PointList> &points = batch_points[b - start];
+            std::vector<uint64_t> &edges = batch_edges[b - start];
+            for (int z = 0; z < TSDF_BLOCK_SIZE; ++z) {
+                for (int y = 0; y < TSDF_BLOCK_SIZE; ++y) {
+                    for (int x = 0; x < TSDF_BLOCK_SIZE; ++x) {
+                        const int gx = block.coord.x * TSDF_BLOCK_SIZE + x;
+                        const int gy = block.coord.y * TSDF_BLOCK_SIZE + y;
+                        const int gz = block.coord.z * TSDF_BLOCK_SIZE + z;
+
+                        const TSDFVoxel *corners[8];
+                        float3 corner_points[8];
+                        int cube_index = 0;
+                        bool valid = true;
+                        for (int k = 0; k < 8 && valid; ++k) {
+                            const int cx = gx + kCubeCorners[k][0];
+                            const int cy = gy + kCubeCorners[k][1];
+                            const int cz = gz + kCubeCorners[k][2];
+                            corners[k] = GetVoxel(cx, cy, cz);
+                            if (corners[k] == NULL || corners[k]->weight < min_weight) {
+                                valid = false;
+                                break;
+                            }
+                            corner_points[k] = make_float3((cx + 0.5f) * voxel_size, (cy + 0.5f) * voxel_size, (cz + 0.5f) * voxel_size);
+                            if (corners[k]->tsdf < 0.0f) {
+                                cube_index |= 1 << k;
+                            }
+                        }
+                        if (!valid || cube_index == 0 || cube_index == 255) {
+                            continue;
+                        }
+
+                        // The gradient points from the inside (occupied) to the outside (free space).
+                        float3 gradient = make_float3(0.0f, 0.0f, 0.0f);
+                        for (int k = 0; k < 8; ++k) {
+                            gradient.x += (kCubeCorners[k][0] ? 1.0f : -1.0f) * corners[k]->tsdf;
+                            gradient.y += (kCubeCorners[k][1] ? 1.0f : -1.0f) * corners[k]->tsdf;
+                            gradient.z += (kCubeCorners[k][2] ? 1.0f : -1.0f) * corners[k]->tsdf;
+                        }
+
+                        const std::vector<int> &triangles = table.triangles[cube_index];
+                        for (size_t t = 0; t + 2 < triangles.size(); t += 3) {
+                            PointList triangle[3];
+                            uint64_t triangle_edges[3];
+                            for (int k = 0; k < 3; ++k) {
+                                const int a = kCubeEdges[triangles[t + k]][0];
+                                const int c = kCubeEdges[triangles[t + k]][1];
+                                triangle[k] = InterpolateSurfacePoint(corner_points[a], *corners[a], corner_points[c], *corners[c]);
+                                int axis = 0;
+                                while (kCubeCorners[a][axis] == kCubeCorners[c][axis]) {
+                                    axis++;
+                                }
+                                const int lower = kCubeCorners[a][axis] < kCubeCorners[c][axis] ? a : c;
+                                triangle_edges[k] = PackEdgeKey(gx + kCubeCorners[lower][0], gy + kCubeCorners[lower][1], gz + kCubeCorners[lower][2], axis);
+                            }
+                            const float3 e1 = make_float3(triangle[1].coord.x - triangle[0].coord.x, triangle[1].coord.y - triangle[0].coord.y, triangle[1].coord.z - triangle[0].coord.z);
+                            const float3 e2 = make_float3(triangle[2].coord.x - triangle[0].coord.x, triangle[2].coord.y - triangle[0].coord.y, triangle[2].coord.z - triangle[0].coord.z);
+                            const float3 normal = make_float3(e1.y * e2.z - e1.z * e2.y, e1.z * e2.x - e1.x * e2.z, e1.x * e2.y - e1.y * e2.x);
+                            if (normal.x * gradient.x + normal.y * gradient.y + normal.z * gradient.z < 0.0f) {
+                                std::swap(triangle[1], triangle[2]);
+                                std::swap(triangle_edges[1], triangle_edges[2]);
+                            }
+                            for (int k = 0; k < 3; ++k) {
+                                points.push_back(triangle[k]);
+                                edges.push_back(triangle_edges[k]);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        std::vector<PointList> new_vertices;
+        for (size_t i = 0; i < batch_points.size(); ++i) {
+            const std::vector<PointList> &points = batch_points[i];
+            const std::vector<uint64_t> &edges = batch_edges[i];
+            for (size_t t = 0; t + 2 < points.size(); t += 3) {
+                int indices[3];
+                for (int k = 0; k < 3; ++k) {
+                    const int next_index = (int)(writer.GetNumVertices() + new_vertices.size());
+                    std::pair<std::unordered_map<uint64_t, int>::iterator, bool> it = edge_vertices.insert(std::make_pair(edges[t + k], next_index));
+                    if (it.second) {
+                        new_vertices.push_back(points[t + k]);
+                    }
+                    indices[k] = it.first->second;
+                }
+                writer.WriteFace(indices[0], indices[1], indices[2]);
+            }
+        }
+        writer.WriteVertices(new_vertices);
+    }
+
+    return writer.Close();
+}
+
+void RunTSDFFusion(const std::string &dense_folder, const std::vector<Problem> &problems, bool geom_consistency, const TSDFParams &tsdf_params)
+{
+    size_t num_images = problems.size();
+    std::string image_folder = dense_folder + std::string("/images");
+
+    std::vector<TSDFView> views(num_images);
+    std::vector<float> footprints;
+    for (size_t i = 0; i < num_images; ++i) {
+        std::cout << "Reading image " << std::setw(8) << std::setfill('0') << i << "..." << std::endl;
+        std::stringstream image_path;
+        image_path << image_folder << "/" << std::setw(8) << std::setfill('0') << problems[i].ref_image_id << ".jpg";
+        cv::Mat_<cv::Vec3b> image = cv::imread (image_path.str(), cv::IMREAD_COLOR);
+        Camera camera = GetSceneCamera(problems[i].ref_image_id);
+
+        std::stringstream result_path;
+        result_path << dense_folder << "/CNVR" << "/2333_" << std::setw(8) << std::setfill('0') << problems[i].ref_image_id;
+        std::string result_folder = result_path.str();
+        std::string suffix_depth = "/depths.dmb";
+        if (geom_consistency) {
+            suffix_depth = "/depths_geom.dmb";
+        }
+        cv::Mat_<float> depth;
+        readDepthDmb(result_folder + suffix_depth, depth);
+
+        RescaleImageAndCamera(image, views[i].image, depth, camera);
+        camera.width = depth.cols;
+        camera.height = depth.rows;
+        views[i].camera = camera;
+        views[i].depth = depth;
+        footprints.push_back(0.5f * (camera.depth_min + camera.depth_max) / camera.K[0]);
+    }
+
+    float voxel_size = tsdf_params.voxel_size;
+    if (voxel_size <= 0.0f) {
+        std::nth_element(footprints.begin(), footprints.begin() + footprints.size() / 2, footprints.end());
+        voxel_size = 2.0f * footprints[footprints.size() / 2];
+    }
+    const float trunc = tsdf_params.trunc_factor * voxel_size;
+    std::cout << "TSDF voxel size: " << voxel_size << ", truncation: " << trunc << std::endl;
+
+    TSDFVolume volume(voxel_size, trunc);
+    volume.AllocateBlocks(views);
+    std::cout << "Allocated " << volume.GetNumBlocks() << " voxel blocks" << std::endl;
+    volume.Integrate(views);
+    std::vector<TSDFView>().swap(views);
+
+    if (tsdf_params.mesh) {
+        std::string ply_path = dense_folder + "/CNVR/CNVR_tsdf_mesh.ply";
+        size_t num_faces = volume.ExtractMesh(ply_path, tsdf_params.min_weight);
+        std::cout << "Stored " << num_faces << " faces to " << ply_path << std::endl;
+    }
+    else {
+        std::string ply_path = dense_folder + "/CNVR/CNVR_tsdf.ply";
+        size_t num_points = volume.ExtractPoints(ply_path, tsdf_params.min_weight);
+        std::cout << "Stored " << num_points << " points to " << ply_path << std::endl;
+    }
+}
@@ -0,0 +1,56 @@
+#ifndef _TSDF_H_
+#define _TSDF_H_
+
+#include "main.h"
+
+#include <unordered_map>
+
+#define TSDF_BLOCK_SIZE 8
+#define TSDF_BLOCK_VOXELS (TSDF_BLOCK_SIZE * TSDF_BLOCK_SIZE * TSDF_BLOCK_SIZE)
+
+struct TSDFParams {
+    float voxel_size = 0.0f; // 0 means derived from the median pixel footprint
+    float trunc_factor = 4.0f; // truncation distance in voxels
+    float min_weight = 2.0f; // minimal number of observations for a surface voxel
+    bool mesh = false; // marching cubes mesh instead of zero crossing points
+};
+
+struct TSDFVoxel {
+    float tsdf;
+    float weight;
+    float color[3];
+};
+
+struct TSDFBlock {
+    int3 coord;
+    TSDFVoxel voxels[TSDF_BLOCK_VOXELS];
+};
+
+struct TSDFView {
+    cv::Mat_<cv::Vec3b> image;
+    cv::Mat_<float> depth;
+    Camera camera;
+};
+
+class TSDFVolume {
+public:
+    TSDFVolume(const float voxel_size, const float trunc);
+
+    void AllocateBlocks(const std::vector<TSDFView> &views);
+    void Integrate(const std::vector<TSDFView> &views);
+    size_t ExtractPoints(const std::string &ply_path, const float min_weight);
+    size_t ExtractMesh(const std::string &ply_path, const float min_weight);
+    size_t GetNumBlocks() const { return blocks.size(); }
+
+private:
+    const TSDFVoxel *GetVoxel(const int x, const int y, const int z) const;
+
+    float voxel_size;
+    float trunc;
+    std::vector<TSDFBlock> blocks;
+    std::unordered_map<uint64_t, int> block_hash;
+};
+
+void RunTSDFFusion(const std::string &dense_folder, const std::vector<Problem> &problems, bool geom_consistency, const TSDFParams &tsdf_params);
+
+#endif // _TSDF_H_
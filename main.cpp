@@ -1,56 +1,42 @@
 #include "main.h"
 #include "CNVR.h"
+#include "TSDF.h"
 
-void GenerateSampleList(const std::string &dense_folder, std::vector<Problem> &problems)
+void GenerateSampleList(std::vector<Problem> &problems)
 {
-    std::string cluster_list_path = dense_folder + std::string("/pair.txt");
-
     problems.clear();
 
-    std::ifstream file(cluster_list_path);
-
-    int num_images;
-    file >> num_images;
-
+    const int num_images = GetNumSceneViews();
     for (int i = 0; i < num_images; ++i) {
+        const SceneView &view = GetSceneView(i);
+        const ScenePair *pairs = GetScenePairs(view);
         Problem problem;
         problem.src_image_ids.clear();
-        file >> problem.ref_image_id;
-
-        int num_src_images;
-        file >> num_src_images;
-        for (int j = 0; j < num_src_images; ++j) {
-            int id;
-            float score;
-            file >> id >> score;
-            if (score <= 0.0f) {
+        problem.ref_image_id = view.image_id;
+        for (int j = 0; j < view.num_pairs; ++j) {
+            if (pairs[j].score <= 0.0f) {
                 continue;
             }
-            problem.src_image_ids.push_back(id);
+            problem.src_image_ids.push_back(pairs[j].image_id);
         }
         problems.push_back(problem);
     }
 }
 
-int ComputeMultiScaleSettings(const std::string &dense_folder, std::vector<Problem> &problems)
+int ComputeMultiScaleSettings(std::vector<Problem> &problems, const int max_image_size)
 {
     int max_num_downscale = -1;
     int size_bound = 1000;
-    PatchMatchParams pmp;
-    std::string image_folder = dense_folder + std::string("/images");
 
     size_t num_images = problems.size();
 
     for (size_t i = 0; i < num_images; ++i) {
-        std::stringstream image_path;
-        image_path << image_folder << "/" << std::setw(8) << std::setfill('0') << problems[i].ref_image_id << ".jpg";
-        cv::Mat_<uint8_t> image_uint = cv::imread(image_path.str(), cv::IMREAD_GRAYSCALE);
-
-        int rows = image_uint.rows;
-        int cols = image_uint.cols;
+        const SceneView *view = FindSceneView(problems[i].ref_image_id);
+        int rows = view ? view->height : 0;
+        int cols = view ? view->width : 0;
         int max_size = rows > cols ? rows : cols;
-        if (max_size > pmp.max_image_size) {
-            max_size = pmp.max_image_size;
+        if (max_size > max_image_size) {
+            max_size = max_image_size;
         }
         problems[i].max_image_size = max_size;
 
@@ -70,7 +56,20 @@ int ComputeMultiScaleSettings(const std::string &dense_folder, std::vector<Probl
     return max_num_downscale;
 }
 
-void ProcessProblem(const std::string &dense_folder, const std::vector<Problem> &problems, const int idx, bool geom_consistency, bool hierarchy, bool repair, bool multi_geometrty=false)
+// Command line options of the PatchMatch passes, the same for every problem.
+struct ProblemOptions {
+    int tile_budget = 0; // device working set in MB, 0 processes the whole image at once
+    bool depth_bounds = false;
+    bool sparse_prior = false;
+    int cost_cache_budget = 0; // MB for the per-view costs of the current planes
+    bool cascade = false;
+    bool source_pyramids = false;
+    int image_storage = IMAGE_STORAGE_FLOAT;
+    bool adaptive = false;
+};
+
+// Returns true when the adaptive schedule found the pass converged.
+bool ProcessProblem(const std::string &dense_folder, const std::vector<Problem> &problems, const int idx, AsyncMapWriter &map_writer, CNVRWorkspace &workspace, const ProblemOptions &options, bool geom_consistency, bool hierarchy, bool repair, bool multi_geometrty=false)
 {
     const Problem problem = problems[idx];
     std::cout << "Processing image " << std::setw(8) << std::setfill('0') << problem.ref_image_id << "..." << std::endl;
@@ -90,39 +89,72 @@ void ProcessProblem(const std::string &dense_folder, const std::vector<Problem>
     mkdir ( result_folder.c_str(), 0777 );
 #endif
 
-    CNVR cnvr;
+    CNVR cnvr(workspace);
     if (geom_consistency) {
         cnvr.SetGeomConsistencyParams(multi_geometrty);
     }
     if (hierarchy) {
         cnvr.SetHierarchyParams();
+        if (options.depth_bounds) {
+            cnvr.SetDepthBoundsParams();
+        }
     }
     if (repair) {
         cnvr.SetRepairParams();
     }
     cnvr.SetNormalLambda(problem.num_downscale + 1);
+    cnvr.SetTileParams(options.tile_budget);
+    if (options.sparse_prior) {
+        cnvr.SetSparsePriorParams();
+    }
+    cnvr.SetCostCacheParams(options.cost_cache_budget);
+    if (options.cascade) {
+        cnvr.SetCascadeParams();
+    }
+    if (options.source_pyramids) {
+        cnvr.SetSourcePyramidParams();
+    }
+    cnvr.SetImageStorageParams(options.image_storage);
+    if (options.adaptive) {
+        cnvr.SetAdaptiveParams();
+    }
 
     cnvr.InputInitialization(dense_folder, problems, idx);
 
-    cnvr.CudaSpaceInitialization(dense_folder, problem);
-    cnvr.RunPatchMatch();
-
-    const int width = cnvr.GetReferenceImageWidth();
-    const int height = cnvr.GetReferenceImageHeight();
-
-    cv::Mat_<float> depths = cv::Mat::zeros(height, width, CV_32FC1);
-    cv::Mat_<cv::Vec3f> normals = cv::Mat::zeros(height, width, CV_32FC3);
-    cv::Mat_<float> costs = cv::Mat::zeros(height, width, CV_32FC1);
-
-
-    for (int col = 0; col < width; ++col) {
-        for (int row = 0; row < height; ++row) {
-            int center = row * width + col;
-            float4 plane_hypothesis = cnvr.GetPlaneHypothesis(center);
-            depths(row, col) = plane_hypothesis.w;
-            normals(row, col) = cv::Vec3f(plane_hypothesis.x, plane_hypothesis.y, plane_hypothesis.z);
-            costs(row, col) = cnvr.GetCost(center);
+    cv::Mat_<float> depths;
+    cv::Mat_<cv::Vec3f> normals;
+    cv::Mat_<float> costs;
+    cv::Mat_<int> selected_views;
+    const std::vector<ReferenceTile> tiles = cnvr.PlanTiles();
+    if (tiles.size() == 1) {
+        cnvr.CudaSpaceInitialization(dense_folder, problem);
+        cnvr.RunPatchMatch();
+        cnvr.GetResultMaps(depths, normals, costs, selected_views);
+    }
+    else {
+        const int width = cnvr.GetReferenceImageWidth();
+        const int height = cnvr.GetReferenceImageHeight();
+        depths.create(height, width);
+        normals.create(height, width);
+        costs.create(height, width);
+        selected_views.create(height, width);
+        for (size_t i = 0; i < tiles.size(); ++i) {
+            std::cout << "Tile " << i + 1 << "/" << tiles.size() << ": " << tiles[i].rect << std::endl;
+            cnvr.CudaSpaceInitialization(dense_folder, problem, tiles[i]);
+            cnvr.RunPatchMatch();
+            cv::Mat_<float> tile_depths;
+            cv::Mat_<cv::Vec3f> tile_normals;
+            cv::Mat_<float> tile_costs;
+            cv::Mat_<int> tile_selected_views;
+            cnvr.GetResultMaps(tile_depths, tile_normals, tile_costs, tile_selected_views);
+            // Keep the core only; the neighbouring tiles own the overlap.
+            const cv::Rect core(tiles[i].core.tl() - tiles[i].rect.tl(), tiles[i].core.size());
+            tile_depths(core).copyTo(depths(tiles[i].core));
+            tile_normals(core).copyTo(normals(tiles[i].core));
+            tile_costs(core).copyTo(costs(tiles[i].core));
+            tile_selected_views(core).copyTo(selected_views(tiles[i].core));
         }
+        cnvr.ReleaseInputMaps();
     }
 
     std::string suffix_depth = "/depths.dmb";
@@ -131,68 +163,107 @@ void ProcessProblem(const std::string &dense_folder, const std::vector<Problem>
         suffix_depth = "/depths_geom.dmb";
         suffix_normal = "/normals_geom.dmb";
     }
-    std::string depth_path = result_folder + suffix_depth;
-    std::string normal_path = result_folder + suffix_normal;
-    std::string cost_path = result_folder + "/costs.dmb";
-    writeDepthDmb(depth_path, depths);
-    writeNormalDmb(normal_path, normals);
-    writeDepthDmb(cost_path, costs);
+    const std::string depth_path = result_folder + suffix_depth;
+    const std::string normal_path = result_folder + suffix_normal;
+    const std::string cost_path = result_folder + "/costs.dmb";
+    const std::string selected_views_path = result_folder + "/selected_views.dmb";
+    const bool store_selected_views = GetMapStorageParams().container;
+    // Geometric maps at full resolution are what the fusion reads, they stay float32.
+    const bool allow_quantized = !(geom_consistency && problem.num_downscale < 0);
+
+    std::vector<std::string> file_paths;
+    file_paths.push_back(depth_path);
+    file_paths.push_back(normal_path);
+    file_paths.push_back(cost_path);
+    if (store_selected_views) {
+        file_paths.push_back(selected_views_path);
+    }
+    // The job owns the maps, the next problem starts while they are written.
+    map_writer.Enqueue(file_paths, [=]() {
+        int status = 0;
+        status |= writeDepthDmb(depth_path, depths, allow_quantized);
+        status |= writeNormalDmb(normal_path, normals, allow_quantized);
+        status |= writeDepthDmb(cost_path, costs);
+        if (store_selected_views) {
+            status |= writeMaskDmb(selected_views_path, selected_views);
+        }
+        return status;
+    });
     std::cout << "Processing image " << std::setw(8) << std::setfill('0') << problem.ref_image_id << " done!" << std::endl;
+    return cnvr.PassConverged();
 }
 
-void JointBilateralUpsampling(const std::string &dense_folder, const Problem &problem, int cnvr_size)
+// Geometric consistency passes of one scale, the first one against the
+// photometric maps and the others against the geometric ones. A view whose
+// pass converged under the adaptive schedule skips the remaining passes.
+void RunGeomPasses(const std::string &dense_folder, const std::vector<Problem> &problems, AsyncMapWriter &map_writer, CNVRWorkspace &workspace, const ProblemOptions &options, const int geom_iterations)
 {
-    std::stringstream result_path;
-    result_path << dense_folder << "/CNVR" << "/2333_" << std::setw(8) << std::setfill('0') << problem.ref_image_id;
-    std::string result_folder = result_path.str();
-    std::string depth_path = result_folder + "/depths_geom.dmb";
-    cv::Mat_<float> ref_depth;
-    readDepthDmb(depth_path, ref_depth);
+    const size_t num_images = problems.size();
+    const bool geom_consistency = true;
+    const bool hierarchy = false;
+    const bool repair = false;
+    std::vector<bool> geom_converged(num_images, false);
+    for (int geom_iter = 0; geom_iter < geom_iterations; ++geom_iter) {
+        const bool multi_geometry = geom_iter > 0;
+        for (size_t i = 0; i < num_images; ++i) {
+            if (geom_converged[i]) {
+                std::cout << "Image " << std::setw(8) << std::setfill('0') << problems[i].ref_image_id << " converged, geom pass " << geom_iter << " skipped" << std::endl;
+                continue;
+            }
+            geom_converged[i] = ProcessProblem(dense_folder, problems, i, map_writer, workspace, options, geom_consistency, hierarchy, repair, multi_geometry);
+        }
+    }
+}
 
-    std::string image_folder = dense_folder + std::string("/images");
-    std::stringstream image_path;
-    image_path << image_folder << "/" << std::setw(8) << std::setfill('0') << problem.ref_image_id << ".jpg";
-    cv::Mat_<uint8_t> image_uint = cv::imread(image_path.str(), cv::IMREAD_GRAYSCALE);
-    cv::Mat image_float;
-    image_uint.convertTo(image_float, CV_32FC1);
-    const float factor_x = static_cast<float>(cnvr_size) / image_float.cols;
-    const float factor_y = static_cast<float>(cnvr_size) / image_float.rows;
-    const float factor = factor_x < factor_y ? factor_x : factor_y;
-
-    const int new_cols = std::round(image_float.cols * factor);
-    const int new_rows = std::round(image_float.rows * factor);
-    cv::Mat scaled_image_float;
-    cv::resize(image_float, scaled_image_float, cv::Size(new_cols,new_rows), 0, 0, cv::INTER_LINEAR);
-
-    std::cout << "Run JBU for image " << problem.ref_image_id <<  ".jpg" << std::endl;
-    RunJBU(scaled_image_float, ref_depth, dense_folder, problem );
+static bool InsideBounds(const float3 &X, const float3 &bound_min, const float3 &bound_max, const float margin)
+{
+    return X.x >= bound_min.x - margin && X.x < bound_max.x + margin &&
+           X.y >= bound_min.y - margin && X.y < bound_max.y + margin &&
+           X.z >= bound_min.z - margin && X.z < bound_max.z + margin;
 }
 
-void RunFusion(std::string &dense_folder, const std::vector<Problem> &problems, bool geom_consistency)
+// Fuses the depth maps of all views, or only the views of one spatial chunk.
+// A chunk also fuses the pixels within its overlap margin so that the masking
+// decisions near its boundary match the neighbouring chunks, but it only keeps
+// the points whose reference pixel lies inside its own half-open bounds.
+void FuseDepthMaps(const std::string &dense_folder, const std::vector<Problem> &problems, bool geom_consistency, const FusionChunk *chunk, std::vector<PointList> &PointCloud)
 {
     size_t num_images = problems.size();
     std::string image_folder = dense_folder + std::string("/images");
-    std::string cam_folder = dense_folder + std::string("/cams");
 
     std::vector<cv::Mat> images;
     std::vector<Camera> cameras;
     std::vector<cv::Mat_<float>> depths;
     std::vector<cv::Mat_<cv::Vec3f>> normals;
     std::vector<cv::Mat> masks;
+    std::vector<MappedFileHandle> mapped_dmbs;
     images.clear();
     cameras.clear();
     depths.clear();
     normals.clear();
     masks.clear();
 
+    std::vector<bool> load_view(num_images, chunk == NULL);
+    if (chunk) {
+        for (size_t i = 0; i < chunk->view_ids.size(); ++i) {
+            load_view[chunk->view_ids[i]] = true;
+        }
+    }
+
     for (size_t i = 0; i < num_images; ++i) {
+        if (!load_view[i]) {
+            images.push_back(cv::Mat());
+            cameras.push_back(Camera());
+            depths.push_back(cv::Mat_<float>());
+            normals.push_back(cv::Mat_<cv::Vec3f>());
+            masks.push_back(cv::Mat());
+            continue;
+        }
         std::cout << "Reading image " << std::setw(8) << std::setfill('0') << i << "..." << std::endl;
         std::stringstream image_path;
         image_path << image_folder << "/" << std::setw(8) << std::setfill('0') << problems[i].ref_image_id << ".jpg";
         cv::Mat_<cv::Vec3b> image = cv::imread (image_path.str(), cv::IMREAD_COLOR);
-        std::stringstream cam_path;
-        cam_path << cam_folder << "/" << std::setw(8) << std::setfill('0') << problems[i].ref_image_id << "_cam.txt";
-        Camera camera = ReadCamera(cam_path.str());
+        Camera camera = GetSceneCamera(problems[i].ref_image_id);
 
         std::stringstream result_path;
         result_path << dense_folder << "/CNVR" << "/2333_" << std::setw(8) << std::setfill('0') << problems[i].ref_image_id;
@@ -207,8 +278,11 @@ void RunFusion(std::string &dense_folder, const std::vector<Problem> &problems,
         std::string normal_path = result_folder + suffix_normal;
         cv::Mat_<float> depth;
         cv::Mat_<cv::Vec3f> normal;
-        readDepthDmb(depth_path, depth);
-        readNormalDmb(normal_path, normal);
+        MappedFileHandle depth_handle, normal_handle;
+        mapDepthDmb(depth_path, depth, depth_handle);
+        mapNormalDmb(normal_path, normal, normal_handle);
+        mapped_dmbs.push_back(depth_handle);
+        mapped_dmbs.push_back(normal_handle);
 
         cv::Mat_<cv::Vec3b> scaled_image;
         RescaleImageAndCamera(image, scaled_image, depth, camera);
@@ -220,10 +294,12 @@ void RunFusion(std::string &dense_folder, const std::vector<Problem> &problems,
         masks.push_back(mask);
     }
 
-    std::vector<PointList> PointCloud;
     PointCloud.clear();
 
     for (size_t i = 0; i < num_images; ++i) {
+        if (depths[i].empty()) {
+            continue;
+        }
         std::cout << "Fusing image " << std::setw(8) << std::setfill('0') << i << "..." << std::endl;
         const int cols = depths[i].cols;
         const int rows = depths[i].rows;
@@ -240,6 +316,8 @@ void RunFusion(std::string &dense_folder, const std::vector<Problem> &problems,
                     continue;
 
                 float3 PointX = Get3DPointonWorld(c, r, ref_depth, cameras[i]);
+                if (chunk && !InsideBounds(PointX, chunk->bound_min, chunk->bound_max, chunk->margin))
+                    continue;
                 float3 consistent_Point = PointX;
                 //cv::Vec3f consistent_normal = ref_normal;
                 float consistent_Color[3] = {(float)images[i].at<cv::Vec3b>(r, c)[0], (float)images[i].at<cv::Vec3b>(r, c)[1], (float)images[i].at<cv::Vec3b>(r, c)[2]};
@@ -247,6 +325,8 @@ void RunFusion(std::string &dense_folder, const std::vector<Problem> &problems,
 
                 for (int j = 0; j < num_ngb; ++j) {
                     int src_id = problems[i].src_image_ids[j];
+                    if (depths[src_id].empty())
+                        continue;
                     const int src_cols = depths[src_id].cols;
                     const int src_rows = depths[src_id].rows;
                     float2 point;
@@ -299,7 +379,8 @@ void RunFusion(std::string &dense_folder, const std::vector<Problem> &problems,
                     point3D.coord = consistent_Point;
                     //point3D.normal = make_float3(consistent_normal[0], consistent_normal[1], consistent_normal[2]);
                     point3D.color = make_float3(consistent_Color[0], consistent_Color[1], consistent_Color[2]);
-                    PointCloud.push_back(point3D);
+                    if (!chunk || InsideBounds(PointX, chunk->bound_min, chunk->bound_max, 0.0f))
+                        PointCloud.push_back(point3D);
 
                     for (int j = 0; j < num_ngb; ++j) {
                         if (used_list[j].x == -1)
@@ -311,20 +392,407 @@ void RunFusion(std::string &dense_folder, const std::vector<Problem> &problems,
         }
     }
 
+}
+
+void RunFusion(std::string &dense_folder, const std::vector<Problem> &problems, bool geom_consistency)
+{
+    std::vector<PointList> PointCloud;
+    FuseDepthMaps(dense_folder, problems, geom_consistency, NULL, PointCloud);
+
     std::string ply_path = dense_folder + "/CNVR/CNVR_model.ply";
     StoreColorPlyFileBinaryPointCloud (ply_path, PointCloud);
 }
 
+static bool FrustumIntersectsBox(const Camera &camera, const int width, const int height, const float3 &box_min, const float3 &box_max)
+{
+    const float near_depth = camera.depth_min * 0.6f;
+    const float far_depth = camera.depth_max * 1.4f;
+    int outside[6] = {0, 0, 0, 0, 0, 0};
+    for (int k = 0; k < 8; ++k) {
+        float3 X;
+        X.x = (k & 1) ? box_max.x : box_min.x;
+        X.y = (k & 2) ? box_max.y : box_min.y;
+        X.z = (k & 4) ? box_max.z : box_min.z;
+        float3 tmp;
+        tmp.x = camera.R[0] * X.x + camera.R[1] * X.y + camera.R[2] * X.z + camera.t[0];
+        tmp.y = camera.R[3] * X.x + camera.R[4] * X.y + camera.R[5] * X.z + camera.t[1];
+        tmp.z = camera.R[6] * X.x + camera.R[7] * X.y + camera.R[8] * X.z + camera.t[2];
+        // Homogeneous image coordinates, so every frustum side is a linear half-space.
+        const float u = camera.K[0] * tmp.x + camera.K[1] * tmp.y + camera.K[2] * tmp.z;
+        const float v = camera.K[4] * tmp.y + camera.K[5] * tmp.z;
+        outside[0] += tmp.z < near_depth;
+        outside[1] += tmp.z > far_depth;
+        outside[2] += u < 0.0f;
+        outside[3] += u > width * tmp.z;
+        outside[4] += v < 0.0f;
+        outside[5] += v > height * tmp.z;
+    }
+    for (int p = 0; p < 6; ++p) {
+        if (outside[p] == 8) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::vector<FusionChunk> PartitionScene(const std::vector<Problem> &problems, const int num_chunks)
+{
+    size_t num_images = problems.size();
+    std::vector<Camera> cameras(num_images);
+    std::vector<int2> image_sizes(num_images);
+    std::vector<float> far_depths;
+    float3 scene_min = make_float3(FLT_MAX, FLT_MAX, FLT_MAX);
+    float3 scene_max = make_float3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    for (size_t i = 0; i < num_images; ++i) {
+        cameras[i] = GetSceneCamera(problems[i].ref_image_id);
+        image_sizes[i] = make_int2(cameras[i].width, cameras[i].height);
+        far_depths.push_back(cameras[i].depth_max);
+
+        // The reconstruction of a view lies between the planes of its search range.
+        const float frustum_depths[2] = {cameras[i].depth_min * 0.6f, cameras[i].depth_max * 1.4f};
+        for (int k = 0; k < 8; ++k) {
+            const int x = (k & 1) ? image_sizes[i].x : 0;
+            const int y = (k & 2) ? image_sizes[i].y : 0;
+            float3 X = Get3DPointonWorld(x, y, frustum_depths[k >> 2], cameras[i]);
+            scene_min = make_float3(std::min(scene_min.x, X.x), std::min(scene_min.y, X.y), std::min(scene_min.z, X.z));
+            scene_max = make_float3(std::max(scene_max.x, X.x), std::max(scene_max.y, X.y), std::max(scene_max.z, X.z));
+        }
+    }
+
+    // The overlap must exceed the 2% relative depth tolerance of the consistency check.
+    std::nth_element(far_depths.begin(), far_depths.begin() + far_depths.size() / 2, far_depths.end());
+    const float margin = 0.02f * far_depths[far_depths.size() / 2];
+
+    // Split the axis with the longest cells until there are enough chunks.
+    const float extent[3] = {scene_max.x - scene_min.x, scene_max.y - scene_min.y, scene_max.z - scene_min.z};
+    int dims[3] = {1, 1, 1};
+    while (dims[0] * dims[1] * dims[2] < num_chunks) {
+        int axis = 0;
+        for (int a = 1; a < 3; ++a) {
+            if (extent[a] / dims[a] > extent[axis] / dims[axis]) {
+                axis = a;
+            }
+        }
+        dims[axis]++;
+    }
+    std::cout << "Partition scene into " << dims[0] << " x " << dims[1] << " x " << dims[2] << " chunks" << std::endl;
+
+    std::vector<FusionChunk> chunks;
+    for (int z = 0; z < dims[2]; ++z) {
+        for (int y = 0; y < dims[1]; ++y) {
+            for (int x = 0; x < dims[0]; ++x) {
+                FusionChunk chunk;
+                chunk.id = (int)chunks.size();
+                chunk.margin = margin;
+                chunk.bound_min = make_float3(scene_min.x + extent[0] * x / dims[0], scene_min.y + extent[1] * y / dims[1], scene_min.z + extent[2] * z / dims[2]);
+                chunk.bound_max = make_float3(scene_min.x + extent[0] * (x + 1) / dims[0], scene_min.y + extent[1] * (y + 1) / dims[1], scene_min.z + extent[2] * (z + 1) / dims[2]);
+                // The outermost chunks are open towards the outside of the scene.
+                if (x == dims[0] - 1) chunk.bound_max.x = FLT_MAX;
+                if (y == dims[1] - 1) chunk.bound_max.y = FLT_MAX;
+                if (z == dims[2] - 1) chunk.bound_max.z = FLT_MAX;
+                if (x == 0) chunk.bound_min.x = -FLT_MAX;
+                if (y == 0) chunk.bound_min.y = -FLT_MAX;
+                if (z == 0) chunk.bound_min.z = -FLT_MAX;
+
+                const float3 test_min = make_float3(std::max(chunk.bound_min.x, scene_min.x) - margin, std::max(chunk.bound_min.y, scene_min.y) - margin, std::max(chunk.bound_min.z, scene_min.z) - margin);
+                const float3 test_max = make_float3(std::min(chunk.bound_max.x, scene_max.x) + margin, std::min(chunk.bound_max.y, scene_max.y) + margin, std::min(chunk.bound_max.z, scene_max.z) + margin);
+                for (size_t i = 0; i < num_images; ++i) {
+                    if (FrustumIntersectsBox(cameras[i], image_sizes[i].x, image_sizes[i].y, test_min, test_max)) {
+                        chunk.view_ids.push_back((int)i);
+                    }
+                }
+                if (!chunk.view_ids.empty()) {
+                    chunks.push_back(chunk);
+                }
+            }
+        }
+    }
+    return chunks;
+}
+
+static std::string ChunkPlyName(const int id)
+{
+    std::stringstream ply_name;
+    ply_name << "chunk_" << std::setw(4) << std::setfill('0') << id << ".ply";
+    return ply_name.str();
+}
+
+void WriteChunkIndex(const std::string &index_path, const std::vector<FusionChunk> &chunks)
+{
+    std::ofstream file(index_path);
+    file << std::setprecision(9);
+    file << chunks.size() << std::endl;
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        const FusionChunk &chunk = chunks[i];
+        file << chunk.id << " " << ChunkPlyName(chunk.id) << " "
+             << chunk.bound_min.x << " " << chunk.bound_min.y << " " << chunk.bound_min.z << " "
+             << chunk.bound_max.x << " " << chunk.bound_max.y << " " << chunk.bound_max.z << " "
+             << chunk.margin << " " << chunk.view_ids.size();
+        for (size_t j = 0; j < chunk.view_ids.size(); ++j) {
+            file << " " << chunk.view_ids[j];
+        }
+        file << std::endl;
+    }
+}
+
+bool ReadChunkIndex(const std::string &index_path, std::vector<FusionChunk> &chunks)
+{
+    std::ifstream file(index_path);
+    if (!file.is_open()) {
+        std::cout << "Error opening file " << index_path << std::endl;
+        return false;
+    }
+
+    size_t num_chunks = 0;
+    file >> num_chunks;
+    chunks.resize(num_chunks);
+    for (size_t i = 0; i < num_chunks; ++i) {
+        FusionChunk &chunk = chunks[i];
+        std::string ply_name;
+        size_t num_views = 0;
+        file >> chunk.id >> ply_name
+             >> chunk.bound_min.x >> chunk.bound_min.y >> chunk.bound_min.z
+             >> chunk.bound_max.x >> chunk.bound_max.y >> chunk.bound_max.z
+             >> chunk.margin >> num_views;
+        chunk.view_ids.resize(num_views);
+        for (size_t j = 0; j < num_views; ++j) {
+            file >> chunk.view_ids[j];
+        }
+    }
+    return !file.fail();
+}
+
+int RunChunkFusion(std::string &dense_folder, const std::vector<Problem> &problems, const int chunk_id)
+{
+    std::string chunk_folder = dense_folder + "/CNVR/chunks";
+    std::vector<FusionChunk> chunks;
+    if (!ReadChunkIndex(chunk_folder + "/index.txt", chunks)) {
+        return -1;
+    }
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        if (chunks[i].id != chunk_id) {
+            continue;
+        }
+        std::cout << "Fusing chunk " << chunk_id << " from " << chunks[i].view_ids.size() << " views" << std::endl;
+        std::vector<PointList> PointCloud;
+        FuseDepthMaps(dense_folder, problems, true, &chunks[i], PointCloud);
+        StoreColorPlyFileBinaryPointCloud(chunk_folder + "/" + ChunkPlyName(chunk_id), PointCloud);
+        return 0;
+    }
+    std::cout << "Chunk " << chunk_id << " not found in the chunk index" << std::endl;
+    return -1;
+}
+
+// Partitions the scene into spatial chunks and fuses every chunk in its own
+// process, so no process holds more than the views of one chunk in memory.
+// Returns the number of chunks that failed.
+int RunPartitionedFusion(const std::string &executable, std::string &dense_folder, const std::vector<Problem> &problems, const int num_chunks, const int num_jobs)
+{
+    std::vector<FusionChunk> chunks = PartitionScene(problems, num_chunks);
+
+    std::string chunk_folder;
+#if defined(_WIN32)
+    chunk_folder = dense_folder + std::string("\\CNVR\\chunks");
+    std::string command = "mkdir " + chunk_folder;
+    if(_access(chunk_folder.c_str(), 0) != 0){
+        system(command.c_str());
+    }
+#else
+    chunk_folder = dense_folder + std::string("/CNVR/chunks");
+    mkdir ( chunk_folder.c_str(), 0777 );
+#endif
+    WriteChunkIndex(dense_folder + "/CNVR/chunks/index.txt", chunks);
+
+    const MapStorageParams storage_params = GetMapStorageParams();
+    std::atomic<int> next_chunk(0);
+    std::vector<int> status(chunks.size(), 0);
+    std::vector<std::thread> workers;
+    for (int j = 0; j < std::max(1, num_jobs); ++j) {
+        workers.push_back(std::thread([&]() {
+            while (true) {
+                const int k = next_chunk++;
+                if (k >= (int)chunks.size()) {
+                    break;
+                }
+                std::stringstream chunk_command;
+                chunk_command << "\"" << executable << "\" \"" << dense_folder << "\" --fuse_chunk " << chunks[k].id;
+                // The child has to read the maps from the same storage as this run.
+                if (storage_params.container) {
+                    chunk_command << " --map_container";
+                }
+                if (storage_params.quantized) {
+                    chunk_command << " --quantized_maps";
+                }
+#if defined(_WIN32)
+                // cmd.exe strips the outermost pair of quotes.
+                status[k] = system(("\"" + chunk_command.str() + "\"").c_str());
+#else
+                status[k] = system(chunk_command.str().c_str());
+#endif
+            }
+        }));
+    }
+    for (size_t j = 0; j < workers.size(); ++j) {
+        workers[j].join();
+    }
+
+    int num_failed = 0;
+    for (size_t k = 0; k < chunks.size(); ++k) {
+        if (status[k] != 0) {
+            std::cout << "Fusion of chunk " << chunks[k].id << " failed with status " << status[k] << std::endl;
+            num_failed++;
+        }
+    }
+    std::cout << "Fused " << chunks.size() - num_failed << " of " << chunks.size() << " chunks into " << dense_folder << "/CNVR/chunks" << std::endl;
+    return num_failed;
+}
+
+int ConvertMapsToContainers(const std::string &dense_folder, const std::vector<Problem> &problems)
+{
+    int num_failed = 0;
+    for (size_t i = 0; i < problems.size(); ++i) {
+        std::stringstream result_path;
+        result_path << dense_folder << "/CNVR" << "/2333_" << std::setw(8) << std::setfill('0') << problems[i].ref_image_id;
+        const int num_layers = ConvertDmbToContainer(result_path.str());
+        if (num_layers < 0) {
+            num_failed++;
+            continue;
+        }
+        std::cout << "Packed " << num_layers << " maps of image " << std::setw(8) << std::setfill('0') << problems[i].ref_image_id << std::endl;
+    }
+    if (num_failed > 0) {
+        std::cout << num_failed << " map containers could not be written" << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
 int main(int argc, char** argv)
 {
     if (argc < 2) {
-        std::cout << "USAGE: CNVR dense_folder" << std::endl;
+        std::cout << "USAGE: CNVR dense_folder [--fusion_only] [--tsdf] [--tsdf_mesh] [--tsdf_voxel size] [--chunks n] [--fusion_jobs n] [--map_container] [--quantized_maps] [--convert_maps] [--write_queue n] [--colmap colmap_dense_folder] [--tile_budget MB] [--max_image_size n] [--depth_bounds] [--sparse_prior] [--cost_cache MB] [--cascade] [--source_pyramids] [--image_storage float|fp16|uint8] [--adaptive]" << std::endl;
         return -1;
     }
 
     std::string dense_folder = argv[1];
+    bool tsdf_fusion = false;
+    bool fusion_only = false;
+    TSDFParams tsdf_params;
+    int num_chunks = 1;
+    int num_fusion_jobs = 2;
+    int fuse_chunk = -1;
+    bool convert_maps = false;
+    int write_queue_size = 4;
+    std::string colmap_folder;
+    ProblemOptions options;
+    int max_image_size = PatchMatchParams().max_image_size;
+    MapStorageParams storage_params;
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--fusion_only") {
+            fusion_only = true;
+        }
+        else if (arg == "--chunks" && i + 1 < argc) {
+            num_chunks = atoi(argv[++i]);
+        }
+        else if (arg == "--fusion_jobs" && i + 1 < argc) {
+            num_fusion_jobs = atoi(argv[++i]);
+        }
+        else if (arg == "--fuse_chunk" && i + 1 < argc) {
+            fuse_chunk = atoi(argv[++i]);
+        }
+        else if (arg == "--tsdf") {
+            tsdf_fusion = true;
+        }
+        else if (arg == "--tsdf_mesh") {
+            tsdf_fusion = true;
+            tsdf_params.mesh = true;
+        }
+        else if (arg == "--tsdf_voxel" && i + 1 < argc) {
+            tsdf_fusion = true;
+            tsdf_params.voxel_size = atof(argv[++i]);
+        }
+        else if (arg == "--map_container") {
+            storage_params.container = true;
+        }
+        else if (arg == "--write_queue" && i + 1 < argc) {
+            write_queue_size = atoi(argv[++i]);
+        }
+        else if (arg == "--quantized_maps") {
+            storage_params.quantized = true;
+        }
+        else if (arg == "--colmap" && i + 1 < argc) {
+            colmap_folder = argv[++i];
+        }
+        else if (arg == "--tile_budget" && i + 1 < argc) {
+            options.tile_budget = atoi(argv[++i]);
+        }
+        else if (arg == "--depth_bounds") {
+            options.depth_bounds = true;
+        }
+        else if (arg == "--sparse_prior") {
+            options.sparse_prior = true;
+        }
+        else if (arg == "--cost_cache" && i + 1 < argc) {
+            options.cost_cache_budget = atoi(argv[++i]);
+        }
+        else if (arg == "--cascade") {
+            options.cascade = true;
+        }
+        else if (arg == "--source_pyramids") {
+            options.source_pyramids = true;
+        }
+        else if (arg == "--image_storage" && i + 1 < argc) {
+            const std::string storage = argv[++i];
+            if (storage == "uint8") {
+                options.image_storage = IMAGE_STORAGE_UINT8;
+            }
+            else if (storage == "fp16") {
+                options.image_storage = IMAGE_STORAGE_HALF;
+            }
+            else if (storage == "float") {
+                options.image_storage = IMAGE_STORAGE_FLOAT;
+            }
+            else {
+                std::cout << "Unknown image storage " << storage << ", use float, fp16 or uint8" << std::endl;
+                return -1;
+            }
+        }
+        else if (arg == "--adaptive") {
+            options.adaptive = true;
+        }
+        else if (arg == "--max_image_size" && i + 1 < argc) {
+            max_image_size = atoi(argv[++i]);
+        }
+        else if (arg == "--convert_maps") {
+            convert_maps = true;
+        }
+        else {
+            std::cout << "Unknown option " << arg << std::endl;
+            return -1;
+        }
+    }
+
+    SetMapStorageParams(storage_params);
+
     std::vector<Problem> problems;
-    GenerateSampleList(dense_folder, problems);
+    if (!colmap_folder.empty() && !CNVR::Colmap2MVS(colmap_folder, dense_folder, problems)) {
+        std::cout << "Error converting the COLMAP model in " << colmap_folder << std::endl;
+        return -1;
+    }
+    if (!LoadSceneManifest(dense_folder)) {
+        std::cout << "Error loading the scene in " << dense_folder << std::endl;
+        return -1;
+    }
+    if (colmap_folder.empty()) {
+        GenerateSampleList(problems);
+    }
+    if (convert_maps) {
+        return ConvertMapsToContainers(dense_folder, problems);
+    }
+    if (fuse_chunk >= 0) {
+        return RunChunkFusion(dense_folder, problems, fuse_chunk);
+    }
     std::string output_folder; 
     
 #if defined(_WIN32)
@@ -342,13 +810,14 @@ int main(int argc, char** argv)
     std::cout << "There are " << num_images << " problems needed to be processed!" << std::endl;
     std::cout <<"change center cost" <<std::endl ;
 
-    int max_num_downscale = ComputeMultiScaleSettings(dense_folder, problems);
+    int max_num_downscale = fusion_only ? -1 : ComputeMultiScaleSettings(problems, max_image_size);
 
+     AsyncMapWriter map_writer(std::max(write_queue_size, 1));
+     CNVRWorkspace workspace;
      int flag = 0;
      int geom_iterations = 2;
      bool geom_consistency = false;
      bool hierarchy = false;
-     bool multi_geometry = false;
      bool repair = false;
      while (max_num_downscale >= 0) {
         std::cout << "Scale: " << max_num_downscale << std::endl;
@@ -365,51 +834,41 @@ int main(int argc, char** argv)
             geom_consistency = false;
             repair = false;
             for (size_t i = 0; i < num_images; ++i) {
-                ProcessProblem(dense_folder, problems, i, geom_consistency ,hierarchy, repair);
-            }
-            geom_consistency = true;
-            for (int geom_iter = 0; geom_iter < geom_iterations; ++geom_iter) {
-                if (geom_iter == 0) {
-                    multi_geometry = false;
-                }
-                else {
-                    multi_geometry = true;
-                }
-                for (size_t i = 0; i < num_images; ++i) {
-                    ProcessProblem(dense_folder,  problems, i, geom_consistency, hierarchy, repair,multi_geometry);
-                }
+                ProcessProblem(dense_folder, problems, i, map_writer, workspace, options, geom_consistency, hierarchy, repair);
             }
+            RunGeomPasses(dense_folder, problems, map_writer, workspace, options, geom_iterations);
         }
         else {
-            for (size_t i = 0; i < num_images; ++i) {
-                JointBilateralUpsampling(dense_folder, problems[i], problems[i].cur_image_size);
-            }
-
             hierarchy = true;
             geom_consistency = false;
             repair = false;
 
             for (size_t i = 0; i < num_images; ++i) {
-                ProcessProblem(dense_folder, problems, i, geom_consistency, hierarchy, repair);
+                ProcessProblem(dense_folder, problems, i, map_writer, workspace, options, geom_consistency, hierarchy, repair);
             }
             hierarchy = false;
-            geom_consistency = true;
-            for (int geom_iter = 0; geom_iter < geom_iterations; ++geom_iter) {
-                if (geom_iter == 0) {
-                    multi_geometry = false;
-                }
-                else {
-                    multi_geometry = true;
-                }
-                for (size_t i = 0; i < num_images; ++i) {
-                    ProcessProblem(dense_folder, problems, i, geom_consistency, hierarchy, repair, multi_geometry);
-                }
-            }
+            RunGeomPasses(dense_folder, problems, map_writer, workspace, options, geom_iterations);
         }
         max_num_downscale--;
     }
+    workspace.PrintStats();
+    const int num_failed_writes = map_writer.Finish();
+    if (num_failed_writes > 0) {
+        std::cout << num_failed_writes << " problems could not write their results" << std::endl;
+        return -1;
+    }
     geom_consistency = true;
-    RunFusion(dense_folder, problems, geom_consistency);
+    if (tsdf_fusion) {
+        RunTSDFFusion(dense_folder, problems, geom_consistency, tsdf_params);
+    }
+    else if (num_chunks > 1) {
+        if (RunPartitionedFusion(argv[0], dense_folder, problems, num_chunks, num_fusion_jobs) > 0) {
+            return -1;
+        }
+    }
+    else {
+        RunFusion(dense_folder, problems, geom_consistency);
+    }
 
     return 0;
 }
@@ -25,6 +25,12 @@
 #include <algorithm>
 #include <map>
 #include <memory>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include "iomanip"
 
 #ifdef WIN32
@@ -38,7 +44,6 @@
 #include <sys/types.h> // mkdir
 
 #define MAX_IMAGES 256
-#define JBU_NUM 2
 
 struct Camera {
     float K[9];
@@ -58,6 +63,14 @@ struct Problem {
     int cur_image_size = 3200;
 };
 
+struct FusionChunk {
+    int id;
+    float3 bound_min;
+    float3 bound_max;
+    float margin; // overlap with the neighbouring chunks
+    std::vector<int> view_ids;
+};
+
 struct PointList {
     float3 coord;
     //float3 normal;
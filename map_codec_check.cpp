@@ -0,0 +1,126 @@
+// Self-check of the quantized map encodings in MapCodec.h (ctest -R map_codec).
+// Exits non-zero when one of the error bounds documented there is violated.
+
+#include "MapCodec.h"
+
+#include <cfloat>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define NUM_SAMPLES 5000000
+
+// Every finite half converts to float and back unchanged, NaNs stay NaNs.
+// NaNs are compared by their bits, std::isnan does not survive -ffast-math.
+static bool CheckHalfRoundTrip()
+{
+    int num_failed = 0;
+    for (uint32_t h = 0; h <= 0xffff; ++h) {
+        const float value = HalfToFloat((uint16_t)h);
+        const uint16_t back = FloatToHalf(value);
+        const bool is_nan = ((h >> 10) & 0x1f) == 31 && (h & 0x3ff) != 0;
+        const bool ok = is_nan ? (((back >> 10) & 0x1f) == 31 && (back & 0x3ff) != 0) : back == h;
+        if (!ok) {
+            if (num_failed < 10) {
+                printf("fp16 round trip failed for 0x%04x: %g -> 0x%04x\n", h, value, back);
+            }
+            ++num_failed;
+        }
+    }
+    printf("fp16 round trip: %d of 65536 codes failed\n", num_failed);
+    return num_failed == 0;
+}
+
+// Normalized depths in [0, 1] come back within 1 / 4096.
+static bool CheckDepthError(std::mt19937 &rng)
+{
+    std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+    double max_error = 0.0;
+    for (int i = 0; i < NUM_SAMPLES; ++i) {
+        const float value = uniform(rng);
+        const double error = fabs((double)HalfToFloat(FloatToHalf(value)) - (double)value);
+        max_error = std::max(max_error, error);
+    }
+    printf("fp16 depth: max error %.3g of the depth range, bound %.3g\n", max_error, 1.0 / 4096.0);
+    return max_error <= 1.0 / 4096.0;
+}
+
+// A depth map with invalid pixels: the zeros come back exactly and stay out of
+// the range, the valid depths come back within 1 / 4096 of their own range
+// plus the float rounding of the decoded depth.
+static bool CheckDepthMapWithHoles(std::mt19937 &rng)
+{
+    std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+    const float depth_min = 20.0f;
+    const float depth_max = 25.0f;
+    std::vector<float> depths(NUM_SAMPLES);
+    float lower = FLT_MAX;
+    float upper = -FLT_MAX;
+    for (int i = 0; i < NUM_SAMPLES; ++i) {
+        depths[i] = uniform(rng) < 0.3f ? 0.0f : depth_min + uniform(rng) * (depth_max - depth_min);
+        if (depths[i] != 0.0f) {
+            lower = std::min(lower, depths[i]);
+            upper = std::max(upper, depths[i]);
+        }
+    }
+    const float scale = upper - lower;
+    const double bound = scale / 4096.0 + upper * FLT_EPSILON;
+    double max_error = 0.0;
+    int num_zero_errors = 0;
+    for (int i = 0; i < NUM_SAMPLES; ++i) {
+        const float decoded = DecodeRangeHalf(EncodeRangeHalf(depths[i], lower, scale), lower, scale);
+        if (depths[i] == 0.0f) {
+            num_zero_errors += decoded != 0.0f;
+        }
+        else {
+            max_error = std::max(max_error, fabs((double)decoded - (double)depths[i]));
+        }
+    }
+    printf("fp16 depth map: range [%g, %g], max error %.6g, bound %.6g, %d invalid pixels changed\n", lower, upper, max_error, bound, num_zero_errors);
+    return max_error <= bound && num_zero_errors == 0;
+}
+
+// Uniformly distributed unit normals come back within 0.96 degrees, 0.34 on average.
+static bool CheckNormalError(std::mt19937 &rng)
+{
+    std::normal_distribution<float> gauss(0.0f, 1.0f);
+    double max_angle = 0.0;
+    double sum_angle = 0.0;
+    for (int i = 0; i < NUM_SAMPLES; ++i) {
+        const float x = gauss(rng);
+        const float y = gauss(rng);
+        const float z = gauss(rng);
+        const float norm = sqrt(x * x + y * y + z * z);
+        if (!(norm > 0.0f)) {
+            --i;
+            continue;
+        }
+        const cv::Vec3f normal(x / norm, y / norm, z / norm);
+        int oct[2];
+        EncodeOctNormal(normal, 127.0f, oct);
+        const int8_t code[2] = { (int8_t)oct[0], (int8_t)oct[1] };
+        const cv::Vec3f decoded = DecodeOctNormal(code);
+        const double cos_angle = (double)normal[0] * decoded[0] + (double)normal[1] * decoded[1] + (double)normal[2] * decoded[2];
+        const double angle = acos(std::max(-1.0, std::min(1.0, cos_angle))) * 180.0 / M_PI;
+        max_angle = std::max(max_angle, angle);
+        sum_angle += angle;
+    }
+    const double mean_angle = sum_angle / NUM_SAMPLES;
+    printf("oct16 normal: max error %.3f deg (bound 0.96), mean %.3f deg (bound 0.34)\n", max_angle, mean_angle);
+    return max_angle < 0.96 && mean_angle < 0.34;
+}
+
+int main()
+{
+    std::mt19937 rng(2333);
+    bool ok = CheckHalfRoundTrip();
+    ok = CheckDepthError(rng) && ok;
+    ok = CheckDepthMapWithHoles(rng) && ok;
+    ok = CheckNormalError(rng) && ok;
+    printf(ok ? "map codec check passed\n" : "map codec check FAILED\n");
+    return ok ? 0 : 1;
+}